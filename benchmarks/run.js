@@ -81,6 +81,14 @@ bm('toBuffer() 1000x1000', 50, function(){
   largeCanvas.toBuffer();
 });
 
+bm('toBuffer() 1000x1000 compressionLevel 1 SUB', 50, function(){
+  largeCanvas.toBuffer('png', { compressionLevel: 1, filters: Canvas.PNG_FILTER_SUB });
+});
+
+bm('toBuffer() 1000x1000 4 threads', 50, function(){
+  largeCanvas.toBuffer('png', { threads: 4 });
+});
+
 bm('toBuffer().toString("base64") 200x200', 50, function(){
   canvas.toBuffer().toString('base64');
 });
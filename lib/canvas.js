@@ -14,9 +14,12 @@ var canvas = require('./bindings')
   , Image = canvas.Image
   , cairoVersion = canvas.cairoVersion
   , PixelArray = canvas.PixelArray
+  , AnimationEncoder = canvas.AnimationEncoder
   , Context2d = require('./context2d')
   , PNGStream = require('./pngstream')
   , JPEGStream = require('./jpegstream')
+  , PDFStream = require('./pdfstream')
+  , SVGStream = require('./svgstream')
   , fs = require('fs');
 
 /**
@@ -44,7 +47,10 @@ exports.cairoVersion = cairoVersion;
 exports.Context2d = Context2d;
 exports.PNGStream = PNGStream;
 exports.JPEGStream = JPEGStream;
+exports.PDFStream = PDFStream;
+exports.SVGStream = SVGStream;
 exports.PixelArray = PixelArray;
+exports.AnimationEncoder = AnimationEncoder;
 exports.Image = Image;
 
 /**
@@ -96,23 +102,25 @@ Canvas.prototype.getContext = function(contextId){
 /**
  * Create a `PNGStream` for `this` canvas.
  *
+ * @param {Object} options
  * @return {PNGStream}
  * @api public
  */
 
-Canvas.prototype.createPNGStream = function(){
-  return new PNGStream(this);
+Canvas.prototype.createPNGStream = function(options){
+  return new PNGStream(this, options || {});
 };
 
 /**
  * Create a synchronous `PNGStream` for `this` canvas.
  *
+ * @param {Object} options
  * @return {PNGStream}
  * @api public
  */
 
-Canvas.prototype.createSyncPNGStream = function(){
-  return new PNGStream(this, true);
+Canvas.prototype.createSyncPNGStream = function(options){
+  return new PNGStream(this, options || {}, true);
 };
 
 /**
@@ -124,7 +132,7 @@ Canvas.prototype.createSyncPNGStream = function(){
  */
 
 Canvas.prototype.createJPEGStream = function(options){
-  return this.createSyncJPEGStream(options);
+  return new JPEGStream(this, jpegOptions(options));
 };
 
 /**
@@ -136,41 +144,70 @@ Canvas.prototype.createJPEGStream = function(options){
  */
 
 Canvas.prototype.createSyncJPEGStream = function(options){
-  options = options || {};
-  return new JPEGStream(this, {
-      bufsize: options.bufsize || 4096
-    , quality: options.quality || 75
-  });
+  return new JPEGStream(this, jpegOptions(options), true);
 };
 
 /**
- * Return a data url. Pass a function for async support.
+ * Create a `PDFStream` for `this` PDF canvas.
  *
- * @param {String|Function} type
- * @param {Function} fn
- * @return {String}
+ * @return {PDFStream}
  * @api public
  */
 
-Canvas.prototype.toDataURL = function(type, fn){
-  // Default to png
-  type = type || 'image/png';
+Canvas.prototype.createPDFStream = function(){
+  return new PDFStream(this);
+};
 
-  // Allow callback as first arg
-  if ('function' == typeof type) fn = type, type = 'image/png';
+/**
+ * Create a `SVGStream` for `this` SVG canvas.
+ *
+ * @return {SVGStream}
+ * @api public
+ */
 
-  // Throw on non-png
-  if ('image/png' != type) throw new Error('currently only image/png is supported');
+Canvas.prototype.createSVGStream = function(){
+  return new SVGStream(this);
+};
 
-  var prefix = 'data:' + type + ';base64,';
+/**
+ * Create an `AnimationEncoder` for `this` canvas, each
+ * `addFrame()` appends the canvas as it is drawn at the
+ * time. Options:
+ *
+ *   - `format` "apng" (default) or "gif"
+ *   - `delay` frame delay in milliseconds, 100
+ *   - `loop` times to play, 0 loops forever
+ *   - `colors` GIF palette size, 256
+ *   - `palette` "local" or "shared" GIF palette
+ *   - `dither` diffuse the GIF palette's color error
+ *   - `compressionLevel` APNG zlib level 0-9
+ *
+ * @param {Object} options
+ * @return {AnimationEncoder}
+ * @api public
+ */
 
-  if (fn) {
-    this.toBuffer(function(err, buf){
-      if (err) return fn(err);
-      var str = 'data:' + type
-      fn(null, prefix + buf.toString('base64'));
-    });
-  } else {
-    return prefix + this.toBuffer().toString('base64');
-  }
+Canvas.prototype.createAnimationEncoder = function(options){
+  var encoder = new AnimationEncoder(this, options || {});
+  encoder.canvas = this;
+  return encoder;
 };
+
+/**
+ * Copy JPEG stream `options`, applying the defaults.
+ *
+ * @param {Object} options
+ * @return {Object}
+ * @api private
+ */
+
+function jpegOptions(options) {
+  var ret = { bufsize: 4096, quality: 75 };
+  options = options || {};
+  for (var key in options) {
+    if (null != options[key]) ret[key] = options[key];
+  }
+  ret.bufsize = ret.bufsize || 4096;
+  ret.quality = ret.quality || 75;
+  return ret;
+}
@@ -23,6 +23,11 @@ var Stream = require('stream').Stream;
  *
  *     stream.pipe(out);
  *
+ * Async streams honor `pause()`, so a slow destination throttles
+ * encoding: output is merged into `options.chunkSize` byte chunks
+ * (16kb) and encoding waits while `options.highWaterMark` bytes
+ * (64kb) are waiting to be consumed.
+ *
  * @param {Canvas} canvas
  * @param {Boolean} sync
  * @api public
@@ -37,10 +42,12 @@ var JPEGStream = module.exports = function JPEGStream(canvas, options, sync) {
   this.sync = sync;
   this.canvas = canvas;
   this.readable = true;
-  // TODO: implement async
-  if ('streamJPEG' == method) method = 'streamJPEGSync';
+  this.paused = false;
+  // async streaming requires node >= 0.6
+  if (!canvas[method]) method = 'streamJPEGSync';
   process.nextTick(function(){
-    canvas[method](options.bufsize, options.quality, function(err, chunk, len){
+    if (!self.readable) return;
+    self.control = canvas[method](options, function(err, chunk, len){
       if (err) {
         self.emit('error', err);
         self.readable = false;
@@ -51,6 +58,7 @@ var JPEGStream = module.exports = function JPEGStream(canvas, options, sync) {
         self.readable = false;
       }
     });
+    if (self.paused) self.pause();
   });
 };
 
@@ -59,3 +67,37 @@ var JPEGStream = module.exports = function JPEGStream(canvas, options, sync) {
  */
 
 JPEGStream.prototype.__proto__ = Stream.prototype;
+
+/**
+ * Stop emitting "data" events, encoding waits once
+ * `highWaterMark` bytes are queued.
+ *
+ * @api public
+ */
+
+JPEGStream.prototype.pause = function(){
+  this.paused = true;
+  if (this.control) this.control.pause();
+};
+
+/**
+ * Resume emitting "data" events.
+ *
+ * @api public
+ */
+
+JPEGStream.prototype.resume = function(){
+  this.paused = false;
+  if (this.control) this.control.resume();
+};
+
+/**
+ * Abort encoding, no further events are emitted.
+ *
+ * @api public
+ */
+
+JPEGStream.prototype.destroy = function(){
+  this.readable = false;
+  if (this.control) this.control.destroy();
+};
\ No newline at end of file
@@ -0,0 +1,80 @@
+
+/*!
+ * Canvas - PDFStream
+ * Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+ * MIT Licensed
+ */
+
+/**
+ * Module dependencies.
+ */
+
+var Stream = require('stream').Stream;
+
+/**
+ * Initialize a `PDFStream` with the given PDF `canvas`.
+ *
+ * "data" events are emitted with `Buffer` chunks as each page
+ * is added, so only the page being drawn is held in memory.
+ * Call `end()` once the last page is drawn, the document is
+ * then finished on the thread pool and the "end" event is
+ * emitted. The following example will stream to a file named
+ * "./my.pdf".
+ *
+ *     var out = fs.createWriteStream(__dirname + '/my.pdf')
+ *       , stream = canvas.createPDFStream();
+ *
+ *     stream.pipe(out);
+ *     // draw, ctx.addPage(), draw...
+ *     stream.end();
+ *
+ * @param {Canvas} canvas
+ * @api public
+ */
+
+var PDFStream = module.exports = function PDFStream(canvas) {
+  var self = this;
+  this.canvas = canvas;
+  this.readable = true;
+  process.nextTick(function(){
+    canvas[self.streamMethod](function(err, chunk, len){
+      if (err) {
+        self.emit('error', err);
+        self.readable = false;
+      } else if (len) {
+        self.emit('data', chunk, len);
+      } else {
+        self.emit('end');
+        self.readable = false;
+      }
+    });
+  });
+};
+
+/**
+ * Inherit from `EventEmitter`.
+ */
+
+PDFStream.prototype.__proto__ = Stream.prototype;
+
+/**
+ * Canvas methods driving the stream.
+ */
+
+PDFStream.prototype.streamMethod = 'streamPDF';
+PDFStream.prototype.endMethod = 'endPDF';
+
+/**
+ * Finish the document, "end" is emitted once
+ * the remaining data has been emitted.
+ *
+ * @api public
+ */
+
+PDFStream.prototype.end = function(){
+  var canvas = this.canvas
+    , method = this.endMethod;
+  process.nextTick(function(){
+    canvas[method]();
+  });
+};
@@ -23,23 +23,34 @@ var Stream = require('stream').Stream;
  *
  *     stream.pipe(out);
  *
+ * Async streams honor `pause()`, so a slow destination throttles
+ * encoding: output is merged into `options.chunkSize` byte chunks
+ * (16kb) and encoding waits while `options.highWaterMark` bytes
+ * (64kb) are waiting to be consumed.
+ *
  * @param {Canvas} canvas
+ * @param {Object} options
  * @param {Boolean} sync
  * @api public
  */
 
-var PNGStream = module.exports = function PNGStream(canvas, sync) {
+var PNGStream = module.exports = function PNGStream(canvas, options, sync) {
+  if ('boolean' == typeof options) sync = options, options = null;
+  options = options || {};
   var self = this
     , method = sync
       ? 'streamPNGSync'
       : 'streamPNG';
+  this.options = options;
   this.sync = sync;
   this.canvas = canvas;
   this.readable = true;
-  // TODO: implement async
-  if ('streamPNG' == method) method = 'streamPNGSync';
+  this.paused = false;
+  // async streaming requires node >= 0.6
+  if (!canvas[method]) method = 'streamPNGSync';
   process.nextTick(function(){
-    canvas[method](function(err, chunk, len){
+    if (!self.readable) return;
+    self.control = canvas[method](options, function(err, chunk, len){
       if (err) {
         self.emit('error', err);
         self.readable = false;
@@ -50,6 +61,7 @@ var PNGStream = module.exports = function PNGStream(canvas, sync) {
         self.readable = false;
       }
     });
+    if (self.paused) self.pause();
   });
 };
 
@@ -57,4 +69,38 @@ var PNGStream = module.exports = function PNGStream(canvas, sync) {
  * Inherit from `EventEmitter`.
  */
 
-PNGStream.prototype.__proto__ = Stream.prototype;
\ No newline at end of file
+PNGStream.prototype.__proto__ = Stream.prototype;
+
+/**
+ * Stop emitting "data" events, encoding waits once
+ * `highWaterMark` bytes are queued.
+ *
+ * @api public
+ */
+
+PNGStream.prototype.pause = function(){
+  this.paused = true;
+  if (this.control) this.control.pause();
+};
+
+/**
+ * Resume emitting "data" events.
+ *
+ * @api public
+ */
+
+PNGStream.prototype.resume = function(){
+  this.paused = false;
+  if (this.control) this.control.resume();
+};
+
+/**
+ * Abort encoding, no further events are emitted.
+ *
+ * @api public
+ */
+
+PNGStream.prototype.destroy = function(){
+  this.readable = false;
+  if (this.control) this.control.destroy();
+};
\ No newline at end of file
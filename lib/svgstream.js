@@ -0,0 +1,46 @@
+/*!
+ * Canvas - SVGStream
+ * Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+ * MIT Licensed
+ */
+
+/**
+ * Module dependencies.
+ */
+
+var PDFStream = require('./pdfstream');
+
+/**
+ * Initialize a `SVGStream` with the given SVG `canvas`.
+ *
+ * Behaves like `PDFStream`, however cairo only serializes
+ * the document once it is finished, so all "data" events
+ * are emitted after `end()` is called.
+ *
+ *     var out = fs.createWriteStream(__dirname + '/my.svg')
+ *       , stream = canvas.createSVGStream();
+ *
+ *     stream.pipe(out);
+ *     // draw...
+ *     stream.end();
+ *
+ * @param {Canvas} canvas
+ * @api public
+ */
+
+var SVGStream = module.exports = function SVGStream(canvas) {
+  PDFStream.call(this, canvas);
+};
+
+/**
+ * Inherit from `PDFStream`.
+ */
+
+SVGStream.prototype.__proto__ = PDFStream.prototype;
+
+/**
+ * Canvas methods driving the stream.
+ */
+
+SVGStream.prototype.streamMethod = 'streamSVG';
+SVGStream.prototype.endMethod = 'endSVG';
@@ -0,0 +1,212 @@
+//
+// AnimationEncoder.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <string.h>
+#include <zlib.h>
+#include <node_buffer.h>
+#include "AnimationEncoder.h"
+
+Persistent<FunctionTemplate> AnimationEncoder::constructor;
+
+/*
+ * Initialize AnimationEncoder.
+ */
+
+void
+AnimationEncoder::Initialize(Handle<Object> target) {
+  HandleScope scope;
+
+  // Constructor
+  constructor = Persistent<FunctionTemplate>::New(FunctionTemplate::New(AnimationEncoder::New));
+  constructor->InstanceTemplate()->SetInternalFieldCount(1);
+  constructor->SetClassName(String::NewSymbol("AnimationEncoder"));
+
+  // Prototype
+  Local<ObjectTemplate> proto = constructor->PrototypeTemplate();
+  NODE_SET_PROTOTYPE_METHOD(constructor, "addFrame", AddFrame);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "toBuffer", ToBuffer);
+  proto->SetAccessor(String::NewSymbol("frames"), GetFrames);
+  proto->SetAccessor(String::NewSymbol("format"), GetFormat);
+  target->Set(String::NewSymbol("AnimationEncoder"), constructor->GetFunction());
+}
+
+/*
+ * Initialize a new AnimationEncoder for `canvas` with `options`:
+ *
+ *   - format            "apng" (default) or "gif"
+ *   - delay             default frame delay in milliseconds, 100
+ *   - loop              times to play, 0 (default) loops forever
+ *   - colors            GIF palette size 3-256, 256
+ *   - palette           "local" (default) quantizes each GIF frame, "shared" reuses the first frame's
+ *   - dither            diffuse the GIF palette's color error
+ *   - compressionLevel  APNG zlib level 0-9
+ *
+ */
+
+Handle<Value>
+AnimationEncoder::New(const Arguments &args) {
+  HandleScope scope;
+
+  Local<Object> obj = args[0]->ToObject();
+  if (!Canvas::constructor->HasInstance(obj))
+    return ThrowException(Exception::TypeError(String::New("Canvas expected")));
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(obj);
+  if (canvas->isVector())
+    return ThrowException(Exception::TypeError(String::New("only image canvases can be animated")));
+
+  animation_options_t options;
+  options.format = ANIMATION_FORMAT_APNG;
+  options.width = canvas->width;
+  options.height = canvas->height;
+  options.loop = 0;
+  options.colors = 256;
+  options.dither = 0;
+  options.shared_palette = 0;
+  options.compression_level = Z_DEFAULT_COMPRESSION;
+  unsigned delay = 100;
+
+  if (args[1]->IsObject()) {
+    Local<Object> opts = args[1]->ToObject();
+
+    Local<Value> format = opts->Get(String::NewSymbol("format"));
+    if (format->IsString()) {
+      String::AsciiValue str(format);
+      if (0 == strcmp("gif", *str)) {
+        options.format = ANIMATION_FORMAT_GIF;
+      } else if (0 != strcmp("apng", *str)) {
+        return ThrowException(Exception::TypeError(String::New("invalid animation format")));
+      }
+    }
+
+    Local<Value> val = opts->Get(String::NewSymbol("delay"));
+    if (val->IsNumber()) delay = val->Int32Value() < 0 ? 0 : val->Int32Value();
+
+    val = opts->Get(String::NewSymbol("loop"));
+    if (val->IsNumber()) {
+      options.loop = val->Int32Value();
+      if (options.loop < 0) options.loop = 0;
+      if (options.loop > 0xffff) options.loop = 0xffff;
+    }
+
+    val = opts->Get(String::NewSymbol("colors"));
+    if (val->IsNumber()) options.colors = val->Int32Value();
+
+    val = opts->Get(String::NewSymbol("palette"));
+    if (val->IsString()) {
+      String::AsciiValue str(val);
+      options.shared_palette = 0 == strcmp("shared", *str);
+    }
+
+    val = opts->Get(String::NewSymbol("dither"));
+    if (!val->IsUndefined()) options.dither = val->BooleanValue();
+
+    val = opts->Get(String::NewSymbol("compressionLevel"));
+    if (val->IsNumber()) {
+      options.compression_level = val->Int32Value();
+      if (options.compression_level < 0) options.compression_level = 0;
+      if (options.compression_level > 9) options.compression_level = 9;
+    }
+  }
+
+  AnimationEncoder *encoder = new AnimationEncoder(obj, delay);
+  cairo_status_t status = animation_init(encoder->animation(), &options);
+  if (status) {
+    delete encoder;
+    return ThrowException(Canvas::Error(status));
+  }
+  encoder->Wrap(args.This());
+  return args.This();
+}
+
+/*
+ * Append the canvas as it is now, shown for `delay`
+ * milliseconds or the encoder's default delay.
+ */
+
+Handle<Value>
+AnimationEncoder::AddFrame(const Arguments &args) {
+  HandleScope scope;
+  AnimationEncoder *encoder = ObjectWrap::Unwrap<AnimationEncoder>(args.This());
+  Canvas *canvas = encoder->_canvas;
+  animation_t *anim = encoder->animation();
+
+  if (anim->finished)
+    return ThrowException(Exception::Error(String::New("animation already finished")));
+  if (canvas->width != anim->options.width || canvas->height != anim->options.height)
+    return ThrowException(Exception::Error(String::New("canvas size changed since the animation started")));
+
+  unsigned delay = encoder->_delay;
+  if (args[0]->IsNumber()) delay = args[0]->Int32Value() < 0 ? 0 : args[0]->Int32Value();
+
+  cairo_status_t status = animation_add_frame(anim, canvas->surface(), delay);
+  if (status) return ThrowException(Canvas::Error(status));
+  return Undefined();
+}
+
+/*
+ * Finish the animation and return it as a Buffer. Frames
+ * can't be added afterwards.
+ */
+
+Handle<Value>
+AnimationEncoder::ToBuffer(const Arguments &args) {
+  HandleScope scope;
+  AnimationEncoder *encoder = ObjectWrap::Unwrap<AnimationEncoder>(args.This());
+  animation_t *anim = encoder->animation();
+
+  if (!anim->frames)
+    return ThrowException(Exception::Error(String::New("no frames added")));
+
+  cairo_status_t status = animation_finish(anim);
+  if (status) return ThrowException(Canvas::Error(status));
+
+  Buffer *buf = Buffer::New((char *) anim->data, anim->len);
+  return scope.Close(buf->handle_);
+}
+
+/*
+ * Get number of frames, identical frames count once.
+ */
+
+Handle<Value>
+AnimationEncoder::GetFrames(Local<String> prop, const AccessorInfo &info) {
+  HandleScope scope;
+  AnimationEncoder *encoder = ObjectWrap::Unwrap<AnimationEncoder>(info.This());
+  return scope.Close(Number::New(encoder->animation()->frames));
+}
+
+/*
+ * Get format string.
+ */
+
+Handle<Value>
+AnimationEncoder::GetFormat(Local<String> prop, const AccessorInfo &info) {
+  HandleScope scope;
+  AnimationEncoder *encoder = ObjectWrap::Unwrap<AnimationEncoder>(info.This());
+  return scope.Close(String::New(ANIMATION_FORMAT_GIF == encoder->animation()->options.format
+    ? "gif"
+    : "apng"));
+}
+
+/*
+ * Initialize encoder, keeping the `canvas` alive while it is used.
+ */
+
+AnimationEncoder::AnimationEncoder(Handle<Object> canvas, unsigned delay):
+  _delay(delay) {
+  _canvas = ObjectWrap::Unwrap<Canvas>(canvas);
+  _canvas_handle = Persistent<Object>::New(canvas);
+  memset(&_animation, 0, sizeof(animation_t));
+}
+
+/*
+ * Free the encoded data and release the canvas.
+ */
+
+AnimationEncoder::~AnimationEncoder() {
+  animation_destroy(&_animation);
+  _canvas_handle.Dispose();
+}
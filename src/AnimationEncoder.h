@@ -0,0 +1,34 @@
+
+//
+// AnimationEncoder.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_ANIMATION_ENCODER_H__
+#define __NODE_ANIMATION_ENCODER_H__
+
+#include "Canvas.h"
+#include "animation.h"
+
+class AnimationEncoder: public node::ObjectWrap {
+  public:
+    static Persistent<FunctionTemplate> constructor;
+    static void Initialize(Handle<Object> target);
+    static Handle<Value> New(const Arguments &args);
+    static Handle<Value> AddFrame(const Arguments &args);
+    static Handle<Value> ToBuffer(const Arguments &args);
+    static Handle<Value> GetFrames(Local<String> prop, const AccessorInfo &info);
+    static Handle<Value> GetFormat(Local<String> prop, const AccessorInfo &info);
+    AnimationEncoder(Handle<Object> canvas, unsigned delay);
+    inline animation_t *animation(){ return &_animation; }
+
+  private:
+    ~AnimationEncoder();
+    Canvas *_canvas;
+    Persistent<Object> _canvas_handle;
+    unsigned _delay;
+    animation_t _animation;
+};
+
+#endif
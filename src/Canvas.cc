@@ -8,17 +8,27 @@
 #include "Canvas.h"
 #include "CanvasRenderingContext2d.h"
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <node_buffer.h>
 #include <node_version.h>
 #include <cairo-pdf.h>
-#include "closure.h"
+#ifdef CAIRO_HAS_SVG_SURFACE
+#include <cairo-svg.h>
+#endif
+#include "PNG.h"
+#include "raw.h"
+#include "base64.h"
 
 #ifdef HAVE_JPEG
 #include "JPEGStream.h"
 #endif
 
+#include "closure.h"
+
 Persistent<FunctionTemplate> Canvas::constructor;
 
 /*
@@ -37,14 +47,42 @@ Canvas::Initialize(Handle<Object> target) {
   // Prototype
   Local<ObjectTemplate> proto = constructor->PrototypeTemplate();
   NODE_SET_PROTOTYPE_METHOD(constructor, "toBuffer", ToBuffer);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "toDataURL", ToDataURL);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "encodeInto", EncodeInto);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "getDirtyRegion", GetDirtyRegion);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "resetDirty", ResetDirty);
   NODE_SET_PROTOTYPE_METHOD(constructor, "streamPNGSync", StreamPNGSync);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "streamPDF", StreamVector);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "endPDF", EndVector);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "streamSVG", StreamVector);
+  NODE_SET_PROTOTYPE_METHOD(constructor, "endSVG", EndVector);
 #ifdef HAVE_JPEG
   NODE_SET_PROTOTYPE_METHOD(constructor, "streamJPEGSync", StreamJPEGSync);
+#endif
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  NODE_SET_PROTOTYPE_METHOD(constructor, "streamPNG", StreamPNG);
+#ifdef HAVE_JPEG
+  NODE_SET_PROTOTYPE_METHOD(constructor, "streamJPEG", StreamJPEG);
+#endif
 #endif
   proto->SetAccessor(String::NewSymbol("type"), GetType);
+
+  // PNG filters
+  Local<Function> ctor = constructor->GetFunction();
+  ctor->Set(String::NewSymbol("PNG_NO_FILTERS"), Number::New(PNG_NO_FILTERS));
+  ctor->Set(String::NewSymbol("PNG_FILTER_NONE"), Number::New(PNG_FILTER_NONE));
+  ctor->Set(String::NewSymbol("PNG_FILTER_SUB"), Number::New(PNG_FILTER_SUB));
+  ctor->Set(String::NewSymbol("PNG_FILTER_UP"), Number::New(PNG_FILTER_UP));
+  ctor->Set(String::NewSymbol("PNG_FILTER_AVG"), Number::New(PNG_FILTER_AVG));
+  ctor->Set(String::NewSymbol("PNG_FILTER_PAETH"), Number::New(PNG_FILTER_PAETH));
+  ctor->Set(String::NewSymbol("PNG_ALL_FILTERS"), Number::New(PNG_ALL_FILTERS));
+
+  // Batch encoding
+  ctor->Set(String::NewSymbol("encodeBatch"), FunctionTemplate::New(EncodeBatch)->GetFunction());
+
   proto->SetAccessor(String::NewSymbol("width"), GetWidth, SetWidth);
   proto->SetAccessor(String::NewSymbol("height"), GetHeight, SetHeight);
-  target->Set(String::NewSymbol("Canvas"), constructor->GetFunction());
+  target->Set(String::NewSymbol("Canvas"), ctor);
 }
 
 /*
@@ -58,9 +96,18 @@ Canvas::New(const Arguments &args) {
   canvas_type_t type = CANVAS_TYPE_IMAGE;
   if (args[0]->IsNumber()) width = args[0]->Uint32Value();
   if (args[1]->IsNumber()) height = args[1]->Uint32Value();
-  if (args[2]->IsString()) type = !strcmp("pdf", *String::AsciiValue(args[2]))
-    ? CANVAS_TYPE_PDF
-    : CANVAS_TYPE_IMAGE;
+  if (args[2]->IsString()) {
+    String::AsciiValue str(args[2]);
+    if (0 == strcmp("pdf", *str)) {
+      type = CANVAS_TYPE_PDF;
+    } else if (0 == strcmp("svg", *str)) {
+#ifdef CAIRO_HAS_SVG_SURFACE
+      type = CANVAS_TYPE_SVG;
+#else
+      return ThrowException(Exception::Error(String::New("cairo was built without SVG support")));
+#endif
+    }
+  }
   Canvas *canvas = new Canvas(width, height, type);
   canvas->Wrap(args.This());
   return args.This();
@@ -74,7 +121,9 @@ Handle<Value>
 Canvas::GetType(Local<String> prop, const AccessorInfo &info) {
   HandleScope scope;
   Canvas *canvas = ObjectWrap::Unwrap<Canvas>(info.This());
-  return scope.Close(String::New(canvas->isPDF() ? "pdf" : "image"));
+  return scope.Close(String::New(canvas->isPDF()
+    ? "pdf"
+    : canvas->isSVG() ? "svg" : "image"));
 }
 
 /*
@@ -96,6 +145,7 @@ void
 Canvas::SetWidth(Local<String> prop, Local<Value> val, const AccessorInfo &info) {
   if (val->IsNumber()) {
     Canvas *canvas = ObjectWrap::Unwrap<Canvas>(info.This());
+    if (!canvas->ensureWritable()) return;
     canvas->width = val->Uint32Value();
     canvas->resurface(info.This());
   }
@@ -120,6 +170,7 @@ void
 Canvas::SetHeight(Local<String> prop, Local<Value> val, const AccessorInfo &info) {
   if (val->IsNumber()) {
     Canvas *canvas = ObjectWrap::Unwrap<Canvas>(info.This());
+    if (!canvas->ensureWritable()) return;
     canvas->height = val->Uint32Value();
     canvas->resurface(info.This());
   }
@@ -132,27 +183,390 @@ Canvas::SetHeight(Local<String> prop, Local<Value> val, const AccessorInfo &info
 static cairo_status_t
 toBuffer(void *c, const uint8_t *data, unsigned len) {
   closure_t *closure = (closure_t *) c;
-  
-  // Olaf: grow buffer
-  if (closure->len + len > closure->max_len) {
-    uint8_t *data;
-    unsigned max = closure->max_len;
-  
-    // round to the nearest multiple of 1024 bytes
-    max = (closure->max_len + len + 1023) & ~1023;
-  
-    data = (uint8_t *) realloc(closure->data, max);
-    if (!data) return CAIRO_STATUS_NO_MEMORY;
-    closure->data = data;
-    closure->max_len = max;
-  }
-  
+  cairo_status_t status = closure_reserve(closure, closure->len + len);
+  if (status) return status;
   memcpy(closure->data + closure->len, data, len);
   closure->len += len;
-  
   return CAIRO_STATUS_SUCCESS;
 }
 
+/*
+ * Write `len` bytes to `fd`.
+ */
+
+static cairo_status_t
+writeFd(int fd, const uint8_t *data, unsigned len) {
+  while (len) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (EINTR == errno) continue;
+      return CAIRO_STATUS_WRITE_ERROR;
+    }
+    data += n;
+    len -= n;
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * PDF / SVG surface callback, writes through to the file
+ * descriptor the document is streamed to, if any.
+ * Does not touch V8, cairo_surface_finish() may call
+ * it from the thread pool.
+ */
+
+static cairo_status_t
+vectorWrite(void *c, const uint8_t *data, unsigned len) {
+  vector_closure_t *closure = (vector_closure_t *) c;
+  return closure->fd < 0
+    ? toBuffer(&closure->closure, data, len)
+    : writeFd(closure->fd, data, len);
+}
+
+/*
+ * Free callback for buffers adopting closure data.
+ */
+
+static void
+freeClosureData(char *data, void *hint) {
+  free(data);
+}
+
+/*
+ * Wrap the closure's encoded data in a node::Buffer
+ * without copying, the buffer takes ownership.
+ */
+
+static Buffer *
+closureBuffer(closure_t *closure) {
+  unsigned len = closure->len;
+  return Buffer::New((char *) closure_detach(closure), len, freeClosureData, NULL);
+}
+
+/*
+ * Free callback for buffers viewing a surface's pixels.
+ */
+
+static void
+releaseSurface(char *data, void *surface) {
+  cairo_surface_destroy((cairo_surface_t *) surface);
+}
+
+/*
+ * Guess the encoded size from the surface dimensions so
+ * that most encodes fit the initial allocation. The data
+ * is shrunk to fit afterwards and untouched pages of a
+ * generous guess are never committed. Guesses are capped
+ * at the largest Buffer, larger output grows as needed.
+ */
+
+#define CANVAS_MAX_ESTIMATE 0x3fffffff
+
+static unsigned
+estimateSize(closure_t *closure) {
+  Canvas *canvas = closure->canvas;
+  uint64_t pixels = (uint64_t) canvas->width * canvas->height
+    , size;
+  switch (closure->format) {
+    case CANVAS_FORMAT_RAW:
+      size = pixels * raw_format_bpp(closure->raw);
+      break;
+    case CANVAS_FORMAT_JPEG:
+      size = pixels / 2 + 1024;
+      break;
+    default:
+      size = pixels * 2 + 1024;
+  }
+  return size > CANVAS_MAX_ESTIMATE ? CANVAS_MAX_ESTIMATE : (unsigned) size;
+}
+
+/*
+ * Encode `surface` in the closure's format, passing the
+ * output to `write_func`.
+ */
+
+static cairo_status_t
+encodeSurface(closure_t *closure, cairo_surface_t *surface, cairo_write_func_t write_func, void *data) {
+  cairo_status_t status = cairo_surface_status(surface);
+  if (status) return status;
+  switch (closure->format) {
+#ifdef HAVE_JPEG
+    case CANVAS_FORMAT_JPEG:
+      return write_to_jpeg_stream(
+          surface
+        , closure->bufsize
+        , &closure->jpeg
+        , write_func
+        , data);
+#endif
+    case CANVAS_FORMAT_RAW:
+      return write_raw_stream(surface, closure->raw, write_func, data);
+    default:
+      return write_to_png_stream(surface, &closure->png, write_func, data);
+  }
+}
+
+/*
+ * Encode the canvas in the closure's format, passing the
+ * output to `write_func`. Safe to call from the thread pool
+ * as long as `write_func` is, reading from the closure's
+ * snapshot when it has one.
+ */
+
+static cairo_status_t
+encode(closure_t *closure, cairo_write_func_t write_func, void *data) {
+  cairo_surface_t *surface = closure->snapshot
+    ? snapshot_surface(closure->snapshot)
+    : closure->canvas->surface();
+  return encodeSurface(closure, surface, write_func, data);
+}
+
+/*
+ * Encode each of the closure's dirty rects on its own,
+ * through views sharing the pixels of the canvas or of
+ * the snapshot. Safe to call from the thread pool when
+ * the closure has a snapshot.
+ */
+
+static cairo_status_t
+encodeTiles(tiles_closure_t *closure) {
+  cairo_surface_t *surface = closure->closure.snapshot
+    ? snapshot_surface(closure->closure.snapshot)
+    : closure->closure.canvas->surface();
+  cairo_status_t status = cairo_surface_status(surface);
+  if (status) return status;
+  cairo_surface_flush(surface);
+
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+
+  for (int i = 0; i < closure->count; ++i) {
+    dirty_rect_t *rect = &closure->rects[i];
+    closure_t *tile = &closure->tiles[i];
+    cairo_surface_t *view = cairo_image_surface_create_for_data(
+        data + rect->y * stride + rect->x * 4
+      , format
+      , rect->width
+      , rect->height
+      , stride);
+    status = encodeSurface(tile, view, toBuffer, tile);
+    cairo_surface_destroy(view);
+    if (status) return status;
+  }
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Parse PNG encoder `options` into `png`.
+ *
+ *   - compressionLevel  zlib level 0-9
+ *   - filters           Canvas.PNG_FILTER_* bitmask
+ *   - strategy          zlib strategy, see require('zlib')
+ *   - threads           compress row stripes in parallel
+ *   - palette           indexed output of at most this many colors (2-256), true for 256
+ *   - dither            boolean, dither the palette
+ *
+ */
+
+static void
+parsePNGOptions(Handle<Object> options, png_options_t *png) {
+  Local<Value> level = options->Get(String::NewSymbol("compressionLevel"));
+  if (level->IsNumber()) {
+    png->compression_level = level->Int32Value();
+    if (png->compression_level < 0) png->compression_level = 0;
+    if (png->compression_level > 9) png->compression_level = 9;
+  }
+
+  Local<Value> filters = options->Get(String::NewSymbol("filters"));
+  if (filters->IsNumber())
+    png->filters = filters->Int32Value() & PNG_ALL_FILTERS;
+
+  Local<Value> strategy = options->Get(String::NewSymbol("strategy"));
+  if (strategy->IsNumber()) {
+    int val = strategy->Int32Value();
+    if (val >= Z_DEFAULT_STRATEGY && val <= Z_FIXED) png->strategy = val;
+  }
+
+  Local<Value> threads = options->Get(String::NewSymbol("threads"));
+  if (threads->IsNumber()) {
+    png->threads = threads->Int32Value();
+    if (png->threads < 1) png->threads = 1;
+    if (png->threads > 64) png->threads = 64;
+  }
+
+  Local<Value> palette = options->Get(String::NewSymbol("palette"));
+  if (palette->IsNumber()) {
+    png->palette = palette->Int32Value();
+    if (png->palette < 0) png->palette = 0;
+    if (png->palette == 1) png->palette = 2;
+    if (png->palette > 256) png->palette = 256;
+  } else if (palette->IsBoolean()) {
+    png->palette = palette->BooleanValue() ? 256 : 0;
+  }
+
+  Local<Value> dither = options->Get(String::NewSymbol("dither"));
+  if (!dither->IsUndefined()) png->dither = dither->BooleanValue();
+}
+
+#ifdef HAVE_JPEG
+
+/*
+ * Parse JPEG encoder `options` into `jpeg`.
+ *
+ *   - quality            0-100
+ *   - progressive        boolean
+ *   - optimizeCoding     boolean
+ *   - restartInterval    MCUs between restart markers
+ *   - chromaSubsampling  "4:4:4", "4:2:2" or "4:2:0"
+ *   - dctMethod          "islow", "fast" or "float"
+ *
+ */
+
+static void
+parseJPEGOptions(Handle<Object> options, jpeg_options_t *jpeg) {
+  Local<Value> quality = options->Get(String::NewSymbol("quality"));
+  if (quality->IsNumber()) {
+    jpeg->quality = quality->Int32Value();
+    if (jpeg->quality < 0) jpeg->quality = 0;
+    if (jpeg->quality > 100) jpeg->quality = 100;
+  }
+
+  Local<Value> progressive = options->Get(String::NewSymbol("progressive"));
+  if (!progressive->IsUndefined()) jpeg->progressive = progressive->BooleanValue();
+
+  Local<Value> optimize = options->Get(String::NewSymbol("optimizeCoding"));
+  if (!optimize->IsUndefined()) jpeg->optimize_coding = optimize->BooleanValue();
+
+  Local<Value> restart = options->Get(String::NewSymbol("restartInterval"));
+  if (restart->IsNumber()) {
+    jpeg->restart_interval = restart->Int32Value();
+    if (jpeg->restart_interval < 0) jpeg->restart_interval = 0;
+    if (jpeg->restart_interval > 65535) jpeg->restart_interval = 65535;
+  }
+
+  Local<Value> subsampling = options->Get(String::NewSymbol("chromaSubsampling"));
+  if (subsampling->IsString()) {
+    String::AsciiValue str(subsampling);
+    if (0 == strcmp("4:4:4", *str)) {
+      jpeg->chroma_h = jpeg->chroma_v = 1;
+    } else if (0 == strcmp("4:2:2", *str)) {
+      jpeg->chroma_h = 2;
+      jpeg->chroma_v = 1;
+    } else if (0 == strcmp("4:2:0", *str)) {
+      jpeg->chroma_h = jpeg->chroma_v = 2;
+    }
+  }
+
+  Local<Value> dct = options->Get(String::NewSymbol("dctMethod"));
+  if (dct->IsString()) {
+    String::AsciiValue str(dct);
+    if (0 == strcmp("islow", *str)) {
+      jpeg->dct_method = JDCT_ISLOW;
+    } else if (0 == strcmp("fast", *str)) {
+      jpeg->dct_method = JDCT_IFAST;
+    } else if (0 == strcmp("float", *str)) {
+      jpeg->dct_method = JDCT_FLOAT;
+    }
+  }
+}
+
+#endif
+
+/*
+ * Parse the format name `type` into `closure`, returns
+ * false when the format is not supported.
+ *
+ *   - "png" or "image/png" (default), see parsePNGOptions()
+ *   - "jpeg" or "image/jpeg", see parseJPEGOptions()
+ *   - "raw", options: { format: "argb32-premul" | "rgba" | "bgra" | "rgb" }
+ *
+ */
+
+static bool
+parseFormat(const char *type, closure_t *closure) {
+  if (0 == strcmp("png", type) || 0 == strcmp("image/png", type)) {
+    closure->format = CANVAS_FORMAT_PNG;
+#ifdef HAVE_JPEG
+  } else if (0 == strcmp("jpeg", type) || 0 == strcmp("image/jpeg", type)) {
+    closure->format = CANVAS_FORMAT_JPEG;
+#endif
+  } else if (0 == strcmp("raw", type)) {
+    closure->format = CANVAS_FORMAT_RAW;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Parse encoder `options` for the closure's format,
+ * returns false on an unsupported raw pixel format.
+ */
+
+static bool
+parseOptions(Handle<Object> options, closure_t *closure) {
+  parsePNGOptions(options, &closure->png);
+#ifdef HAVE_JPEG
+  parseJPEGOptions(options, &closure->jpeg);
+#endif
+  if (CANVAS_FORMAT_RAW == closure->format) {
+    Local<Value> format = options->Get(String::NewSymbol("format"));
+    if (format->IsString()) {
+      String::AsciiValue str(format);
+      if (!raw_format_from_string(*str, &closure->raw)) return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Parse the optional (format, options) arguments starting
+ * at `i` into `closure`. Returns the index of the first remaining
+ * argument, or -1 when the format is not supported.
+ */
+
+static int
+parseFormatArgs(const Arguments &args, closure_t *closure, int i = 0) {
+  if (args[i]->IsString()) {
+    String::AsciiValue type(args[i++]);
+    if (!parseFormat(*type, closure)) return -1;
+  }
+
+  if (args[i]->IsObject() && !args[i]->IsFunction()) {
+    if (!parseOptions(args[i++]->ToObject(), closure)) return -1;
+  }
+
+  return i;
+}
+
+#ifdef HAVE_JPEG
+
+/*
+ * Parse the ([options], fn) arguments of the JPEG stream
+ * methods, `options.bufsize` sets the chunk size. Returns
+ * the index of `fn`, or -1 when it is missing.
+ */
+
+static int
+parseJPEGStreamArgs(const Arguments &args, closure_t *closure) {
+  int i = 0;
+  closure->format = CANVAS_FORMAT_JPEG;
+
+  if (args[i]->IsObject() && !args[i]->IsFunction()) {
+    Local<Object> options = args[i++]->ToObject();
+    parseJPEGOptions(options, &closure->jpeg);
+    Local<Value> bufsize = options->Get(String::NewSymbol("bufsize"));
+    if (bufsize->IsNumber() && bufsize->Int32Value() > 0)
+      closure->bufsize = bufsize->Int32Value();
+  }
+
+  return args[i]->IsFunction() ? i : -1;
+}
+
+#endif
+
 /*
  * EIO toBuffer callback.
  */
@@ -169,16 +583,33 @@ Canvas::EIO_ToBuffer(eio_req *req) {
 #endif
   closure_t *closure = (closure_t *) req->data;
 
-  closure->status = cairo_surface_write_to_png_stream(
-      closure->canvas->surface()
-    , toBuffer
-    , closure);
+  // data is already present when served from the cache
+  if (!closure->len) closure->status = encode(closure, toBuffer, closure);
     
 #if !NODE_VERSION_AT_LEAST(0, 5, 4)
   return 0;
 #endif
 }
 
+/*
+ * Invoke `fn` with the closure's error or a Buffer of its data,
+ * handing the data itself over when `last` is set.
+ */
+
+static void
+deliverBuffer(closure_t *closure, Persistent<Function> fn, bool last) {
+  if (closure->status) {
+    Local<Value> argv[1] = { Canvas::Error(closure->status) };
+    fn->Call(Context::GetCurrent()->Global(), 1, argv);
+  } else {
+    Buffer *buf = last
+      ? closureBuffer(closure)
+      : Buffer::New((char *) closure->data, closure->len);
+    Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(buf->handle_) };
+    fn->Call(Context::GetCurrent()->Global(), 2, argv);
+  }
+}
+
 /*
  * EIO after toBuffer callback.
  */
@@ -199,18 +630,32 @@ Canvas::EIO_AfterToBuffer(eio_req *req) {
   ev_unref(EV_DEFAULT_UC);
 #endif
 
-  if (closure->status) {
-    Local<Value> argv[1] = { Canvas::Error(closure->status) };
-    closure->pfn->Call(Context::GetCurrent()->Global(), 1, argv);
-  } else {
-    Buffer *buf = Buffer::New(closure->len);
-    memcpy(Buffer::Data(buf), closure->data, closure->len);
-    Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(buf->handle_) };
-    closure->pfn->Call(Context::GetCurrent()->Global(), 2, argv);
+  Canvas *canvas = closure->canvas;
+
+  // no longer joinable
+  for (closure_t **c = (closure_t **) &canvas->_pending; *c; c = &(*c)->next) {
+    if (*c == closure) {
+      *c = closure->next;
+      break;
+    }
   }
 
-  closure->canvas->Unref();
+  canvas->cacheEncode(closure);
+
+  // merged callbacks run in call order, the last adopts the data
+  deliverBuffer(closure, closure->pfn, !closure->waiters);
   closure->pfn.Dispose();
+
+  closure_waiter_t *waiter = closure->waiters;
+  while (waiter) {
+    closure_waiter_t *next = waiter->next;
+    deliverBuffer(closure, waiter->pfn, !next);
+    waiter->pfn.Dispose();
+    free(waiter);
+    waiter = next;
+  }
+
+  canvas->Unref();
   closure_destroy(closure);
   free(closure);
   
@@ -220,8 +665,14 @@ Canvas::EIO_AfterToBuffer(eio_req *req) {
 }
 
 /*
- * Convert PNG data to a node::Buffer, async when a 
- * callback function is passed.
+ * Encode the canvas to a node::Buffer, async
+ * when a callback function is passed.
+ *
+ *  - [fn]
+ *  - format, [options], [fn]
+ *  - "raw", { format: "argb32-premul", copy: false }
+ *  - "tiles", [options], [fn], see Canvas::ToTiles()
+ *
  */
 
 Handle<Value>
@@ -229,18 +680,82 @@ Canvas::ToBuffer(const Arguments &args) {
   HandleScope scope;
   cairo_status_t status;
   Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  canvas->willEncode();
+
+  if (args[0]->IsString() && 0 == strcmp("tiles", *String::AsciiValue(args[0])))
+    return ToTiles(args);
+
+  if (canvas->isVector()) {
+    vector_closure_t *closure = (vector_closure_t *) canvas->closure();
+    if (closure->streaming)
+      return ThrowException(Exception::Error(String::New("toBuffer() is not available while streaming")));
+    if (!canvas->ensureWritable()) return Undefined();
+
+    // Async, the document is finished on the thread pool
+    if (args[0]->IsFunction()) {
+      canvas->endVector(Handle<Function>::Cast(args[0]));
+      return Undefined();
+    }
 
-  // TODO: async / move this out
-  if (canvas->isPDF()) {
     cairo_surface_finish(canvas->surface());
-    closure_t *closure = (closure_t *) canvas->closure();
-    Buffer *buf = Buffer::New(closure->len);
-    memcpy(Buffer::Data(buf), closure->data, closure->len);
+    Buffer *buf = Buffer::New(closure->closure.len);
+    memcpy(Buffer::Data(buf), closure->closure.data, closure->closure.len);
     return buf->handle_;
   }
 
+  closure_t parsed;
+  closure_defaults(&parsed);
+  int argc = parseFormatArgs(args, &parsed);
+  if (argc < 0)
+    return ThrowException(Exception::TypeError(String::New("unsupported image format")));
+
+  // Zero-copy view of the native pixels, holding a reference
+  // so the memory outlives a resurface. Writes through it go
+  // unnoticed, so from now on every encode reads the pixels
+  // afresh rather than reusing earlier output
+  if (CANVAS_FORMAT_RAW == parsed.format
+    && RAW_FORMAT_ARGB32 == parsed.raw
+    && !args[argc]->IsFunction()
+    && args[1]->IsObject()
+    && args[1]->ToObject()->Get(String::NewSymbol("copy"))->IsFalse()) {
+    cairo_surface_t *surface = canvas->surface();
+    cairo_surface_flush(surface);
+    canvas->willDraw();
+    encode_cache_clear((encode_cache_t **) &canvas->_cache);
+    canvas->_exposed = true;
+    Buffer *buf = Buffer::New(
+        (char *) canvas->data()
+      , canvas->stride() * cairo_image_surface_get_height(surface)
+      , releaseSurface
+      , cairo_surface_reference(surface));
+    return buf->handle_;
+  }
+
+  encode_cache_t *cached = encode_cache_find(
+      (encode_cache_t **) &canvas->_cache
+    , &parsed
+    , canvas->_generation);
+
   // Async
-  if (args[0]->IsFunction()) {
+  if (args[argc]->IsFunction()) {
+    // join an identical encode of the same pixels
+    if (!cached) {
+      closure_t *pending = (closure_t *) canvas->_pending;
+      for (; pending; pending = pending->next) {
+        if (pending->generation == canvas->_generation
+          && closure_same_options(pending, &parsed)) {
+          closure_waiter_t *waiter = (closure_waiter_t *) malloc(sizeof(closure_waiter_t));
+          if (!waiter) return ThrowException(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+          waiter->pfn = Persistent<Function>::New(Handle<Function>::Cast(args[argc]));
+          waiter->next = NULL;
+          closure_waiter_t **tail = &pending->waiters;
+          while (*tail) tail = &(*tail)->next;
+          *tail = waiter;
+          return Undefined();
+        }
+      }
+    }
+
     closure_t *closure = (closure_t *) malloc(sizeof(closure_t));
     status = closure_init(closure, canvas);
 
@@ -251,9 +766,31 @@ Canvas::ToBuffer(const Arguments &args) {
       return Canvas::Error(status);
     }
 
+    closure_copy_options(closure, &parsed);
+    closure->generation = canvas->_generation;
+
+    if (cached) {
+      // still hand it back asynchronously
+      status = closure_reserve(closure, cached->len);
+      if (status) {
+        closure_destroy(closure);
+        free(closure);
+        return ThrowException(Canvas::Error(status));
+      }
+      memcpy(closure->data, cached->data, cached->len);
+      closure->len = cached->len;
+      closure->status = CAIRO_STATUS_SUCCESS;
+    } else {
+      closure->snapshot = canvas->snapshot();
+      // best effort, toBuffer() grows the data as needed
+      closure_reserve(closure, estimateSize(closure));
+      closure->next = (closure_t *) canvas->_pending;
+      canvas->_pending = closure;
+    }
+
     // TODO: only one callback fn in closure
     canvas->Ref();
-    closure->pfn = Persistent<Function>::New(Handle<Function>::Cast(args[0]));
+    closure->pfn = Persistent<Function>::New(Handle<Function>::Cast(args[argc]));
     
 #if NODE_VERSION_AT_LEAST(0, 6, 0)
     uv_work_t* req = new uv_work_t;
@@ -267,6 +804,11 @@ Canvas::ToBuffer(const Arguments &args) {
     return Undefined();
   // Sync
   } else {
+    if (cached) {
+      Buffer *buf = Buffer::New((char *) cached->data, cached->len);
+      return buf->handle_;
+    }
+
     closure_t closure;
     status = closure_init(&closure, canvas);
 
@@ -276,8 +818,11 @@ Canvas::ToBuffer(const Arguments &args) {
       return Canvas::Error(status);
     }
 
+    closure_copy_options(&closure, &parsed);
+    closure_reserve(&closure, estimateSize(&closure));
+
     TryCatch try_catch;
-    status = cairo_surface_write_to_png_stream(canvas->surface(), toBuffer, &closure);
+    status = encode(&closure, toBuffer, &closure);
 
     if (try_catch.HasCaught()) {
       closure_destroy(&closure);
@@ -286,8 +831,9 @@ Canvas::ToBuffer(const Arguments &args) {
       closure_destroy(&closure);
       return ThrowException(Canvas::Error(status));
     } else {
-      Buffer *buf = Buffer::New(closure.len);
-      memcpy(Buffer::Data(buf), closure.data, closure.len);
+      if (CANVAS_FORMAT_RAW != closure.format)
+        encode_cache_add((encode_cache_t **) &canvas->_cache, &closure, canvas->_generation);
+      Buffer *buf = closureBuffer(&closure);
       closure_destroy(&closure);
       return buf->handle_;
     }
@@ -295,88 +841,1390 @@ Canvas::ToBuffer(const Arguments &args) {
 }
 
 /*
- * Canvas::StreamPNG callback.
+ * Build the array of { x, y, width, height, buffer }
+ * objects of the closure's tiles, the buffers adopt
+ * the tile data.
  */
 
-static cairo_status_t
-streamPNG(void *c, const uint8_t *data, unsigned len) {
-  HandleScope scope;
-  closure_t *closure = (closure_t *) c;
-  Local<Buffer> buf = Buffer::New(len);
-  memcpy(Buffer::Data(buf->handle_), data, len);
-  Local<Value> argv[3] = {
-      Local<Value>::New(Null())
-    , Local<Value>::New(buf->handle_)
-    , Integer::New(len) };
-  closure->fn->Call(Context::GetCurrent()->Global(), 3, argv);
-  return CAIRO_STATUS_SUCCESS;
+static Local<Array>
+tilesArray(tiles_closure_t *closure) {
+  Local<Array> tiles = Array::New(closure->count);
+  for (int i = 0; i < closure->count; ++i) {
+    dirty_rect_t *rect = &closure->rects[i];
+    Local<Object> tile = Object::New();
+    tile->Set(String::NewSymbol("x"), Number::New(rect->x));
+    tile->Set(String::NewSymbol("y"), Number::New(rect->y));
+    tile->Set(String::NewSymbol("width"), Number::New(rect->width));
+    tile->Set(String::NewSymbol("height"), Number::New(rect->height));
+    tile->Set(String::NewSymbol("buffer"), closureBuffer(&closure->tiles[i])->handle_);
+    tiles->Set(i, tile);
+  }
+  return tiles;
 }
 
 /*
- * Stream PNG data synchronously.
+ * Invoke `fn` with the closure's error or its tiles.
  */
 
-Handle<Value>
-Canvas::StreamPNGSync(const Arguments &args) {
-  HandleScope scope;
-  // TODO: async as well
-  if (!args[0]->IsFunction())
-    return ThrowException(Exception::TypeError(String::New("callback function required")));
-
-  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
-  closure_t closure;
-  closure.fn = Handle<Function>::Cast(args[0]);
-
-  TryCatch try_catch;
-  cairo_status_t status = cairo_surface_write_to_png_stream(canvas->surface(), streamPNG, &closure);
-
-  if (try_catch.HasCaught()) {
-    return try_catch.ReThrow();
-  } else if (status) {
-    Local<Value> argv[1] = { Canvas::Error(status) };
-    closure.fn->Call(Context::GetCurrent()->Global(), 1, argv);
+static void
+deliverTiles(tiles_closure_t *closure, Handle<Function> fn) {
+  if (closure->closure.status) {
+    Local<Value> argv[1] = { Canvas::Error(closure->closure.status) };
+    fn->Call(Context::GetCurrent()->Global(), 1, argv);
   } else {
-    Local<Value> argv[3] = {
-        Local<Value>::New(Null())
-      , Local<Value>::New(Null())
-      , Integer::New(0) };
-    closure.fn->Call(Context::GetCurrent()->Global(), 3, argv);
+    Local<Value> argv[2] = { Local<Value>::New(Null()), tilesArray(closure) };
+    fn->Call(Context::GetCurrent()->Global(), 2, argv);
   }
-  return Undefined();
 }
 
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
 /*
- * Stream JPEG data synchronously.
+ * Encode tiles on the thread pool.
  */
 
-#ifdef HAVE_JPEG
+void
+Canvas::ToTilesAsync(uv_work_t *req) {
+  tiles_closure_t *closure = (tiles_closure_t *) req->data;
+  closure->closure.status = encodeTiles(closure);
+}
 
-Handle<Value>
-Canvas::StreamJPEGSync(const Arguments &args) {
-  HandleScope scope;
-  // TODO: async as well
-  if (!args[0]->IsNumber())
-    return ThrowException(Exception::TypeError(String::New("buffer size required")));
-  if (!args[1]->IsNumber())
-    return ThrowException(Exception::TypeError(String::New("quality setting required")));
-  if (!args[2]->IsFunction())
-    return ThrowException(Exception::TypeError(String::New("callback function required")));
+/*
+ * Deliver the tiles encoded on the thread pool.
+ */
 
-  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
-  closure_t closure;
-  closure.fn = Handle<Function>::Cast(args[2]);
+void
+Canvas::ToTilesAsyncAfter(uv_work_t *req) {
+  HandleScope scope;
+  tiles_closure_t *closure = (tiles_closure_t *) req->data;
+  delete req;
 
-  TryCatch try_catch;
-  write_to_jpeg_stream(canvas->surface(), args[0]->NumberValue(), args[1]->NumberValue(), &closure);
+  deliverTiles(closure, closure->closure.pfn);
+  closure->closure.pfn.Dispose();
 
-  if (try_catch.HasCaught()) return try_catch.ReThrow();
-  return Undefined();
+  closure->closure.canvas->Unref();
+  tiles_closure_destroy(closure);
+  free(closure);
 }
 
 #endif
 
 /*
- * Initialize cairo surface.
+ * Encode each dirty tile of the canvas on its own, merging
+ * runs of dirty tiles within a tile row. Async when a
+ * callback function is passed, dirty state is left as is.
+ *
+ *  - "tiles", [options], [fn]
+ *
+ * `options.type` picks the tile encoding by its toBuffer()
+ * format name, other options go to that encoder.
+ */
+
+Handle<Value>
+Canvas::ToTiles(const Arguments &args) {
+  HandleScope scope;
+  cairo_status_t status;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  canvas->willEncode();
+
+  if (canvas->isVector())
+    return ThrowException(Exception::TypeError(String::New("tiles require an image canvas")));
+
+  closure_t parsed;
+  closure_defaults(&parsed);
+  int i = 1;
+
+  if (args[i]->IsObject() && !args[i]->IsFunction()) {
+    Local<Object> options = args[i++]->ToObject();
+    Local<Value> type = options->Get(String::NewSymbol("type"));
+    if ((type->IsString() && !parseFormat(*String::AsciiValue(type), &parsed))
+      || !parseOptions(options, &parsed))
+      return ThrowException(Exception::TypeError(String::New("unsupported image format")));
+  }
+
+  tiles_closure_t *closure = (tiles_closure_t *) malloc(sizeof(tiles_closure_t));
+  if (!closure) return ThrowException(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+  status = tiles_closure_init(closure, canvas, &parsed);
+
+  // ensure closure is ok
+  if (status) {
+    tiles_closure_destroy(closure);
+    free(closure);
+    return ThrowException(Canvas::Error(status));
+  }
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  // Async
+  if (args[i]->IsFunction()) {
+    closure->closure.snapshot = canvas->snapshot();
+    closure->closure.pfn = Persistent<Function>::New(Handle<Function>::Cast(args[i]));
+    canvas->Ref();
+    uv_work_t *req = new uv_work_t;
+    req->data = closure;
+    uv_queue_work(uv_default_loop(), req, ToTilesAsync, ToTilesAsyncAfter);
+    return Undefined();
+  }
+#endif
+
+  // Sync, older node versions call back right away
+  closure->closure.status = encodeTiles(closure);
+
+  if (args[i]->IsFunction()) {
+    deliverTiles(closure, Handle<Function>::Cast(args[i]));
+    tiles_closure_destroy(closure);
+    free(closure);
+    return Undefined();
+  }
+
+  if (closure->closure.status) {
+    status = closure->closure.status;
+    tiles_closure_destroy(closure);
+    free(closure);
+    return ThrowException(Canvas::Error(status));
+  }
+
+  Local<Array> tiles = tilesArray(closure);
+  tiles_closure_destroy(closure);
+  free(closure);
+  return scope.Close(tiles);
+}
+
+/*
+ * Canvas::EncodeInto callback, writes in place until the
+ * output overflows, then collects all of it.
+ */
+
+static cairo_status_t
+writeInto(void *c, const uint8_t *data, unsigned len) {
+  into_closure_t *closure = (into_closure_t *) c;
+  unsigned offset = closure->len;
+  if (len > UINT_MAX - offset) return CAIRO_STATUS_NO_MEMORY;
+  closure->len += len;
+
+  if (closure->len <= closure->max_len) {
+    memcpy(closure->dst + offset, data, len);
+    return CAIRO_STATUS_SUCCESS;
+  }
+
+  // first overflow, take over what fit so far
+  if (offset <= closure->max_len) {
+    cairo_status_t status = toBuffer(&closure->closure, closure->dst, offset);
+    if (status) return status;
+  }
+  return toBuffer(&closure->closure, data, len);
+}
+
+/*
+ * RangeError for a buffer `needed` bytes short of the
+ * output, carrying `neededSize`.
+ */
+
+static Local<Value>
+bufferTooSmall(unsigned needed) {
+  char msg[64];
+  snprintf(msg, sizeof(msg), "buffer too small, %u bytes needed", needed);
+  Local<Value> err = Exception::RangeError(String::New(msg));
+  err->ToObject()->Set(String::NewSymbol("neededSize"), Number::New(needed));
+  return err;
+}
+
+/*
+ * Invoke `fn` with the closure's error or the number of
+ * bytes written.
+ */
+
+static void
+deliverInto(into_closure_t *closure, Handle<Function> fn) {
+  if (closure->closure.status) {
+    Local<Value> argv[1] = { Canvas::Error(closure->closure.status) };
+    fn->Call(Context::GetCurrent()->Global(), 1, argv);
+  } else if (closure->len > closure->max_len) {
+    Local<Value> argv[1] = { bufferTooSmall(closure->len) };
+    fn->Call(Context::GetCurrent()->Global(), 1, argv);
+  } else {
+    Local<Value> argv[2] = { Local<Value>::New(Null()), Number::New(closure->len) };
+    fn->Call(Context::GetCurrent()->Global(), 2, argv);
+  }
+}
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
+/*
+ * Encode into the buffer on the thread pool.
+ */
+
+void
+Canvas::EncodeIntoAsync(uv_work_t *req) {
+  into_closure_t *closure = (into_closure_t *) req->data;
+
+  // output is already present when served from the cache
+  if (!closure->len) closure->closure.status = encode(&closure->closure, writeInto, closure);
+}
+
+/*
+ * Deliver the outcome of encoding on the thread pool.
+ */
+
+void
+Canvas::EncodeIntoAsyncAfter(uv_work_t *req) {
+  HandleScope scope;
+  into_closure_t *closure = (into_closure_t *) req->data;
+  delete req;
+
+  Canvas *canvas = closure->closure.canvas;
+  if (closure->len > closure->max_len) canvas->cacheEncode(&closure->closure);
+  deliverInto(closure, closure->closure.pfn);
+  closure->closure.pfn.Dispose();
+
+  canvas->Unref();
+  into_closure_destroy(closure);
+  free(closure);
+}
+
+#endif
+
+/*
+ * Encode the canvas into `buffer` at `offset`, returning
+ * the number of bytes written. Async when a callback
+ * function is passed, which receives (err, bytesWritten).
+ *
+ *  - buffer, [offset], [format], [options], [fn]
+ *
+ * Formats and options are those of toBuffer(). When the
+ * output doesn't fit a RangeError is thrown with the size
+ * needed as `err.neededSize`, the bytes past `offset` are
+ * then undefined. The output is cached so a retry with a
+ * large enough buffer is a copy.
+ */
+
+Handle<Value>
+Canvas::EncodeInto(const Arguments &args) {
+  HandleScope scope;
+  cairo_status_t status;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  canvas->willEncode();
+
+  if (canvas->isVector())
+    return ThrowException(Exception::TypeError(String::New("encodeInto() requires an image canvas")));
+  if (!Buffer::HasInstance(args[0]))
+    return ThrowException(Exception::TypeError(String::New("Buffer expected")));
+
+  Local<Object> buffer = args[0]->ToObject();
+  size_t length = Buffer::Length(buffer);
+  size_t offset = 0;
+  int i = 1;
+
+  if (args[i]->IsNumber()) {
+    double val = args[i++]->NumberValue();
+    if (!(val >= 0 && val <= length))
+      return ThrowException(Exception::RangeError(String::New("offset out of range")));
+    offset = val;
+  }
+
+  closure_t parsed;
+  closure_defaults(&parsed);
+  i = parseFormatArgs(args, &parsed, i);
+  if (i < 0)
+    return ThrowException(Exception::TypeError(String::New("unsupported image format")));
+
+  size_t avail = length - offset;
+  uint8_t *dst = (uint8_t *) Buffer::Data(buffer) + offset;
+
+  into_closure_t *closure = (into_closure_t *) malloc(sizeof(into_closure_t));
+  if (!closure) return ThrowException(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+  status = into_closure_init(closure, canvas, dst, avail > UINT_MAX ? UINT_MAX : avail);
+
+  // ensure closure is ok
+  if (status) {
+    into_closure_destroy(closure);
+    free(closure);
+    return ThrowException(Canvas::Error(status));
+  }
+
+  closure_copy_options(&closure->closure, &parsed);
+  closure->closure.generation = canvas->_generation;
+
+  encode_cache_t *cached = encode_cache_find(
+      (encode_cache_t **) &canvas->_cache
+    , &parsed
+    , canvas->_generation);
+  if (cached) closure->closure.status = writeInto(closure, cached->data, cached->len);
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  // Async, the buffer is kept alive until written
+  if (args[i]->IsFunction()) {
+    closure->buffer = Persistent<Object>::New(buffer);
+    if (!cached) closure->closure.snapshot = canvas->snapshot();
+    closure->closure.pfn = Persistent<Function>::New(Handle<Function>::Cast(args[i]));
+    canvas->Ref();
+    uv_work_t *req = new uv_work_t;
+    req->data = closure;
+    uv_queue_work(uv_default_loop(), req, EncodeIntoAsync, EncodeIntoAsyncAfter);
+    return Undefined();
+  }
+#endif
+
+  // Sync, older node versions call back right away
+  if (!cached) closure->closure.status = encode(&closure->closure, writeInto, closure);
+  if (closure->len > closure->max_len) canvas->cacheEncode(&closure->closure);
+
+  if (args[i]->IsFunction()) {
+    deliverInto(closure, Handle<Function>::Cast(args[i]));
+    into_closure_destroy(closure);
+    free(closure);
+    return Undefined();
+  }
+
+  Local<Value> ret = closure->closure.status
+    ? ThrowException(Canvas::Error(closure->closure.status))
+    : closure->len > closure->max_len
+      ? ThrowException(bufferTooSmall(closure->len))
+      : Local<Value>(Number::New(closure->len));
+  into_closure_destroy(closure);
+  free(closure);
+  return scope.Close(ret);
+}
+
+/*
+ * Data URL string resource, adopting the characters built
+ * on the thread pool so V8 doesn't copy them.
+ */
+
+class DataURLResource: public String::ExternalAsciiStringResource {
+  public:
+    DataURLResource(char *data, size_t len): _data(data), _len(len) {}
+    ~DataURLResource() { free(_data); }
+    const char *data() const { return _data; }
+    size_t length() const { return _len; }
+
+  private:
+    char *_data;
+    size_t _len;
+};
+
+/*
+ * Base64 encode the closure's data behind the data URL
+ * prefix of its format. Does not touch V8.
+ */
+
+static cairo_status_t
+buildDataURL(dataurl_closure_t *closure) {
+  const char *prefix = CANVAS_FORMAT_JPEG == closure->closure.format
+    ? "data:image/jpeg;base64,"
+    : "data:image/png;base64,";
+  size_t n = strlen(prefix);
+
+  closure->len = n + BASE64_ENCODED_LEN(closure->closure.len);
+  closure->str = (char *) malloc(closure->len);
+  if (!closure->str) return CAIRO_STATUS_NO_MEMORY;
+  memcpy(closure->str, prefix, n);
+  base64_encode(closure->closure.data, closure->closure.len, closure->str + n);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Hand the closure's data URL over to a V8 string.
+ */
+
+static Local<String>
+dataURLString(dataurl_closure_t *closure) {
+  Local<String> str = String::NewExternal(new DataURLResource(closure->str, closure->len));
+  closure->str = NULL;
+  return str;
+}
+
+/*
+ * Invoke `fn` with the closure's error or data URL.
+ */
+
+static void
+deliverDataURL(dataurl_closure_t *closure, Handle<Function> fn) {
+  if (closure->closure.status) {
+    Local<Value> argv[1] = { Canvas::Error(closure->closure.status) };
+    fn->Call(Context::GetCurrent()->Global(), 1, argv);
+  } else {
+    Local<Value> argv[2] = { Local<Value>::New(Null()), dataURLString(closure) };
+    fn->Call(Context::GetCurrent()->Global(), 2, argv);
+  }
+}
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
+/*
+ * Encode and base64 encode on the thread pool.
+ */
+
+void
+Canvas::ToDataURLAsync(uv_work_t *req) {
+  dataurl_closure_t *closure = (dataurl_closure_t *) req->data;
+  closure_t *encoded = &closure->closure;
+
+  // data is already present when served from the cache
+  if (!encoded->len) encoded->status = encode(encoded, toBuffer, encoded);
+  if (!encoded->status) encoded->status = buildDataURL(closure);
+}
+
+/*
+ * Deliver the data URL built on the thread pool.
+ */
+
+void
+Canvas::ToDataURLAsyncAfter(uv_work_t *req) {
+  HandleScope scope;
+  dataurl_closure_t *closure = (dataurl_closure_t *) req->data;
+  delete req;
+
+  Canvas *canvas = closure->closure.canvas;
+  canvas->cacheEncode(&closure->closure);
+  deliverDataURL(closure, closure->closure.pfn);
+  closure->closure.pfn.Dispose();
+
+  canvas->Unref();
+  dataurl_closure_destroy(closure);
+  free(closure);
+}
+
+#endif
+
+/*
+ * Return a data URL of the canvas, async when a callback
+ * function is passed, in which case both the encoding and
+ * the base64 expansion happen on the thread pool.
+ *
+ *  - [type], [quality], [fn]
+ *  - type, options, [fn]
+ *
+ * `type` is "image/png" (default) or "image/jpeg", `quality`
+ * the JPEG quality between 0 and 1, and `options` those of
+ * toBuffer() for the type.
+ */
+
+Handle<Value>
+Canvas::ToDataURL(const Arguments &args) {
+  HandleScope scope;
+  cairo_status_t status;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  canvas->willEncode();
+
+  if (canvas->isVector())
+    return ThrowException(Exception::TypeError(String::New("data URLs require an image canvas")));
+
+  closure_t parsed;
+  closure_defaults(&parsed);
+  int i = 0;
+
+  if (args[i]->IsString()) {
+    String::AsciiValue type(args[i++]);
+    if (!parseFormat(*type, &parsed) || CANVAS_FORMAT_RAW == parsed.format)
+      return ThrowException(Exception::TypeError(String::New("unsupported image format")));
+  }
+
+  if (args[i]->IsNumber()) {
+#ifdef HAVE_JPEG
+    double quality = args[i]->NumberValue();
+    if (quality >= 0 && quality <= 1) parsed.jpeg.quality = quality * 100 + .5;
+#endif
+    ++i;
+  } else if (args[i]->IsObject() && !args[i]->IsFunction()) {
+    if (!parseOptions(args[i++]->ToObject(), &parsed))
+      return ThrowException(Exception::TypeError(String::New("unsupported image format")));
+  }
+
+  dataurl_closure_t *closure = (dataurl_closure_t *) malloc(sizeof(dataurl_closure_t));
+  if (!closure) return ThrowException(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+  status = dataurl_closure_init(closure, canvas);
+  closure_t *encoded = &closure->closure;
+  closure_copy_options(encoded, &parsed);
+  encoded->generation = canvas->_generation;
+
+  encode_cache_t *cached = encode_cache_find(
+      (encode_cache_t **) &canvas->_cache
+    , encoded
+    , canvas->_generation);
+  if (!status && cached) {
+    if (!(status = closure_reserve(encoded, cached->len))) {
+      memcpy(encoded->data, cached->data, cached->len);
+      encoded->len = cached->len;
+    }
+  } else if (!status) {
+    // best effort, toBuffer() grows the data as needed
+    closure_reserve(encoded, estimateSize(encoded));
+  }
+
+  // ensure closure is ok
+  if (status) {
+    dataurl_closure_destroy(closure);
+    free(closure);
+    return ThrowException(Canvas::Error(status));
+  }
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  // Async
+  if (args[i]->IsFunction()) {
+    if (!encoded->len) encoded->snapshot = canvas->snapshot();
+    encoded->pfn = Persistent<Function>::New(Handle<Function>::Cast(args[i]));
+    canvas->Ref();
+    uv_work_t *req = new uv_work_t;
+    req->data = closure;
+    uv_queue_work(uv_default_loop(), req, ToDataURLAsync, ToDataURLAsyncAfter);
+    return Undefined();
+  }
+#endif
+
+  // Sync, older node versions call back right away
+  if (!encoded->len) encoded->status = encode(encoded, toBuffer, encoded);
+  canvas->cacheEncode(encoded);
+  if (!encoded->status) encoded->status = buildDataURL(closure);
+
+  if (args[i]->IsFunction()) {
+    deliverDataURL(closure, Handle<Function>::Cast(args[i]));
+    dataurl_closure_destroy(closure);
+    free(closure);
+    return Undefined();
+  }
+
+  if (encoded->status) {
+    status = encoded->status;
+    dataurl_closure_destroy(closure);
+    free(closure);
+    return ThrowException(Canvas::Error(status));
+  }
+
+  Local<String> str = dataURLString(closure);
+  dataurl_closure_destroy(closure);
+  free(closure);
+  return scope.Close(str);
+}
+
+/*
+ * Encode the batch's items until none are left, on
+ * as many threads as run this at once.
+ */
+
+static void *
+encodeBatchItems(void *data) {
+  batch_closure_t *closure = (batch_closure_t *) data;
+  for (;;) {
+    pthread_mutex_lock(&closure->mutex);
+    int i = closure->next++;
+    pthread_mutex_unlock(&closure->mutex);
+    if (i >= closure->count) break;
+
+    // data is already present when served from the cache
+    closure_t *item = &closure->items[i];
+    if (!item->len) item->status = encode(item, toBuffer, item);
+  }
+  return NULL;
+}
+
+/*
+ * Encode all items of the batch, spread over its threads.
+ * Returns the status of the first item that failed.
+ */
+
+static cairo_status_t
+encodeBatch(batch_closure_t *closure) {
+  pthread_t threads[64];
+  int n = closure->threads < closure->count ? closure->threads : closure->count
+    , spawned = 0;
+  if (n > 64) n = 64;
+
+  // the calling thread is one of them
+  while (spawned < n - 1
+    && 0 == pthread_create(&threads[spawned], NULL, encodeBatchItems, closure))
+    ++spawned;
+  encodeBatchItems(closure);
+  for (int i = 0; i < spawned; ++i)
+    pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < closure->count; ++i)
+    if (closure->items[i].status) return closure->items[i].status;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Build the array of Buffers adopting the data of each
+ * item, caching each canvas's output on the way.
+ */
+
+static Local<Array>
+batchArray(batch_closure_t *closure) {
+  Local<Array> buffers = Array::New(closure->count);
+  for (int i = 0; i < closure->count; ++i) {
+    closure_t *item = &closure->items[i];
+    item->canvas->cacheEncode(item);
+    buffers->Set(i, closureBuffer(item)->handle_);
+  }
+  return buffers;
+}
+
+/*
+ * Invoke `fn` with the batch's error or its Buffers.
+ */
+
+static void
+deliverBatch(batch_closure_t *closure, Handle<Function> fn) {
+  if (closure->closure.status) {
+    Local<Value> argv[1] = { Canvas::Error(closure->closure.status) };
+    fn->Call(Context::GetCurrent()->Global(), 1, argv);
+    return;
+  }
+
+  Local<Value> argv[2] = { Local<Value>::New(Null()), batchArray(closure) };
+  fn->Call(Context::GetCurrent()->Global(), 2, argv);
+}
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
+/*
+ * Encode a batch on the thread pool.
+ */
+
+void
+Canvas::EncodeBatchAsync(uv_work_t *req) {
+  batch_closure_t *closure = (batch_closure_t *) req->data;
+  closure->closure.status = encodeBatch(closure);
+}
+
+/*
+ * Deliver the batch encoded on the thread pool.
+ */
+
+void
+Canvas::EncodeBatchAsyncAfter(uv_work_t *req) {
+  HandleScope scope;
+  batch_closure_t *closure = (batch_closure_t *) req->data;
+  delete req;
+
+  deliverBatch(closure, closure->closure.pfn);
+  closure->closure.pfn.Dispose();
+
+  for (int i = 0; i < closure->count; ++i)
+    closure->items[i].canvas->Unref();
+  batch_closure_destroy(closure);
+  free(closure);
+}
+
+#endif
+
+/*
+ * Encode many image canvases with the same options in a
+ * single job, returning an array of Buffers in the order
+ * of `canvases`. Async when a callback function is passed.
+ *
+ *  - canvases, [format], [options], [fn]
+ *
+ * Formats and options are those of toBuffer(), except that
+ * `options.threads` sets how many threads share the batch,
+ * defaulting to one per CPU, while each canvas is encoded on
+ * a single thread. Results are served from and added to the
+ * encode cache of each canvas.
+ */
+
+Handle<Value>
+Canvas::EncodeBatch(const Arguments &args) {
+  HandleScope scope;
+  cairo_status_t status;
+
+  if (!args[0]->IsArray())
+    return ThrowException(Exception::TypeError(String::New("array of canvases expected")));
+  Local<Array> canvases = Local<Array>::Cast(args[0]);
+
+  closure_t parsed;
+  closure_defaults(&parsed);
+  int argc = parseFormatArgs(args, &parsed, 1);
+  if (argc < 0)
+    return ThrowException(Exception::TypeError(String::New("unsupported image format")));
+
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (args[argc - 1]->IsObject() && !args[argc - 1]->IsFunction() && argc > 1) {
+    Local<Value> val = args[argc - 1]->ToObject()->Get(String::NewSymbol("threads"));
+    if (val->IsNumber()) threads = val->Int32Value();
+  }
+  parsed.png.threads = 1;
+
+  int count = canvases->Length();
+  for (int i = 0; i < count; ++i) {
+    Local<Value> val = canvases->Get(i);
+    if (!val->IsObject() || !Canvas::constructor->HasInstance(val->ToObject()))
+      return ThrowException(Exception::TypeError(String::New("Canvas expected")));
+    if (ObjectWrap::Unwrap<Canvas>(val->ToObject())->isVector())
+      return ThrowException(Exception::TypeError(String::New("only image canvases can be batch encoded")));
+  }
+
+  batch_closure_t *closure = (batch_closure_t *) malloc(sizeof(batch_closure_t));
+  if (!closure) return ThrowException(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+  status = batch_closure_init(closure, count, &parsed);
+  closure->threads = threads < 1 ? 1 : threads;
+
+  bool async = false;
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  async = args[argc]->IsFunction();
+#endif
+
+  for (int i = 0; !status && i < count; ++i) {
+    Canvas *canvas = ObjectWrap::Unwrap<Canvas>(canvases->Get(i)->ToObject());
+    closure_t *item = &closure->items[i];
+    canvas->willEncode();
+    if ((status = closure_init(item, canvas))) break;
+    closure_copy_options(item, &parsed);
+    item->generation = canvas->_generation;
+
+    encode_cache_t *cached = encode_cache_find(
+        (encode_cache_t **) &canvas->_cache
+      , item
+      , canvas->_generation);
+    if (cached) {
+      if ((status = closure_reserve(item, cached->len))) break;
+      memcpy(item->data, cached->data, cached->len);
+      item->len = cached->len;
+      continue;
+    }
+
+    // best effort, toBuffer() grows the data as needed
+    closure_reserve(item, estimateSize(item));
+    if (async) item->snapshot = canvas->snapshot();
+  }
+
+  // ensure closure is ok
+  if (status) {
+    batch_closure_destroy(closure);
+    free(closure);
+    return ThrowException(Canvas::Error(status));
+  }
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  // Async
+  if (async) {
+    for (int i = 0; i < count; ++i)
+      closure->items[i].canvas->Ref();
+    closure->closure.pfn = Persistent<Function>::New(Handle<Function>::Cast(args[argc]));
+    uv_work_t *req = new uv_work_t;
+    req->data = closure;
+    uv_queue_work(uv_default_loop(), req, EncodeBatchAsync, EncodeBatchAsyncAfter);
+    return Undefined();
+  }
+#endif
+
+  // Sync, older node versions call back right away
+  closure->closure.status = encodeBatch(closure);
+
+  if (args[argc]->IsFunction()) {
+    deliverBatch(closure, Handle<Function>::Cast(args[argc]));
+    batch_closure_destroy(closure);
+    free(closure);
+    return Undefined();
+  }
+
+  if (closure->closure.status) {
+    status = closure->closure.status;
+    batch_closure_destroy(closure);
+    free(closure);
+    return ThrowException(Canvas::Error(status));
+  }
+
+  Local<Array> buffers = batchArray(closure);
+  batch_closure_destroy(closure);
+  free(closure);
+  return scope.Close(buffers);
+}
+
+/*
+ * Return the bounding box of the pixels drawn since
+ * the last resetDirty() as { x, y, width, height },
+ * or null when nothing was drawn.
+ */
+
+Handle<Value>
+Canvas::GetDirtyRegion(const Arguments &args) {
+  HandleScope scope;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  dirty_t *dirty = canvas->dirty();
+  if (dirty->x2 <= dirty->x1) return scope.Close(Null());
+  Local<Object> region = Object::New();
+  region->Set(String::NewSymbol("x"), Number::New(dirty->x1));
+  region->Set(String::NewSymbol("y"), Number::New(dirty->y1));
+  region->Set(String::NewSymbol("width"), Number::New(dirty->x2 - dirty->x1));
+  region->Set(String::NewSymbol("height"), Number::New(dirty->y2 - dirty->y1));
+  return scope.Close(region);
+}
+
+/*
+ * Mark the whole canvas clean.
+ */
+
+Handle<Value>
+Canvas::ResetDirty(const Arguments &args) {
+  HandleScope scope;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  dirty_reset(canvas->dirty());
+  return Undefined();
+}
+
+/*
+ * Canvas::StreamPNGSync / StreamJPEGSync callback.
+ */
+
+static cairo_status_t
+streamSync(void *c, const uint8_t *data, unsigned len) {
+  HandleScope scope;
+  closure_t *closure = (closure_t *) c;
+  Local<Buffer> buf = Buffer::New(len);
+  memcpy(Buffer::Data(buf->handle_), data, len);
+  Local<Value> argv[3] = {
+      Local<Value>::New(Null())
+    , Local<Value>::New(buf->handle_)
+    , Integer::New(len) };
+  closure->fn->Call(Context::GetCurrent()->Global(), 3, argv);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Stream PNG data synchronously.
+ */
+
+Handle<Value>
+Canvas::StreamPNGSync(const Arguments &args) {
+  HandleScope scope;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  closure_t closure;
+  closure.canvas = canvas;
+  closure.snapshot = NULL;
+  closure_defaults(&closure);
+
+  int argc = 0;
+  if (args[0]->IsObject() && !args[0]->IsFunction())
+    parsePNGOptions(args[argc++]->ToObject(), &closure.png);
+  if (!args[argc]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("callback function required")));
+  closure.fn = Handle<Function>::Cast(args[argc]);
+
+  TryCatch try_catch;
+  cairo_status_t status = encode(&closure, streamSync, &closure);
+
+  if (try_catch.HasCaught()) {
+    return try_catch.ReThrow();
+  } else if (status) {
+    Local<Value> argv[1] = { Canvas::Error(status) };
+    closure.fn->Call(Context::GetCurrent()->Global(), 1, argv);
+  } else {
+    Local<Value> argv[3] = {
+        Local<Value>::New(Null())
+      , Local<Value>::New(Null())
+      , Integer::New(0) };
+    closure.fn->Call(Context::GetCurrent()->Global(), 3, argv);
+  }
+  return Undefined();
+}
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
+/*
+ * Canvas::StreamPNG / StreamJPEG callback, invoked on the encoder thread.
+ */
+
+static cairo_status_t
+streamAsync(void *c, const uint8_t *data, unsigned len) {
+  stream_closure_t *closure = (stream_closure_t *) c;
+  int filled = 0;
+  cairo_status_t status = stream_closure_push(closure, data, len, &filled);
+  if (filled) uv_async_send(&closure->async);
+  return status;
+}
+
+/*
+ * Free a chunk once the Buffer wrapping it is collected.
+ */
+
+static void
+freeStreamChunk(char *data, void *chunk) {
+  free(chunk);
+}
+
+/*
+ * Release the stream closure once its async handle is closed.
+ */
+
+static void
+streamClose(uv_handle_t *handle) {
+  stream_closure_t *closure = (stream_closure_t *) handle->data;
+  stream_closure_destroy(closure);
+  free(closure);
+}
+
+/*
+ * Emit the chunks ready so far as (null, buf, len) until the
+ * consumer pauses, the Buffers adopt the chunk memory rather
+ * than copying it. Once the encoder is done and everything
+ * is consumed, "end" or the error follows and the closure
+ * is released. Cancelled streams emit nothing further.
+ */
+
+void
+Canvas::StreamDrain(void *c) {
+  HandleScope scope;
+  stream_closure_t *closure = (stream_closure_t *) c;
+  stream_chunk_t *chunk;
+
+  while (!closure->paused
+    && !closure->cancelled
+    && (chunk = stream_closure_take(closure))) {
+    Buffer *buf = Buffer::New((char *) chunk->data, chunk->len, freeStreamChunk, chunk);
+    Local<Value> argv[3] = {
+        Local<Value>::New(Null())
+      , Local<Value>::New(buf->handle_)
+      , Integer::New(chunk->len) };
+    TryCatch try_catch;
+    closure->closure.pfn->Call(Context::GetCurrent()->Global(), 3, argv);
+    if (try_catch.HasCaught()) FatalException(try_catch);
+  }
+
+  // the pfn may have resumed, and finished, the stream already
+  pthread_mutex_lock(&closure->mutex);
+  int done = closure->done;
+  pthread_mutex_unlock(&closure->mutex);
+  if (!done || closure->ended) return;
+  if (!closure->cancelled && (closure->paused || closure->head)) return;
+  closure->ended = 1;
+
+  if (!closure->cancelled) {
+    TryCatch try_catch;
+    if (closure->closure.status) {
+      Local<Value> argv[1] = { Canvas::Error(closure->closure.status) };
+      closure->closure.pfn->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else {
+      Local<Value> argv[3] = {
+          Local<Value>::New(Null())
+        , Local<Value>::New(Null())
+        , Integer::New(0) };
+      closure->closure.pfn->Call(Context::GetCurrent()->Global(), 3, argv);
+    }
+    if (try_catch.HasCaught()) FatalException(try_catch);
+  }
+
+  // the encoder thread wakes us up once more as it exits
+  if (closure->threaded) pthread_join(closure->thread, NULL);
+  closure->control->SetPointerInInternalField(0, NULL);
+  closure->control.Dispose();
+  closure->closure.canvas->Unref();
+  closure->closure.pfn.Dispose();
+  uv_close((uv_handle_t *) &closure->async, streamClose);
+}
+
+/*
+ * Async handle callback, a chunk filled up.
+ */
+
+static void
+streamFlush(uv_async_t *handle, int status) {
+  Canvas::StreamDrain((stream_closure_t *) handle->data);
+}
+
+/*
+ * Unwrap the stream closure of a control object,
+ * NULL once the stream has ended.
+ */
+
+static stream_closure_t *
+streamControl(const Arguments &args) {
+  return (stream_closure_t *) args.This()->GetPointerFromInternalField(0);
+}
+
+/*
+ * Stop emitting chunks, the encoder waits
+ * once `highWaterMark` bytes are queued.
+ */
+
+static Handle<Value>
+StreamPause(const Arguments &args) {
+  stream_closure_t *closure = streamControl(args);
+  if (closure) closure->paused = 1;
+  return Undefined();
+}
+
+/*
+ * Emit the queued chunks and let the encoder continue.
+ */
+
+static Handle<Value>
+StreamResume(const Arguments &args) {
+  stream_closure_t *closure = streamControl(args);
+  if (closure && closure->paused) {
+    closure->paused = 0;
+    Canvas::StreamDrain(closure);
+  }
+  return Undefined();
+}
+
+/*
+ * Abort encoding and drop the queued chunks,
+ * neither "end" nor an error is emitted.
+ */
+
+static Handle<Value>
+StreamDestroy(const Arguments &args) {
+  stream_closure_t *closure = streamControl(args);
+  if (closure && !closure->cancelled) {
+    stream_closure_cancel(closure);
+    Canvas::StreamDrain(closure);
+  }
+  return Undefined();
+}
+
+/*
+ * Parse the `chunkSize` and `highWaterMark` stream options,
+ * the high water mark is kept at or above the chunk size
+ * so that a full chunk is always ready when the encoder waits.
+ */
+
+static void
+parseStreamOptions(Handle<Object> options, stream_closure_t *closure) {
+  Local<Value> val = options->Get(String::NewSymbol("chunkSize"));
+  if (val->IsNumber() && val->Int32Value() > 0)
+    closure->chunk_size = val->Int32Value();
+
+  val = options->Get(String::NewSymbol("highWaterMark"));
+  if (val->IsNumber() && val->Int32Value() >= 0)
+    closure->high_water_mark = val->Int32Value();
+
+  if (closure->high_water_mark < closure->chunk_size)
+    closure->high_water_mark = closure->chunk_size;
+}
+
+/*
+ * Encode on the stream's own thread, then have the main thread
+ * emit the partial last chunk, followed by "end" or the error,
+ * as soon as the consumer isn't paused.
+ */
+
+static void *
+streamEncode(void *c) {
+  stream_closure_t *closure = (stream_closure_t *) c;
+  cairo_status_t status = encode(&closure->closure, streamAsync, closure);
+  pthread_mutex_lock(&closure->mutex);
+  closure->closure.status = status;
+  closure->done = 1;
+  pthread_mutex_unlock(&closure->mutex);
+  uv_async_send(&closure->async);
+  return NULL;
+}
+
+/*
+ * Start encoding `closure` on a thread of its own, emitting
+ * its output to `fn`. Returns the control object with
+ * pause(), resume() and destroy() methods.
+ */
+
+Local<Object>
+Canvas::queueStream(void *c, Handle<Function> fn) {
+  static Persistent<ObjectTemplate> tpl;
+  if (tpl.IsEmpty()) {
+    tpl = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
+    tpl->SetInternalFieldCount(1);
+    tpl->Set(String::NewSymbol("pause"), FunctionTemplate::New(StreamPause));
+    tpl->Set(String::NewSymbol("resume"), FunctionTemplate::New(StreamResume));
+    tpl->Set(String::NewSymbol("destroy"), FunctionTemplate::New(StreamDestroy));
+  }
+
+  stream_closure_t *closure = (stream_closure_t *) c;
+  Local<Object> control = tpl->NewInstance();
+  control->SetPointerInInternalField(0, closure);
+  closure->control = Persistent<Object>::New(control);
+  willEncode();
+  closure->closure.snapshot = snapshot();
+  closure->closure.pfn = Persistent<Function>::New(fn);
+  uv_async_init(uv_default_loop(), &closure->async, streamFlush);
+  closure->async.data = closure;
+
+  Ref();
+  if (pthread_create(&closure->thread, NULL, streamEncode, closure)) {
+    closure->closure.status = CAIRO_STATUS_NO_MEMORY;
+    closure->done = 1;
+    uv_async_send(&closure->async);
+  } else {
+    closure->threaded = 1;
+  }
+  return control;
+}
+
+/*
+ * Stream PNG data asynchronously, compressing on the thread pool.
+ */
+
+Handle<Value>
+Canvas::StreamPNG(const Arguments &args) {
+  HandleScope scope;
+  int argc = args[0]->IsObject() && !args[0]->IsFunction() ? 1 : 0;
+  if (!args[argc]->IsFunction())
+    return ThrowException(Exception::TypeError(String::New("callback function required")));
+
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  stream_closure_t *closure = (stream_closure_t *) malloc(sizeof(stream_closure_t));
+  if (!closure) return ThrowException(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+  stream_closure_init(closure, canvas);
+  if (argc) {
+    parsePNGOptions(args[0]->ToObject(), &closure->closure.png);
+    parseStreamOptions(args[0]->ToObject(), closure);
+  }
+
+  return scope.Close(canvas->queueStream(closure, Handle<Function>::Cast(args[argc])));
+}
+
+#ifdef HAVE_JPEG
+
+/*
+ * Stream JPEG data asynchronously, compressing on the thread pool.
+ */
+
+Handle<Value>
+Canvas::StreamJPEG(const Arguments &args) {
+  HandleScope scope;
+  closure_t parsed;
+  closure_defaults(&parsed);
+  int argc = parseJPEGStreamArgs(args, &parsed);
+  if (argc < 0)
+    return ThrowException(Exception::TypeError(String::New("callback function required")));
+
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  stream_closure_t *closure = (stream_closure_t *) malloc(sizeof(stream_closure_t));
+  if (!closure) return ThrowException(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+  stream_closure_init(closure, canvas);
+  closure_copy_options(&closure->closure, &parsed);
+  if (argc) parseStreamOptions(args[0]->ToObject(), closure);
+
+  return scope.Close(canvas->queueStream(closure, Handle<Function>::Cast(args[argc])));
+}
+
+#endif
+
+#endif
+
+/*
+ * Stream JPEG data synchronously.
+ */
+
+#ifdef HAVE_JPEG
+
+Handle<Value>
+Canvas::StreamJPEGSync(const Arguments &args) {
+  HandleScope scope;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+  closure_t closure;
+  closure.canvas = canvas;
+  closure.snapshot = NULL;
+  closure_defaults(&closure);
+
+  int argc = parseJPEGStreamArgs(args, &closure);
+  if (argc < 0)
+    return ThrowException(Exception::TypeError(String::New("callback function required")));
+  closure.fn = Handle<Function>::Cast(args[argc]);
+
+  TryCatch try_catch;
+  cairo_status_t status = encode(&closure, streamSync, &closure);
+
+  if (try_catch.HasCaught()) {
+    return try_catch.ReThrow();
+  } else if (status) {
+    Local<Value> argv[1] = { Canvas::Error(status) };
+    closure.fn->Call(Context::GetCurrent()->Global(), 1, argv);
+  } else {
+    Local<Value> argv[3] = {
+        Local<Value>::New(Null())
+      , Local<Value>::New(Null())
+      , Integer::New(0) };
+    closure.fn->Call(Context::GetCurrent()->Global(), 3, argv);
+  }
+  return Undefined();
+}
+
+#endif
+
+/*
+ * Stream the PDF or SVG document as it is drawn, to either:
+ *
+ *  - fn(err, chunk, len), called with each finished PDF page,
+ *    and with a zero `len` once the document is ended
+ *  - a file descriptor, written to directly
+ *
+ * Data written so far is handed over first.
+ */
+
+Handle<Value>
+Canvas::StreamVector(const Arguments &args) {
+  HandleScope scope;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+
+  if (!canvas->isVector())
+    return ThrowException(Exception::TypeError(String::New("only PDF and SVG canvases can be streamed")));
+
+  vector_closure_t *closure = (vector_closure_t *) canvas->closure();
+  if (closure->streaming)
+    return ThrowException(Exception::Error(String::New("the document is already being streamed")));
+
+  if (args[0]->IsNumber()) {
+    int fd = args[0]->Int32Value();
+    cairo_status_t status = writeFd(fd, closure->closure.data, closure->closure.len);
+    if (status) return ThrowException(Canvas::Error(status));
+    closure->closure.len = 0;
+    closure->fd = fd;
+  } else if (args[0]->IsFunction()) {
+    closure->closure.pfn = Persistent<Function>::New(Handle<Function>::Cast(args[0]));
+  } else {
+    return ThrowException(Exception::TypeError(String::New("callback function or file descriptor expected")));
+  }
+
+  closure->streaming = 1;
+  canvas->flushVector();
+  return Undefined();
+}
+
+/*
+ * Finish the PDF or SVG document asynchronously, invoking the
+ * optional callback with (err) once it is written.
+ */
+
+Handle<Value>
+Canvas::EndVector(const Arguments &args) {
+  HandleScope scope;
+  Canvas *canvas = ObjectWrap::Unwrap<Canvas>(args.This());
+
+  if (!canvas->isVector())
+    return ThrowException(Exception::TypeError(String::New("only PDF and SVG canvases can be ended")));
+
+  if (!canvas->ensureWritable()) return Undefined();
+
+  canvas->endVector(args[0]->IsFunction()
+    ? Handle<Function>::Cast(args[0])
+    : Handle<Function>());
+  return Undefined();
+}
+
+/*
+ * Return true when the surface may be used, otherwise throw,
+ * a PDF or SVG document is left alone while being finished.
+ */
+
+bool
+Canvas::ensureWritable() {
+  if (!isVector() || !((vector_closure_t *) _closure)->finishing) return true;
+  ThrowException(Exception::Error(String::New("the document is being finished")));
+  return false;
+}
+
+/*
+ * Hand the document data written so far to the stream callback.
+ */
+
+void
+Canvas::flushVector() {
+  vector_closure_t *closure = (vector_closure_t *) _closure;
+  if (!closure->streaming || closure->fd >= 0 || !closure->closure.len) return;
+  HandleScope scope;
+  unsigned len = closure->closure.len;
+  Buffer *buf = closureBuffer(&closure->closure);
+  Local<Value> argv[3] = {
+      Local<Value>::New(Null())
+    , Local<Value>::New(buf->handle_)
+    , Integer::New(len) };
+  closure->closure.pfn->Call(Context::GetCurrent()->Global(), 3, argv);
+}
+
+/*
+ * Finish the document, on the thread pool when available,
+ * then call vectorEnded(). Drawing must wait until it is done.
+ */
+
+void
+Canvas::endVector(Handle<Function> fn) {
+  vector_closure_t *closure = (vector_closure_t *) _closure;
+  closure->finishing = 1;
+  if (!fn.IsEmpty()) closure->end = Persistent<Function>::New(fn);
+  Ref();
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  uv_work_t *req = new uv_work_t;
+  req->data = this;
+  uv_queue_work(uv_default_loop(), req, EndVectorAsync, EndVectorAsyncAfter);
+#else
+  cairo_surface_finish(_surface);
+  vectorEnded();
+#endif
+}
+
+/*
+ * Flush the end of the document to the stream and invoke
+ * the end callback, with (err) when streaming and
+ * (err, buffer) otherwise.
+ */
+
+void
+Canvas::vectorEnded() {
+  HandleScope scope;
+  vector_closure_t *closure = (vector_closure_t *) _closure;
+  cairo_status_t status = cairo_surface_status(_surface);
+  closure->finishing = 0;
+
+  if (closure->streaming && closure->fd < 0) {
+    flushVector();
+    if (status) {
+      Local<Value> argv[1] = { Canvas::Error(status) };
+      closure->closure.pfn->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else {
+      Local<Value> argv[3] = {
+          Local<Value>::New(Null())
+        , Local<Value>::New(Null())
+        , Integer::New(0) };
+      closure->closure.pfn->Call(Context::GetCurrent()->Global(), 3, argv);
+    }
+  }
+
+  if (!closure->end.IsEmpty()) {
+    Persistent<Function> fn = closure->end;
+    closure->end.Clear();
+    if (status) {
+      Local<Value> argv[1] = { Canvas::Error(status) };
+      fn->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else if (closure->streaming) {
+      Local<Value> argv[1] = { Local<Value>::New(Null()) };
+      fn->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else {
+      Buffer *buf = Buffer::New(closure->closure.len);
+      memcpy(Buffer::Data(buf), closure->closure.data, closure->closure.len);
+      Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(buf->handle_) };
+      fn->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+    fn.Dispose();
+  }
+
+  Unref();
+}
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
+/*
+ * Finish the PDF / SVG surface on the thread pool.
+ */
+
+void
+Canvas::EndVectorAsync(uv_work_t *req) {
+  Canvas *canvas = (Canvas *) req->data;
+  cairo_surface_finish(canvas->surface());
+}
+
+/*
+ * Document finished.
+ */
+
+void
+Canvas::EndVectorAsyncAfter(uv_work_t *req) {
+  Canvas *canvas = (Canvas *) req->data;
+  delete req;
+  canvas->vectorEnded();
+}
+
+#endif
+
+/*
+ * Initialize cairo surface.
  */
 
 Canvas::Canvas(int w, int h, canvas_type_t t): ObjectWrap() {
@@ -384,14 +2232,26 @@ Canvas::Canvas(int w, int h, canvas_type_t t): ObjectWrap() {
   width = w;
   height = h;
   _surface = NULL;
+  _snapshot = NULL;
+  _generation = 0;
+  _cache = NULL;
+  _pending = NULL;
+  _exposed = false;
   _closure = NULL;
+  dirty_init(&_dirty, w, h);
 
-  if (CANVAS_TYPE_PDF == t) {
-    _closure = malloc(sizeof(closure_t));
+  if (isVector()) {
+    _closure = malloc(sizeof(vector_closure_t));
     assert(_closure);
-    cairo_status_t status = closure_init((closure_t *) _closure, this);
+    cairo_status_t status = vector_closure_init((vector_closure_t *) _closure, this);
     assert(status == CAIRO_STATUS_SUCCESS);
-    _surface = cairo_pdf_surface_create_for_stream(toBuffer, _closure, w, h);
+#ifdef CAIRO_HAS_SVG_SURFACE
+    if (CANVAS_TYPE_SVG == t) {
+      _surface = cairo_svg_surface_create_for_stream(vectorWrite, _closure, w, h);
+      return;
+    }
+#endif
+    _surface = cairo_pdf_surface_create_for_stream(vectorWrite, _closure, w, h);
   } else {
     _surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
     assert(_surface);
@@ -404,11 +2264,16 @@ Canvas::Canvas(int w, int h, canvas_type_t t): ObjectWrap() {
  */
 
 Canvas::~Canvas() {
+  if (_snapshot) dropSnapshot(false);
+  encode_cache_clear((encode_cache_t **) &_cache);
+  dirty_destroy(&_dirty);
   switch (type) {
     case CANVAS_TYPE_PDF:
-      closure_destroy((closure_t *) _closure);
-      free(_closure);
+    case CANVAS_TYPE_SVG:
+      // finishing the surface still writes to the closure
       cairo_surface_destroy(_surface);
+      vector_closure_destroy((vector_closure_t *) _closure);
+      free(_closure);
       break;
     case CANVAS_TYPE_IMAGE:
       cairo_surface_destroy(_surface);
@@ -416,36 +2281,112 @@ Canvas::~Canvas() {
   }
 }
 
+/*
+ * Point the context of `canvas`, if any, at `surface`.
+ */
+
+static void
+resetContext(Handle<Object> canvas, cairo_surface_t *surface) {
+  Handle<Value> context = canvas->Get(String::New("context"));
+  if (!context->IsUndefined()) {
+    Context2d *context2d = ObjectWrap::Unwrap<Context2d>(context->ToObject());
+    cairo_t *prev = context2d->context();
+    context2d->setContext(cairo_create(surface));
+    cairo_destroy(prev);
+  }
+}
+
 /*
  * Re-alloc the surface, destroying the previous.
  */
 
 void
 Canvas::resurface(Handle<Object> canvas) {
+  // The SVG surface would be destroyed under the thread finishing it
+  if (!ensureWritable()) return;
+
   switch (type) {
     case CANVAS_TYPE_PDF:
       cairo_pdf_surface_set_size(_surface, width, height);
       break;
+    case CANVAS_TYPE_SVG: {
+#ifdef CAIRO_HAS_SVG_SURFACE
+      // SVG surfaces can't be resized, start the document over
+      // and discard what finishing the previous one writes
+      vector_closure_t *closure = (vector_closure_t *) _closure;
+      int fd = closure->fd;
+      closure->fd = -1;
+      cairo_surface_destroy(_surface);
+      closure->fd = fd;
+      closure->closure.len = 0;
+      _surface = cairo_svg_surface_create_for_stream(vectorWrite, _closure, width, height);
+      resetContext(canvas, _surface);
+#endif
+      break;
+    }
     case CANVAS_TYPE_IMAGE:
+      // In-flight encodes keep the old surface alive
+      ++_generation;
+      if (_snapshot) dropSnapshot(false);
+
       // Re-surface
       int old_width = cairo_image_surface_get_width(_surface);
       int old_height = cairo_image_surface_get_height(_surface);
       cairo_surface_destroy(_surface);
       _surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
       V8::AdjustAmountOfExternalAllocatedMemory(4 * (width * height - old_width * old_height));
+      // views handed out show the old surface only
+      _exposed = false;
 
-      // Reset context
-      Handle<Value> context = canvas->Get(String::New("context"));
-      if (!context->IsUndefined()) {
-        Context2d *context2d = ObjectWrap::Unwrap<Context2d>(context->ToObject());
-        cairo_t *prev = context2d->context();
-        context2d->setContext(cairo_create(surface()));
-        cairo_destroy(prev);
-      }
+      // Fresh pixels are all dirty
+      dirty_destroy(&_dirty);
+      dirty_init(&_dirty, width, height);
+
+      resetContext(canvas, _surface);
       break;
   }
 }
 
+/*
+ * Cache the closure's output unless it failed or the
+ * canvas was drawn to since, raw output is not cached.
+ */
+
+void
+Canvas::cacheEncode(closure_t *closure) {
+  if (!closure->status
+    && closure->generation == _generation
+    && CANVAS_FORMAT_RAW != closure->format) {
+    encode_cache_add((encode_cache_t **) &_cache, closure, closure->generation);
+  }
+}
+
+/*
+ * Return a new reference to a snapshot of the current
+ * pixels, shared by every encode queued before the
+ * next draw. NULL for PDF and SVG canvases.
+ */
+
+snapshot_t *
+Canvas::snapshot() {
+  if (isVector()) return NULL;
+  if (!_snapshot) _snapshot = snapshot_create(_surface);
+  return _snapshot ? snapshot_ref(_snapshot) : NULL;
+}
+
+/*
+ * Release the current snapshot, when `freeze` is set
+ * its pixels are copied out first so that pending
+ * encodes don't see the next draw.
+ */
+
+void
+Canvas::dropSnapshot(bool freeze) {
+  if (freeze) snapshot_freeze(_snapshot);
+  snapshot_unref(_snapshot);
+  _snapshot = NULL;
+}
+
 /*
  * Construct an Error from the given cairo status.
  */
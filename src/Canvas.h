@@ -13,10 +13,14 @@
 #include <node_object_wrap.h>
 #include <node_version.h>
 #include <cairo.h>
+#include "snapshot.h"
+#include "dirty.h"
 
 using namespace v8;
 using namespace node;
 
+struct closure;
+
 /*
  * Maxmimum states per context.
  * TODO: remove/resize
@@ -32,7 +36,8 @@ using namespace node;
 
 typedef enum {
   CANVAS_TYPE_IMAGE,
-  CANVAS_TYPE_PDF
+  CANVAS_TYPE_PDF,
+  CANVAS_TYPE_SVG
 } canvas_type_t;
 
 /*
@@ -48,6 +53,12 @@ class Canvas: public node::ObjectWrap {
     static void Initialize(Handle<Object> target);
     static Handle<Value> New(const Arguments &args);
     static Handle<Value> ToBuffer(const Arguments &args);
+    static Handle<Value> ToTiles(const Arguments &args);
+    static Handle<Value> EncodeBatch(const Arguments &args);
+    static Handle<Value> ToDataURL(const Arguments &args);
+    static Handle<Value> EncodeInto(const Arguments &args);
+    static Handle<Value> GetDirtyRegion(const Arguments &args);
+    static Handle<Value> ResetDirty(const Arguments &args);
     static Handle<Value> GetType(Local<String> prop, const AccessorInfo &info);
     static Handle<Value> GetWidth(Local<String> prop, const AccessorInfo &info);
     static Handle<Value> GetHeight(Local<String> prop, const AccessorInfo &info);
@@ -55,10 +66,26 @@ class Canvas: public node::ObjectWrap {
     static void SetHeight(Local<String> prop, Local<Value> val, const AccessorInfo &info);
     static Handle<Value> StreamPNGSync(const Arguments &args);
     static Handle<Value> StreamJPEGSync(const Arguments &args);
+    static Handle<Value> StreamVector(const Arguments &args);
+    static Handle<Value> EndVector(const Arguments &args);
     static Local<Value> Error(cairo_status_t status);
 #if NODE_VERSION_AT_LEAST(0, 6, 0)
+    static Handle<Value> StreamPNG(const Arguments &args);
+    static Handle<Value> StreamJPEG(const Arguments &args);
+    static void StreamDrain(void *closure);
+    Local<Object> queueStream(void *closure, Handle<Function> fn);
     static void ToBufferAsync(uv_work_t *req);
     static void ToBufferAsyncAfter(uv_work_t *req);
+    static void ToTilesAsync(uv_work_t *req);
+    static void ToTilesAsyncAfter(uv_work_t *req);
+    static void EncodeIntoAsync(uv_work_t *req);
+    static void EncodeIntoAsyncAfter(uv_work_t *req);
+    static void ToDataURLAsync(uv_work_t *req);
+    static void ToDataURLAsyncAfter(uv_work_t *req);
+    static void EncodeBatchAsync(uv_work_t *req);
+    static void EncodeBatchAsyncAfter(uv_work_t *req);
+    static void EndVectorAsync(uv_work_t *req);
+    static void EndVectorAsyncAfter(uv_work_t *req);
 #else
     static
 #if NODE_VERSION_AT_LEAST(0, 5, 4)
@@ -71,16 +98,41 @@ class Canvas: public node::ObjectWrap {
 #endif
 
     inline bool isPDF(){ return CANVAS_TYPE_PDF == type; }
+    inline bool isSVG(){ return CANVAS_TYPE_SVG == type; }
+    inline bool isVector(){ return CANVAS_TYPE_IMAGE != type; }
     inline cairo_surface_t *surface(){ return _surface; }
     inline void *closure(){ return _closure; }
     inline uint8_t *data(){ return cairo_image_surface_get_data(_surface); }
     inline int stride(){ return cairo_image_surface_get_stride(_surface); }
+    inline unsigned generation(){ return _generation; }
+    inline dirty_t *dirty(){ return &_dirty; }
+    inline void willDraw(){
+      ++_generation;
+      if (_snapshot) dropSnapshot(true);
+    }
+    // a writable view may have changed the pixels since
+    inline void willEncode(){
+      if (_exposed) willDraw();
+    }
+    bool ensureWritable();
+    snapshot_t *snapshot();
+    void cacheEncode(struct closure *closure);
+    void flushVector();
+    void endVector(Handle<Function> fn);
+    void vectorEnded();
+    void dropSnapshot(bool freeze);
     Canvas(int width, int height, canvas_type_t type);
     void resurface(Handle<Object> canvas);
 
   private:
     ~Canvas();
     cairo_surface_t *_surface;
+    snapshot_t *_snapshot;
+    dirty_t _dirty;
+    unsigned _generation;
+    bool _exposed;
+    void *_cache;
+    void *_pending;
     void *_closure;
 };
 
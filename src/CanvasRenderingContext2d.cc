@@ -220,6 +220,7 @@ Context2d::restorePath() {
 
 void
 Context2d::fill(bool preserve) {
+  _canvas->willDraw();
   if (state->fillPattern) {
     cairo_set_source(_context, state->fillPattern); 
     cairo_pattern_set_extend(cairo_get_source(_context), CAIRO_EXTEND_REPEAT); 
@@ -231,6 +232,10 @@ Context2d::fill(bool preserve) {
     setSourceRGBA(state->fill);
   }
 
+  double x1, y1, x2, y2;
+  cairo_path_extents(_context, &x1, &y1, &x2, &y2);
+  markDirty(x1, y1, x2, y2);
+
   if (preserve) {
     hasShadow()
       ? shadow(cairo_fill_preserve)
@@ -248,6 +253,7 @@ Context2d::fill(bool preserve) {
 
 void
 Context2d::stroke(bool preserve) {
+  _canvas->willDraw();
   if (state->strokePattern) {
     cairo_set_source(_context, state->strokePattern); 
     cairo_pattern_set_extend(cairo_get_source(_context), CAIRO_EXTEND_REPEAT); 
@@ -258,6 +264,16 @@ Context2d::stroke(bool preserve) {
     setSourceRGBA(state->stroke);
   }
 
+  // cheaper than cairo_stroke_extents(), miters reach
+  // miterLimit half-widths and square caps sqrt(2)
+  double x1, y1, x2, y2;
+  double pad = cairo_get_line_width(_context) / 2;
+  pad *= CAIRO_LINE_JOIN_MITER == cairo_get_line_join(_context)
+    ? fmax(cairo_get_miter_limit(_context), M_SQRT2)
+    : M_SQRT2;
+  cairo_path_extents(_context, &x1, &y1, &x2, &y2);
+  markDirty(x1 - pad, y1 - pad, x2 + pad, y2 + pad);
+
   if (preserve) {
     hasShadow()
       ? shadow(cairo_stroke_preserve)
@@ -333,6 +349,53 @@ Context2d::hasShadow() {
     && (state->shadowBlur || state->shadowOffsetX || state->shadowOffsetY);
 }
 
+/*
+ * Mark the device-space bounds of the user-space box
+ * (x1, y1, x2, y2) dirty, grown to cover the shadow when
+ * `shadowed` is set. Unbounded operators touch every
+ * pixel, so they mark the whole canvas.
+ */
+
+void
+Context2d::markDirty(double x1, double y1, double x2, double y2, bool shadowed) {
+  dirty_t *dirty = _canvas->dirty();
+
+  switch (cairo_get_operator(_context)) {
+    case CAIRO_OPERATOR_IN:
+    case CAIRO_OPERATOR_OUT:
+    case CAIRO_OPERATOR_DEST_IN:
+    case CAIRO_OPERATOR_DEST_ATOP:
+      dirty_mark_all(dirty);
+      return;
+    default:
+      break;
+  }
+
+  // the shadow is offset in user space, blurred in device
+  // space, and blur() makes three passes of its radius
+  double blur = 0;
+  if (shadowed && hasShadow()) {
+    x1 = fmin(x1, x1 + state->shadowOffsetX);
+    y1 = fmin(y1, y1 + state->shadowOffsetY);
+    x2 = fmax(x2, x2 + state->shadowOffsetX);
+    y2 = fmax(y2, y2 + state->shadowOffsetY);
+    blur = 3 * state->shadowBlur;
+  }
+
+  double xs[4] = { x1, x2, x1, x2 }
+    , ys[4] = { y1, y1, y2, y2 };
+
+  for (int i = 0; i < 4; ++i)
+    cairo_user_to_device(_context, &xs[i], &ys[i]);
+
+  dirty_mark(
+      dirty
+    , fmin(fmin(xs[0], xs[1]), fmin(xs[2], xs[3])) - blur
+    , fmin(fmin(ys[0], ys[1]), fmin(ys[2], ys[3])) - blur
+    , fmax(fmax(xs[0], xs[1]), fmax(xs[2], xs[3])) + blur
+    , fmax(fmax(ys[0], ys[1]), fmax(ys[2], ys[3])) + blur);
+}
+
 /*
  * Blur the given surface with the given radius.
  */
@@ -424,7 +487,9 @@ Context2d::AddPage(const Arguments &args) {
   if (!context->canvas()->isPDF()) {
     return ThrowException(Exception::Error(String::New("only PDF canvases support .nextPage()")));
   }
+  if (!context->canvas()->ensureWritable()) return Undefined();
   cairo_show_page(context->context());
+  context->canvas()->flushVector();
   return Undefined();
 }
 
@@ -447,7 +512,9 @@ Context2d::PutImageData(const Arguments &args) {
   Context2d *context = ObjectWrap::Unwrap<Context2d>(args.This());
   ImageData *imageData = ObjectWrap::Unwrap<ImageData>(obj);
   PixelArray *arr = imageData->pixelArray();
-  
+
+  if (!context->canvas()->ensureWritable()) return Undefined();
+  context->canvas()->willDraw();
   uint8_t *src = arr->data();
   uint8_t *dst = context->canvas()->data();
 
@@ -489,6 +556,8 @@ Context2d::PutImageData(const Arguments &args) {
       return ThrowException(Exception::Error(String::New("invalid arguments")));
   }
 
+  dirty_mark(context->canvas()->dirty(), dx, dy, dx + cols, dy + rows);
+
   uint8_t *srcRows = src + sy * srcStride + sx * 4;
   for (int y = 0; y < rows; ++y) {
     uint32_t *row = (uint32_t *)(dst + dstStride * (y + dy));
@@ -605,8 +674,12 @@ Context2d::DrawImage(const Arguments &args) {
   }
 
   // Start draw
+  if (!context->canvas()->ensureWritable()) return Undefined();
+  context->canvas()->willDraw();
   cairo_save(ctx);
 
+  context->markDirty(dx, dy, dx + dw, dy + dh, false);
+
   context->savePath();
   cairo_rectangle(ctx, dx, dy, dw, dh);
   cairo_clip(ctx);
@@ -1437,6 +1510,7 @@ Handle<Value>
 Context2d::Fill(const Arguments &args) {
   HandleScope scope;
   Context2d *context = ObjectWrap::Unwrap<Context2d>(args.This());
+  if (!context->canvas()->ensureWritable()) return Undefined();
   context->fill(true);
   return Undefined();
 }
@@ -1449,6 +1523,7 @@ Handle<Value>
 Context2d::Stroke(const Arguments &args) {
   HandleScope scope;
   Context2d *context = ObjectWrap::Unwrap<Context2d>(args.This());
+  if (!context->canvas()->ensureWritable()) return Undefined();
   context->stroke(true);
   return Undefined();
 }
@@ -1469,6 +1544,7 @@ Context2d::FillText(const Arguments &args) {
   double y = args[2]->NumberValue();
 
   Context2d *context = ObjectWrap::Unwrap<Context2d>(args.This());
+  if (!context->canvas()->ensureWritable()) return Undefined();
 
   context->savePath();
   if (context->state->textDrawingMode == TEXT_DRAW_GLYPHS) {
@@ -1499,6 +1575,7 @@ Context2d::StrokeText(const Arguments &args) {
   double y = args[2]->NumberValue();
   
   Context2d *context = ObjectWrap::Unwrap<Context2d>(args.This());
+  if (!context->canvas()->ensureWritable()) return Undefined();
 
   context->savePath();
   if (context->state->textDrawingMode == TEXT_DRAW_GLYPHS) {
@@ -1565,6 +1642,14 @@ Context2d::setTextPath(const char *str, double x, double y) {
   if (state->textDrawingMode == TEXT_DRAW_PATHS) {
     cairo_text_path(_context, str);
   } else if (state->textDrawingMode == TEXT_DRAW_GLYPHS) {
+    _canvas->willDraw();
+    cairo_text_extents(_context, str, &te);
+    markDirty(
+        x + te.x_bearing
+      , y + te.y_bearing
+      , x + te.x_bearing + te.width
+      , y + te.y_bearing + te.height
+      , false);
     cairo_show_text(_context, str);
   }
 }
@@ -1767,6 +1852,7 @@ Context2d::FillRect(const Arguments &args) {
   RECT_ARGS;
   if (0 == width || 0 == height) return Undefined();
   Context2d *context = ObjectWrap::Unwrap<Context2d>(args.This());
+  if (!context->canvas()->ensureWritable()) return Undefined();
   cairo_t *ctx = context->context();
   context->savePath();
   cairo_rectangle(ctx, x, y, width, height);
@@ -1785,6 +1871,7 @@ Context2d::StrokeRect(const Arguments &args) {
   RECT_ARGS;
   if (0 == width && 0 == height) return Undefined();
   Context2d *context = ObjectWrap::Unwrap<Context2d>(args.This());
+  if (!context->canvas()->ensureWritable()) return Undefined();
   cairo_t *ctx = context->context();
   context->savePath();
   cairo_rectangle(ctx, x, y, width, height);
@@ -1804,10 +1891,13 @@ Context2d::ClearRect(const Arguments &args) {
   if (0 == width || 0 == height) return Undefined();
   Context2d *context = ObjectWrap::Unwrap<Context2d>(args.This());
   cairo_t *ctx = context->context();
+  if (!context->canvas()->ensureWritable()) return Undefined();
+  context->canvas()->willDraw();
   cairo_save(ctx);
   context->savePath();
   cairo_rectangle(ctx, x, y, width, height);
   cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
+  context->markDirty(x, y, x + width, y + height, false);
   cairo_fill(ctx);
   context->restorePath();
   cairo_restore(ctx);
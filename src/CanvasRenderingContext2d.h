@@ -123,6 +123,7 @@ class Context2d: public node::ObjectWrap {
     void setTextPath(const char *str, double x, double y);
     void blur(cairo_surface_t *surface, int radius);
     void shadow(void (fn)(cairo_t *cr));
+    void markDirty(double x1, double y1, double x2, double y2, bool shadowed = true);
     void shadowStart();
     void shadowApply();
     void savePath();
@@ -7,11 +7,27 @@
 
 #include "Canvas.h"
 #include "Image.h"
+#include "downscale.h"
+#include "cpu.h"
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <png.h>
 #include <node_buffer.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_SSSE3
+#include <tmmintrin.h>
+#endif
+
 #ifdef HAVE_GIF
 #include <gif_lib.h>
 typedef struct {
@@ -30,8 +46,26 @@ Persistent<FunctionTemplate> Image::constructor;
 typedef struct {
   unsigned len;
   uint8_t *buf;
+  unsigned max_len;
 } read_closure_t;
 
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
+/*
+ * Thread pool decode of an Image, `buffer` keeps
+ * the source Buffer alive while `buf` is read.
+ */
+
+typedef struct {
+  Image *image;
+  Persistent<Object> buffer;
+  uint8_t *buf;
+  unsigned len;
+  cairo_status_t status;
+} load_closure_t;
+
+#endif
+
 /*
  * Setup error handler struct for gracefully dealing with jpeg errors.
  */
@@ -92,12 +126,63 @@ Image::Initialize(Handle<Object> target) {
   proto->SetAccessor(String::NewSymbol("height"), GetHeight);
   proto->SetAccessor(String::NewSymbol("onload"), GetOnload, SetOnload);
   proto->SetAccessor(String::NewSymbol("onerror"), GetOnerror, SetOnerror);
+  proto->SetAccessor(String::NewSymbol("decodeSize"), GetDecodeSize, SetDecodeSize);
 #if CAIRO_VERSION_MINOR >= 10
   proto->SetAccessor(String::NewSymbol("dataMode"), GetDataMode, SetDataMode);
   constructor->Set(String::NewSymbol("MODE_IMAGE"), Number::New(1));
   constructor->Set(String::NewSymbol("MODE_MIME"), Number::New(2));
 #endif
-  target->Set(String::NewSymbol("Image"), constructor->GetFunction());
+
+  // Decoded image cache
+  Local<Function> ctor = constructor->GetFunction();
+  ctor->Set(String::NewSymbol("setCacheLimit"), FunctionTemplate::New(SetCacheLimit)->GetFunction());
+  ctor->Set(String::NewSymbol("getCacheStats"), FunctionTemplate::New(GetCacheStats)->GetFunction());
+  ctor->Set(String::NewSymbol("clearCache"), FunctionTemplate::New(ClearCache)->GetFunction());
+  target->Set(String::NewSymbol("Image"), ctor);
+}
+
+/*
+ * Set the decoded image cache budget in bytes, least recently
+ * used surfaces are evicted beyond it. 0, the default, disables
+ * the cache.
+ */
+
+Handle<Value>
+Image::SetCacheLimit(const Arguments &args) {
+  HandleScope scope;
+  if (!args[0]->IsNumber() || args[0]->NumberValue() < 0)
+    return ThrowException(Exception::TypeError(String::New("cache limit in bytes required")));
+  image_cache_set_limit((size_t) args[0]->NumberValue());
+  return Undefined();
+}
+
+/*
+ * Return the decoded image cache statistics.
+ */
+
+Handle<Value>
+Image::GetCacheStats(const Arguments &args) {
+  HandleScope scope;
+  image_cache_stats_t stats;
+  image_cache_stats(&stats);
+  Local<Object> obj = Object::New();
+  obj->Set(String::NewSymbol("hits"), Number::New(stats.hits));
+  obj->Set(String::NewSymbol("misses"), Number::New(stats.misses));
+  obj->Set(String::NewSymbol("evictions"), Number::New(stats.evictions));
+  obj->Set(String::NewSymbol("entries"), Number::New(stats.entries));
+  obj->Set(String::NewSymbol("bytes"), Number::New(stats.bytes));
+  obj->Set(String::NewSymbol("limit"), Number::New(stats.limit));
+  return scope.Close(obj);
+}
+
+/*
+ * Empty the decoded image cache, images keep their surfaces.
+ */
+
+Handle<Value>
+Image::ClearCache(const Arguments &args) {
+  image_cache_clear();
+  return Undefined();
 }
 
 /*
@@ -162,6 +247,40 @@ Image::SetDataMode(Local<String>, Local<Value> val, const AccessorInfo &info) {
 
 #endif
 
+/*
+ * Get decodeSize, null unless set.
+ */
+
+Handle<Value>
+Image::GetDecodeSize(Local<String>, const AccessorInfo &info) {
+  HandleScope scope;
+  Image *img = ObjectWrap::Unwrap<Image>(info.This());
+  if (!img->decode_width && !img->decode_height) return Null();
+  Local<Object> size = Object::New();
+  size->Set(String::NewSymbol("width"), Number::New(img->decode_width));
+  size->Set(String::NewSymbol("height"), Number::New(img->decode_height));
+  return scope.Close(size);
+}
+
+/*
+ * Set decodeSize, the smallest size the image is needed at.
+ * Images are reduced while decoding to no less than this,
+ * null decodes at full size.
+ */
+
+void
+Image::SetDecodeSize(Local<String>, Local<Value> val, const AccessorInfo &info) {
+  Image *img = ObjectWrap::Unwrap<Image>(info.This());
+  img->decode_width = img->decode_height = 0;
+  if (val->IsObject()) {
+    Local<Object> size = val->ToObject();
+    Local<Value> width = size->Get(String::NewSymbol("width"));
+    Local<Value> height = size->Get(String::NewSymbol("height"));
+    if (width->IsNumber() && width->Int32Value() > 0) img->decode_width = width->Int32Value();
+    if (height->IsNumber() && height->Int32Value() > 0) img->decode_height = height->Int32Value();
+  }
+}
+
 /*
  * Get width.
  */
@@ -170,7 +289,7 @@ Handle<Value>
 Image::GetWidth(Local<String>, const AccessorInfo &info) {
   HandleScope scope;
   Image *img = ObjectWrap::Unwrap<Image>(info.This());
-  return scope.Close(Number::New(img->width));
+  return scope.Close(Number::New(img->_decoding ? 0 : img->width));
 }
 /*
  * Get height.
@@ -180,7 +299,7 @@ Handle<Value>
 Image::GetHeight(Local<String>, const AccessorInfo &info) {
   HandleScope scope;
   Image *img = ObjectWrap::Unwrap<Image>(info.This());
-  return scope.Close(Number::New(img->height));
+  return scope.Close(Number::New(img->_decoding ? 0 : img->height));
 }
 
 /*
@@ -210,6 +329,10 @@ Image::clearData() {
   free(_data);
   _data = NULL;
 
+  free(_error);
+  _error = NULL;
+  _cached = false;
+
   width = height = 0;
 
   free(filename);
@@ -226,31 +349,149 @@ void
 Image::SetSource(Local<String>, Local<Value> val, const AccessorInfo &info) {
   HandleScope scope;
   Image *img = ObjectWrap::Unwrap<Image>(info.This());
-  cairo_status_t status = CAIRO_STATUS_READ_ERROR;
 
-  img->clearData();
+  // the decode in flight is discarded once it is done
+  if (img->_decoding) {
+    if (!img->_next_src.IsEmpty()) img->_next_src.Dispose();
+    img->_next_src = Persistent<Value>::New(val);
+    return;
+  }
+
+  img->setSource(val);
+}
+
+/*
+ * Load the image from a path or Buffer. With an onload
+ * handler assigned it is decoded on the thread pool and
+ * remains LOADING until then, otherwise right away.
+ */
+
+void
+Image::setSource(Handle<Value> val) {
+  HandleScope scope;
+  uint8_t *buf = NULL;
+  unsigned len = 0;
+
+  clearData();
+  _decode_width = decode_width;
+  _decode_height = decode_height;
+  _data_mode = data_mode;
 
   // url string
   if (val->IsString()) {
     String::AsciiValue src(val);
-    if (img->filename) free(img->filename);
-    img->filename = strdup(*src);
-    status = img->load();
+    filename = strdup(*src);
   // Buffer
   } else if (Buffer::HasInstance(val)) {
-    uint8_t *buf = (uint8_t *) Buffer::Data(val->ToObject());
-    unsigned len = Buffer::Length(val->ToObject());
-    status = img->loadFromBuffer(buf, len);
+    buf = (uint8_t *) Buffer::Data(val->ToObject());
+    len = Buffer::Length(val->ToObject());
+  } else {
+    error(Canvas::Error(CAIRO_STATUS_READ_ERROR));
+    return;
+  }
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+  if (!onload.IsEmpty()) {
+    load_closure_t *closure = (load_closure_t *) malloc(sizeof(load_closure_t));
+    if (!closure) {
+      error(Canvas::Error(CAIRO_STATUS_NO_MEMORY));
+      return;
+    }
+    closure->image = this;
+    closure->buffer = buf
+      ? Persistent<Object>::New(val->ToObject())
+      : Persistent<Object>();
+    closure->buf = buf;
+    closure->len = len;
+    closure->status = CAIRO_STATUS_SUCCESS;
+
+    state = LOADING;
+    _decoding = true;
+    Ref();
+    uv_work_t *req = new uv_work_t;
+    req->data = closure;
+    uv_queue_work(uv_default_loop(), req, LoadAsync, LoadAsyncAfter);
+    return;
+  }
+#endif
+
+  finishLoad(buf ? loadBuffer(buf, len) : load());
+}
+
+/*
+ * Report a decode on the main thread: the mime data memory and
+ * JPEG error recorded while decoding, then onerror or onload.
+ */
+
+void
+Image::finishLoad(cairo_status_t status) {
+  HandleScope scope;
+
+  V8::AdjustAmountOfExternalAllocatedMemory(_mime_len);
+  _mime_len = 0;
+
+  if (_error) {
+    state = INVALID;
+    error(Exception::Error(String::New(_error)));
+    free(_error);
+    _error = NULL;
   }
 
-  // check status
   if (status) {
-    img->error(Canvas::Error(status));
+    error(Canvas::Error(status));
+  } else {
+    loaded();
+  }
+}
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
+/*
+ * Decode on the thread pool, without touching V8.
+ */
+
+void
+Image::LoadAsync(uv_work_t *req) {
+  load_closure_t *closure = (load_closure_t *) req->data;
+  Image *img = closure->image;
+  closure->status = closure->buf
+    ? img->loadBuffer(closure->buf, closure->len)
+    : img->loadSurface();
+}
+
+/*
+ * Hand the decoded surface back, or load the src
+ * assigned while decoding instead.
+ */
+
+void
+Image::LoadAsyncAfter(uv_work_t *req) {
+  HandleScope scope;
+  load_closure_t *closure = (load_closure_t *) req->data;
+  Image *img = closure->image;
+  delete req;
+
+  img->_decoding = false;
+  if (!closure->buffer.IsEmpty()) closure->buffer.Dispose();
+
+  if (img->_next_src.IsEmpty()) {
+    img->finishLoad(closure->status);
   } else {
-    img->loaded();
+    Local<Value> src = Local<Value>::New(img->_next_src);
+    img->_next_src.Dispose();
+    img->_next_src.Clear();
+    // the mime data is released along with the surface
+    V8::AdjustAmountOfExternalAllocatedMemory(img->_mime_len);
+    img->_mime_len = 0;
+    img->setSource(src);
   }
+
+  img->Unref();
+  free(closure);
 }
 
+#endif
+
 /*
  * Load image data from `buf` by sniffing
  * the bytes to determine format.
@@ -258,7 +499,8 @@ Image::SetSource(Local<String>, Local<Value> val, const AccessorInfo &info) {
 
 cairo_status_t
 Image::loadFromBuffer(uint8_t *buf, unsigned len) {
-  if (isPNG(buf)) return loadPNGFromBuffer(buf);
+  if (len < 5) return CAIRO_STATUS_READ_ERROR;
+  if (isPNG(buf)) return loadPNGFromBuffer(buf, len);
 #ifdef HAVE_GIF
   if (isGIF(buf)) return loadGIFFromBuffer(buf, len);
 #endif
@@ -267,7 +509,7 @@ Image::loadFromBuffer(uint8_t *buf, unsigned len) {
   if (isJPEG(buf)) return loadJPEGFromBuffer(buf, len);    
 #else
   if (isJPEG(buf)) {
-    switch (data_mode) {
+    switch (_data_mode) {
       case DATA_IMAGE:
         return loadJPEGFromBuffer(buf, len);
       case DATA_MIME:
@@ -285,20 +527,149 @@ Image::loadFromBuffer(uint8_t *buf, unsigned len) {
 }
 
 /*
- * Load PNG data from `buf`.
+ * Load PNG data from `buf`, reduced for `decodeSize`.
  */
 
 cairo_status_t
-Image::loadPNGFromBuffer(uint8_t *buf) {
+Image::loadPNGFromBuffer(uint8_t *buf, unsigned len) {
+  if (_decode_width > 0 || _decode_height > 0) {
+    cairo_status_t status = decodePNGRows(buf, len);
+    if (status || _surface) return status;
+  }
+
   read_closure_t closure;
   closure.len = 0;
   closure.buf = buf;
+  closure.max_len = len;
   _surface = cairo_image_surface_create_from_png_stream(readPNG, &closure);
   cairo_status_t status = cairo_surface_status(_surface);
   if (status) return status;
+
+  // interlaced images are reduced once decoded
+  int factor = downscale_factor(
+      cairo_image_surface_get_width(_surface)
+    , cairo_image_surface_get_height(_surface)
+    , _decode_width
+    , _decode_height
+    , DOWNSCALE_MAX_FACTOR);
+  if (factor > 1) {
+    cairo_surface_t *reduced = downscale_surface(_surface, factor);
+    cairo_surface_destroy(_surface);
+    _surface = reduced;
+    if (!_surface) return CAIRO_STATUS_NO_MEMORY;
+  }
+
   return CAIRO_STATUS_SUCCESS;
 }
 
+/*
+ * libpng read callback for decodePNGRows().
+ */
+
+static void
+readPNGRows(png_structp png, png_bytep data, png_size_t len) {
+  read_closure_t *closure = (read_closure_t *) png_get_io_ptr(png);
+  if (len > closure->max_len - closure->len) png_error(png, "unexpected end of PNG data");
+  memcpy(data, closure->buf + closure->len, len);
+  closure->len += len;
+}
+
+/*
+ * Decode PNG data from `buf` a row at a time, box reducing
+ * the rows for `decodeSize` as they are read so the full
+ * image is never held. Leaves _surface NULL when there is
+ * nothing to reduce or the PNG is interlaced.
+ */
+
+cairo_status_t
+Image::decodePNGRows(uint8_t *buf, unsigned len) {
+  read_closure_t closure;
+  closure.len = 0;
+  closure.buf = buf;
+  closure.max_len = len;
+
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png) return CAIRO_STATUS_NO_MEMORY;
+  png_infop info = png_create_info_struct(png);
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    return CAIRO_STATUS_NO_MEMORY;
+  }
+
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return CAIRO_STATUS_READ_ERROR;
+  }
+
+  png_set_read_fn(png, &closure, readPNGRows);
+  png_read_info(png, info);
+
+  png_uint_32 w, h;
+  int depth, color_type, interlace;
+  png_get_IHDR(png, info, &w, &h, &depth, &color_type, &interlace, NULL, NULL);
+
+  int factor = downscale_factor(w, h, _decode_width, _decode_height, DOWNSCALE_MAX_FACTOR);
+  if (1 == factor || PNG_INTERLACE_NONE != interlace) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return CAIRO_STATUS_SUCCESS;
+  }
+
+  // expand to 8-bit RGBA, as cairo does
+  if (PNG_COLOR_TYPE_PALETTE == color_type) png_set_palette_to_rgb(png);
+  if (PNG_COLOR_TYPE_GRAY == color_type && depth < 8) png_set_expand_gray_1_2_4_to_8(png);
+  if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+  if (16 == depth) png_set_strip_16(png);
+  if (depth < 8) png_set_packing(png);
+  if (PNG_COLOR_TYPE_GRAY == color_type || PNG_COLOR_TYPE_GRAY_ALPHA == color_type)
+    png_set_gray_to_rgb(png);
+  png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+  png_read_update_info(png, info);
+
+  downscale_t scale;
+  uint8_t *row = (uint8_t *) malloc(w * 4);
+  if (!row || downscale_init(&scale, w, h, factor)) {
+    free(row);
+    png_destroy_read_struct(&png, &info, NULL);
+    return CAIRO_STATUS_NO_MEMORY;
+  }
+
+  if (setjmp(png_jmpbuf(png))) {
+    free(row);
+    downscale_destroy(&scale);
+    png_destroy_read_struct(&png, &info, NULL);
+    return CAIRO_STATUS_READ_ERROR;
+  }
+
+  for (png_uint_32 y = 0; y < h; ++y) {
+    png_read_row(png, row, NULL);
+
+    // premultiply RGBA bytes into ARGB32 in place
+    uint8_t *src = row;
+    uint32_t *dst = (uint32_t *) row;
+    for (png_uint_32 x = 0; x < w; ++x, src += 4) {
+      uint8_t a = src[3];
+      uint32_t r = src[0], g = src[1], b = src[2];
+      if (a != 255) {
+        r = r * a + 0x80, r = (r + (r >> 8)) >> 8;
+        g = g * a + 0x80, g = (g + (g >> 8)) >> 8;
+        b = b * a + 0x80, b = (b + (b >> 8)) >> 8;
+      }
+      *dst++ = a << 24 | r << 16 | g << 8 | b;
+    }
+
+    downscale_row(&scale, (uint32_t *) row);
+  }
+
+  png_destroy_read_struct(&png, &info, NULL);
+  free(row);
+
+  _surface = downscale_finish(&scale);
+  downscale_destroy(&scale);
+  return _surface
+    ? CAIRO_STATUS_SUCCESS
+    : CAIRO_STATUS_NO_MEMORY;
+}
+
 /*
  * Read PNG data.
  */
@@ -306,6 +677,7 @@ Image::loadPNGFromBuffer(uint8_t *buf) {
 cairo_status_t
 Image::readPNG(void *c, uint8_t *data, unsigned int len) {
   read_closure_t *closure = (read_closure_t *) c;
+  if (len > closure->max_len - closure->len) return CAIRO_STATUS_READ_ERROR;
   memcpy(data, closure->buf + closure->len, len);
   closure->len += len;
   return CAIRO_STATUS_SUCCESS;
@@ -361,8 +733,15 @@ Image::SetOnerror(Local<String>, Local<Value> val, const AccessorInfo &info) {
 
 Image::Image() {
   filename = NULL;
+  decode_width = decode_height = 0;
+  _decode_width = _decode_height = 0;
+  _data_mode = DATA_IMAGE;
   _data = NULL;
   _data_len = 0;
+  _mime_len = 0;
+  _error = NULL;
+  _decoding = false;
+  _cached = false;
   _surface = NULL;
   width = height = 0;
   state = DEFAULT;
@@ -374,6 +753,7 @@ Image::Image() {
 
 Image::~Image() {
   clearData();
+  if (!_next_src.IsEmpty()) _next_src.Dispose();
 }
 
 /*
@@ -399,7 +779,8 @@ Image::loaded() {
 
   width = cairo_image_surface_get_width(_surface);
   height = cairo_image_surface_get_height(_surface);
-  _data_len = height * cairo_image_surface_get_stride(_surface);
+  // the image cache accounts for shared surfaces
+  _data_len = _cached ? 0 : height * cairo_image_surface_get_stride(_surface);
   V8::AdjustAmountOfExternalAllocatedMemory(_data_len);
 
   // At this point we have a valid surface, but may have errored out
@@ -437,47 +818,108 @@ Image::error(Local<Value> err) {
 }
 
 /*
- * Load cairo surface from the image src.
+ * Load cairo surface from the image src. The file is
+ * mapped and decoded in place like a Buffer source.
  * 
  * TODO: support more formats
- * TODO: use node IO or at least thread pool
  */
 
 cairo_status_t
 Image::loadSurface() {
-  FILE *stream = fopen(filename, "r");
-  if (!stream) return CAIRO_STATUS_READ_ERROR;
-  uint8_t buf[5];
-  if (1 != fread(&buf, 5, 1, stream)) return CAIRO_STATUS_READ_ERROR;
-  fseek(stream, 0, SEEK_SET);
-
-  // png
-  if (isPNG(buf)) {
-    fclose(stream);
-    return loadPNG();
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return CAIRO_STATUS_READ_ERROR;
+
+  struct stat s;
+  if (fstat(fd, &s) < 0 || s.st_size < 5 || s.st_size > UINT_MAX) {
+    close(fd);
+    return CAIRO_STATUS_READ_ERROR;
   }
 
-  // gif
-#ifdef HAVE_GIF
-  if (isGIF(buf)) return loadGIF(stream);
-#endif
+  image_cache_key_t key;
+  bool cache = useCache();
+  if (cache) {
+    key.path = filename;
+    key.data = NULL;
+    key.hash = image_cache_hash((uint8_t *) filename, strlen(filename));
+    key.mtime = s.st_mtime;
+    key.size = s.st_size;
+    if (cacheHit(&key)) {
+      close(fd);
+      return CAIRO_STATUS_SUCCESS;
+    }
+  }
 
-  // jpeg
-#ifdef HAVE_JPEG
-  if (isJPEG(buf)) return loadJPEG(stream);
-#endif
+  void *buf = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == buf) return CAIRO_STATUS_READ_ERROR;
+  madvise(buf, s.st_size, MADV_SEQUENTIAL);
 
-  return CAIRO_STATUS_READ_ERROR;
+  cairo_status_t status = loadFromBuffer((uint8_t *) buf, s.st_size);
+  munmap(buf, s.st_size);
+  if (cache && !status) cacheSurface(&key);
+  return status;
 }
 
 /*
- * Load PNG.
+ * Load a Buffer source, through the image cache
+ * keyed by its contents when enabled.
  */
 
 cairo_status_t
-Image::loadPNG() {
-  _surface = cairo_image_surface_create_from_png(filename);
-  return cairo_surface_status(_surface);
+Image::loadBuffer(uint8_t *buf, unsigned len) {
+  if (!useCache()) return loadFromBuffer(buf, len);
+
+  image_cache_key_t key;
+  key.path = NULL;
+  key.data = buf;
+  key.hash = image_cache_hash(buf, len);
+  key.mtime = 0;
+  key.size = len;
+  if (cacheHit(&key)) return CAIRO_STATUS_SUCCESS;
+
+  cairo_status_t status = loadFromBuffer(buf, len);
+  if (!status) cacheSurface(&key);
+  return status;
+}
+
+/*
+ * Check if the decoded surface may come from, and go to,
+ * the image cache. Surfaces carrying mime data are not shared.
+ */
+
+bool
+Image::useCache() {
+  return DATA_IMAGE == _data_mode && image_cache_enabled();
+}
+
+/*
+ * Share the surface cached for `key`, completed with the decodeSize.
+ */
+
+bool
+Image::cacheHit(image_cache_key_t *key) {
+  key->width = _decode_width;
+  key->height = _decode_height;
+  _surface = image_cache_get(key);
+  return _cached = NULL != _surface;
+}
+
+/*
+ * Cache the surface just decoded for `key`. Later hits share it,
+ * so it takes over the pixel data first. JPEG error fallbacks
+ * are not cached.
+ */
+
+static cairo_user_data_key_t image_data_key;
+
+void
+Image::cacheSurface(image_cache_key_t *key) {
+  if (_error) return;
+  if (_data) {
+    if (cairo_surface_set_user_data(_surface, &image_data_key, _data, free)) return;
+    _data = NULL;
+  }
+  _cached = image_cache_put(key, _surface);
 }
 
 // GIF support
@@ -513,38 +955,6 @@ read_gif_from_memory(GifFileType *gif, GifByteType *buf, int len) {
   return len;
 }
 
-/*
- * Load GIF.
- */
-
-cairo_status_t
-Image::loadGIF(FILE *stream) {
-  struct stat s;
-  int fd = fileno(stream);
-
-  // stat
-  if (fstat(fd, &s) < 0) {
-    fclose(stream);
-    return CAIRO_STATUS_READ_ERROR;
-  } 
-
-  uint8_t *buf = (uint8_t *) malloc(s.st_size);
-
-  if (!buf) {
-    fclose(stream);
-    return CAIRO_STATUS_NO_MEMORY;
-  }
-
-  size_t read = fread(buf, s.st_size, 1, stream);
-  fclose(stream);
-
-  cairo_status_t result = CAIRO_STATUS_READ_ERROR;
-  if (1 == read) result = loadGIFFromBuffer(buf, s.st_size);
-  free(buf);
-
-  return result;
-}
-
 /*
  * Load give from `buf` and the given `len`.
  */
@@ -567,12 +977,6 @@ Image::loadGIFFromBuffer(uint8_t *buf, unsigned len) {
   width = gif->SWidth;
   height = gif->SHeight;
 
-  uint8_t *data = (uint8_t *) malloc(width * height * 4);
-  if (!data) {
-    DGifCloseFile(gif);
-    return CAIRO_STATUS_NO_MEMORY;
-  }
-
   GifImageDesc *img = &gif->SavedImages[i].ImageDesc;
 
   // local colormap takes precedence over global
@@ -586,73 +990,81 @@ Image::loadGIFFromBuffer(uint8_t *buf, unsigned len) {
   else if(alphaColor >= 0) bgColor = alphaColor;
 
   uint8_t *src_data = (uint8_t*) gif->SavedImages[i].RasterBits;
-  uint32_t *dst_data = (uint32_t*) data;
-
-  if (!gif->Image.Interlace) {
-    if (width == img->Width && height == img->Height) {
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          *dst_data = ((*src_data == alphaColor) ? 0 : 255) << 24
-            | colormap->Colors[*src_data].Red << 16
-            | colormap->Colors[*src_data].Green << 8
-            | colormap->Colors[*src_data].Blue;
-
-          dst_data++;
-          src_data++;
-        }
-      }
-    } else {
-      // Image does not take up whole "screen" so we need to fill-in the background
-      int bottom = img->Top + img->Height;
-      int right = img->Left + img->Width;
-
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          if (y < img->Top || y >= bottom || x < img->Left || x >= right) {
-            *dst_data = ((bgColor == alphaColor) ? 0 : 255) << 24
-              | colormap->Colors[bgColor].Red << 16
-              | colormap->Colors[bgColor].Green << 8
-              | colormap->Colors[bgColor].Blue;
-          } else {
-            *dst_data = ((*src_data == alphaColor) ? 0 : 255) << 24
-              | colormap->Colors[*src_data].Red << 16
-              | colormap->Colors[*src_data].Green << 8
-              | colormap->Colors[*src_data].Blue;
-          }
-
-          dst_data++;
-          src_data++;
-        }
-      } 
-    }
-  } else { 
-    // Image is interlaced so that it streams nice over 14.4k and 28.8k modems :)
-    // We first load in 1/8 of the image, followed by another 1/8, followed by
-    // 1/4 and finally the remaining 1/2.
+  int bottom = img->Top + img->Height;
+  int right = img->Left + img->Width;
+
+  int *lines = (int *) malloc(img->Height * sizeof(int));
+  int factor = downscale_factor(width, height, _decode_width, _decode_height, DOWNSCALE_MAX_FACTOR);
+  cairo_status_t status = CAIRO_STATUS_SUCCESS;
+  uint8_t *data = NULL;
+  uint32_t *row = NULL;
+  downscale_t scale;
+  scale.sums = NULL;
+  scale.data = NULL;
+
+  // reduced images are converted one row at a time
+  if (factor > 1) {
+    status = downscale_init(&scale, width, height, factor);
+    row = (uint32_t *) malloc(width * 4);
+  } else {
+    data = (uint8_t *) malloc(width * height * 4);
+  }
+
+  if (!lines || status || !(row || data)) {
+    free(lines);
+    free(row);
+    free(data);
+    downscale_destroy(&scale);
+    DGifCloseFile(gif);
+    return CAIRO_STATUS_NO_MEMORY;
+  }
+
+  // Image is interlaced so that it streams nice over 14.4k and 28.8k modems :)
+  // The raster holds 1/8 of the lines first, followed by another 1/8, then
+  // 1/4 and finally the remaining 1/2, map each line to its raster row.
+  if (gif->Image.Interlace) {
     int ioffs[] = { 0, 4, 2, 1 };
     int ijumps[] = { 8, 8, 4, 2 };
+    int n = 0;
+    for (int z = 0; z < 4; z++)
+      for (int y = ioffs[z]; y < img->Height; y += ijumps[z])
+        lines[y] = n++;
+  } else {
+    for (int y = 0; y < img->Height; ++y) lines[y] = y;
+  }
 
-    uint8_t *src_ptr = src_data;
-    uint32_t *dst_ptr;
-
-    for(int z = 0; z < 4; z++) {
-      for(int y = ioffs[z]; y < height; y += ijumps[z]) {
-        dst_ptr = dst_data + width * y;
-        for(int x = 0; x < width; ++x) {
-          *dst_ptr = ((*src_ptr == alphaColor) ? 0 : 255) << 24
-            | (colormap->Colors[*src_ptr].Red) << 16
-            | (colormap->Colors[*src_ptr].Green) << 8
-            | (colormap->Colors[*src_ptr].Blue);
-
-          dst_ptr++;
-          src_ptr++;
-        }
-      }
+  for (int y = 0; y < height; ++y) {
+    uint32_t *dst_data = row ? row : (uint32_t *) data + width * y;
+    uint8_t *src = y >= img->Top && y < bottom
+      ? src_data + img->Width * lines[y - img->Top] - img->Left
+      : NULL;
+
+    // Image may not take up whole "screen" so we need to fill-in the background
+    for (int x = 0; x < width; ++x) {
+      int color = src && x >= img->Left && x < right
+        ? src[x]
+        : bgColor;
+      *dst_data++ = ((color == alphaColor) ? 0 : 255) << 24
+        | colormap->Colors[color].Red << 16
+        | colormap->Colors[color].Green << 8
+        | colormap->Colors[color].Blue;
     }
+
+    if (row) downscale_row(&scale, row);
   }
 
+  free(lines);
+  free(row);
   DGifCloseFile(gif);
 
+  if (factor > 1) {
+    _surface = downscale_finish(&scale);
+    downscale_destroy(&scale);
+    return _surface
+      ? CAIRO_STATUS_SUCCESS
+      : CAIRO_STATUS_NO_MEMORY;
+  }
+
   // New image surface
   _surface = cairo_image_surface_create_for_data(
       data
@@ -661,7 +1073,7 @@ Image::loadGIFFromBuffer(uint8_t *buf, unsigned len) {
     , height
     , cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width));
 
-  cairo_status_t status = cairo_surface_status(_surface);
+  status = cairo_surface_status(_surface);
 
   if (status) {
     free(data);
@@ -722,9 +1134,128 @@ static void jpeg_mem_src (j_decompress_ptr cinfo, void* buffer, long nbytes) {
 
 #endif
 
+/*
+ * Record the message of a failed JPEG decode for finishLoad(),
+ * decoding may be off the main thread, and fall back to an
+ * empty image.
+ */
+
+cairo_status_t
+Image::decodeJPEGError(jpeg_decompress_struct *info) {
+  free(_error);
+  _error = strdup(info->err->jpeg_message_table[info->err->msg_code]);
+  dispose_jpeg_decompressor(info);
+  return createEmptyImageFallback();
+}
+
+/*
+ * Scanlines requested per jpeg_read_scanlines() call,
+ * one MCU row at the default 2x2 chroma subsampling.
+ */
+
+#define JPEG_DECODE_ROWS 16
+
+/*
+ * JPEG scanline to ARGB32 converters, one per output color
+ * space so that the color space isn't checked per pixel.
+ */
+
+typedef void (*jpeg_row_func_t)(const uint8_t *src, uint32_t *dst, int width);
+
+static void
+jpeg_gray_row(const uint8_t *src, uint32_t *dst, int width) {
+  int x = 0;
+#ifdef __SSE2__
+  // 16 pixels per iteration, each gray byte spread over r, g and b
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  for (; x + 16 <= width; x += 16) {
+    __m128i gray = _mm_loadu_si128((const __m128i *) (src + x));
+    __m128i lo = _mm_unpacklo_epi8(gray, gray);
+    __m128i hi = _mm_unpackhi_epi8(gray, gray);
+    _mm_storeu_si128((__m128i *) (dst + x), _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+    _mm_storeu_si128((__m128i *) (dst + x + 4), _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+    _mm_storeu_si128((__m128i *) (dst + x + 8), _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+    _mm_storeu_si128((__m128i *) (dst + x + 12), _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+  }
+#endif
+  for (; x < width; ++x) dst[x] = 0xff000000 | src[x] * 0x010101;
+}
+
+static void
+jpeg_rgb_row(const uint8_t *src, uint32_t *dst, int width) {
+  for (int x = 0; x < width; ++x, src += 3)
+    dst[x] = 0xff000000 | src[0] << 16 | src[1] << 8 | src[2];
+}
+
+#ifdef HAVE_SSSE3
+
+TARGET_SSSE3 static void
+jpeg_rgb_row_ssse3(const uint8_t *src, uint32_t *dst, int width) {
+  int x = 0;
+  // 4 pixels per iteration, 12 of the 16 bytes read are used
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  const __m128i mask = _mm_setr_epi8(
+      2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  for (; x + 6 <= width; x += 4) {
+    __m128i rgb = _mm_loadu_si128((const __m128i *) (src + x * 3));
+    _mm_storeu_si128((__m128i *) (dst + x), _mm_or_si128(_mm_shuffle_epi8(rgb, mask), alpha));
+  }
+  jpeg_rgb_row(src + x * 3, dst + x, width - x);
+}
+
+#endif
+
+static void
+jpeg_cmyk_row(const uint8_t *src, uint32_t *dst, int width) {
+  // TODO: ICC profiles support?
+  for (int x = 0; x < width; ++x, src += 4) {
+    uint32_t k = src[3];
+    dst[x] = 0xff000000
+      | k * src[0] / 255 << 16
+      | k * src[1] / 255 << 8
+      | k * src[2] / 255;
+  }
+}
+
+static void
+jpeg_black_row(const uint8_t *src, uint32_t *dst, int width) {
+  for (int x = 0; x < width; ++x) dst[x] = 0xff000000;
+}
+
+/*
+ * Pick the converter for `info`'s output. Unknown color
+ * spaces are guessed from the component count.
+ */
+
+static jpeg_row_func_t
+jpeg_row_func(j_decompress_ptr info) {
+  jpeg_row_func_t rgb = jpeg_rgb_row;
+#ifdef HAVE_SSSE3
+  if (cpu_ssse3) rgb = jpeg_rgb_row_ssse3;
+#endif
+
+  switch (info->out_color_space) {
+    case JCS_GRAYSCALE: return jpeg_gray_row;
+    case JCS_RGB: return rgb;
+    case JCS_CMYK: return jpeg_cmyk_row;
+    default:
+      switch (info->output_components) {
+        case 1: return jpeg_gray_row;
+        case 3: return rgb;
+        case 4: return jpeg_cmyk_row;
+        default: return jpeg_black_row;
+      }
+  }
+}
+
 /*
  * Takes an initialised jpeg_decompress_struct and decodes the
  * data into _surface.
+ *
+ * With libjpeg-turbo YCbCr and grayscale JPEGs are decoded
+ * straight into the surface rows, otherwise libjpeg converts
+ * YCbCr to RGB and YCCK to CMYK and a batch of rows at a time
+ * is converted to ARGB32.
  */
 
 cairo_status_t
@@ -735,66 +1266,68 @@ Image::decodeJPEGIntoSurface(jpeg_decompress_struct *info) {
 
   // Set JPEG Error Handler
   if (setjmp(((jpeg_error_manager *) info->err)->setjmp_buffer)) {
-    error(Exception::Error(String::New(info->err->jpeg_message_table[info->err->msg_code])));
-    state = INVALID;
-    dispose_jpeg_decompressor(info);
     free(data);
     free(src);
-    return createEmptyImageFallback();
+    return decodeJPEGError(info);
   }
 
   jpeg_read_header(info, TRUE);
+
+  // DCT scaling decodes straight to 1/2, 1/4 or 1/8 size,
+  // unless the JPEG is also kept as mime data at full size
+  if (DATA_IMAGE == _data_mode) {
+    int factor = downscale_factor(
+        info->image_width
+      , info->image_height
+      , _decode_width
+      , _decode_height
+      , 8);
+    info->scale_num = 1;
+    info->scale_denom = factor >= 8 ? 8 : factor >= 4 ? 4 : factor >= 2 ? 2 : 1;
+  }
+
+  // libjpeg-turbo writes YCbCr and grayscale straight into the surface rows
+  int direct = 0;
+#ifdef JCS_EXTENSIONS
+  if (JCS_YCbCr == info->jpeg_color_space || JCS_GRAYSCALE == info->jpeg_color_space) {
+    uint32_t probe = 1;
+    info->out_color_space = *(uint8_t *) &probe
+      ? JCS_EXT_BGRX
+      : JCS_EXT_XRGB;
+    direct = 1;
+  }
+#endif
+  if (JCS_YCCK == info->jpeg_color_space) info->out_color_space = JCS_CMYK;
+
   jpeg_start_decompress(info);
+  jpeg_row_func_t convert = direct ? NULL : jpeg_row_func(info);
 
   width = info->output_width;
   height = info->output_height;
   int stride = width * 4;
+  int src_stride = width * info->output_components;
   data = (uint8_t *) malloc(width * height * 4);
-  src = (uint8_t *) malloc(width * info->output_components);
+  if (convert) src = (uint8_t *) malloc(src_stride * JPEG_DECODE_ROWS);
 
-  if (!data || !src) {
+  if (!data || (convert && !src)) {
     free(data);
     free(src);
     dispose_jpeg_decompressor(info);
     return CAIRO_STATUS_NO_MEMORY;
   }
 
-  for (int y = 0; y < height; ++y) {
-    jpeg_read_scanlines(info, &src, 1);
-    uint32_t *row = (uint32_t *)(data + stride * y);
-    for (int x = 0; x < width; ++x) {
-      uint8_t r = 0, g = 0, b = 0, k = 0;
-      int bx = info->output_components * x;
-      switch (info->out_color_space) {
-        case JCS_CMYK:
-          // TODO: ICC profiles support?
-          k = src[bx + 3];
-          r = k * src[bx] / 255;
-          g = k * src[bx + 1] / 255;
-          b = k * src[bx + 2] / 255;
-          break;
-        case JCS_RGB:
-        case JCS_GRAYSCALE:
-          if (info->output_components == 1) {
-            r = g = b = src[bx];
-          } else {
-            r = src[bx];
-            g = src[bx + 1];
-            b = src[bx + 2];
-          }
-          break;
-        case JCS_UNKNOWN:
-        case JCS_YCbCr:
-        case JCS_YCCK:
-          // TODO: handle these other colour space options?
-          break;
-      }
-      uint32_t *pixel = row + x;
-      *pixel = 255 << 24
-             | r << 16
-             | g << 8
-             | b;
+  JSAMPROW rows[JPEG_DECODE_ROWS];
+  for (int y = 0; y < height;) {
+    int n = height - y < JPEG_DECODE_ROWS ? height - y : JPEG_DECODE_ROWS;
+    for (int i = 0; i < n; ++i)
+      rows[i] = convert ? src + src_stride * i : data + stride * (y + i);
+    n = jpeg_read_scanlines(info, rows, n);
+    if (!n) break;
+    if (convert) {
+      for (int i = 0; i < n; ++i)
+        convert(rows[i], (uint32_t *) (data + stride * (y + i)), width);
     }
+    y += n;
   }
 
   dispose_jpeg_decompressor(info);
@@ -832,11 +1365,8 @@ Image::decodeJPEGBufferIntoMimeSurface(uint8_t *buf, unsigned len) {
 
   // Set JPEG Error Handler
   if (setjmp(((jpeg_error_manager *) info->err)->setjmp_buffer)) {
-    error(Exception::Error(String::New(info->err->jpeg_message_table[info->err->msg_code])));
-    state = INVALID;
-    dispose_jpeg_decompressor(info);
     free(data);
-    return createEmptyImageFallback();
+    return decodeJPEGError(info);
   }
 
   jpeg_mem_src(info, buf, len);
@@ -907,7 +1437,8 @@ Image::assignDataAsMime(uint8_t *data, int len, const char *mime_type) {
   mime_closure->buf = mime_data;
   mime_closure->len = len;
 
-  V8::AdjustAmountOfExternalAllocatedMemory(len);
+  // reported to V8 by finishLoad()
+  _mime_len += len;
 
   return cairo_surface_set_mime_data(_surface, mime_type, mime_data, len, clearMimeData, mime_closure);
 }
@@ -941,53 +1472,6 @@ Image::createEmptyImageFallback() {
   return cairo_surface_status(_surface);
 }
 
-/*
- * Load JPEG, convert RGB to ARGB.
- */
-
-cairo_status_t
-Image::loadJPEG(FILE *stream) {
-  cairo_status_t status;
-
-  if (data_mode == DATA_IMAGE) { // Can lazily read in the JPEG.
-    struct jpeg_decompress_struct *info = create_jpeg_decompressor();
-    jpeg_stdio_src(info, stream);
-    status = decodeJPEGIntoSurface(info);
-    fclose(stream);
-  } else { // We'll need the actual source jpeg data, so read fully.
-#if CAIRO_VERSION_MINOR >= 10
-    uint8_t *buf;
-    unsigned len;
-
-    fseek(stream, 0, SEEK_END);
-    len = ftell(stream);
-    fseek(stream, 0, SEEK_SET);
-
-    buf = (uint8_t *) malloc(len);
-    if (!buf) return CAIRO_STATUS_NO_MEMORY;
-
-    fread(buf, len, 1, stream);
-    fclose(stream);
-
-    switch (data_mode) {
-      case DATA_IMAGE: // Can't be this, but compiler warning.
-      case DATA_IMAGE_AND_MIME:
-        status = loadJPEGFromBuffer(buf, len);
-        if (status) break;
-        status = assignDataAsMime(buf, len, CAIRO_MIME_TYPE_JPEG);
-        break;
-      case DATA_MIME:
-        status = decodeJPEGBufferIntoMimeSurface(buf, len);
-        break;
-    }
-
-    free(buf);
-#endif
-  }
-
-  return status;
-}
-
 #endif /* HAVE_JPEG */
 
 /*
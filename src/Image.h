@@ -9,6 +9,7 @@
 #define __NODE_IMAGE_H__
 
 #include "Canvas.h"
+#include "imagecache.h"
 
 #ifdef HAVE_JPEG
 #include <jpeglib.h>
@@ -20,6 +21,7 @@ class Image: public node::ObjectWrap {
   public:
     char *filename;
     int width, height;
+    int decode_width, decode_height;
     Persistent<Function> onload;
     Persistent<Function> onerror;
     static Persistent<FunctionTemplate> constructor;
@@ -32,10 +34,19 @@ class Image: public node::ObjectWrap {
     static Handle<Value> GetWidth(Local<String> prop, const AccessorInfo &info);
     static Handle<Value> GetHeight(Local<String> prop, const AccessorInfo &info);
     static Handle<Value> GetDataMode(Local<String> prop, const AccessorInfo &info);
+    static Handle<Value> GetDecodeSize(Local<String> prop, const AccessorInfo &info);
     static void SetSource(Local<String> prop, Local<Value> val, const AccessorInfo &info);
     static void SetOnload(Local<String> prop, Local<Value> val, const AccessorInfo &info);
     static void SetOnerror(Local<String> prop, Local<Value> val, const AccessorInfo &info);
     static void SetDataMode(Local<String> prop, Local<Value> val, const AccessorInfo &info);
+    static void SetDecodeSize(Local<String> prop, Local<Value> val, const AccessorInfo &info);
+    static Handle<Value> SetCacheLimit(const Arguments &args);
+    static Handle<Value> GetCacheStats(const Arguments &args);
+    static Handle<Value> ClearCache(const Arguments &args);
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+    static void LoadAsync(uv_work_t *req);
+    static void LoadAsyncAfter(uv_work_t *req);
+#endif
     inline cairo_surface_t *surface(){ return _surface; } 
     inline uint8_t *data(){ return cairo_image_surface_get_data(_surface); } 
     inline int stride(){ return cairo_image_surface_get_stride(_surface); } 
@@ -45,18 +56,23 @@ class Image: public node::ObjectWrap {
     static cairo_status_t readPNG(void *closure, unsigned char *data, unsigned len);
     inline int isComplete(){ return COMPLETE == state; }
     cairo_status_t loadSurface();
+    cairo_status_t loadBuffer(uint8_t *buf, unsigned len);
+    bool useCache();
+    bool cacheHit(image_cache_key_t *key);
+    void cacheSurface(image_cache_key_t *key);
     cairo_status_t loadFromBuffer(uint8_t *buf, unsigned len);
-    cairo_status_t loadPNGFromBuffer(uint8_t *buf);
-    cairo_status_t loadPNG();
+    cairo_status_t loadPNGFromBuffer(uint8_t *buf, unsigned len);
+    cairo_status_t decodePNGRows(uint8_t *buf, unsigned len);
     void clearData();
+    void setSource(Handle<Value> val);
+    void finishLoad(cairo_status_t status);
 #ifdef HAVE_GIF
     cairo_status_t loadGIFFromBuffer(uint8_t *buf, unsigned len);
-    cairo_status_t loadGIF(FILE *stream);
 #endif
 #ifdef HAVE_JPEG
     cairo_status_t loadJPEGFromBuffer(uint8_t *buf, unsigned len);
-    cairo_status_t loadJPEG(FILE *stream);
     cairo_status_t decodeJPEGIntoSurface(jpeg_decompress_struct *info);
+    cairo_status_t decodeJPEGError(jpeg_decompress_struct *info);
 #if CAIRO_VERSION_MINOR >= 10
     cairo_status_t decodeJPEGBufferIntoMimeSurface(uint8_t *buf, unsigned len);
     cairo_status_t assignDataAsMime(uint8_t *data, int len, const char *mime_type);
@@ -74,11 +90,13 @@ class Image: public node::ObjectWrap {
       , INVALID
     } state;
 
-    enum {
+    typedef enum {
       DATA_IMAGE = 1,
       DATA_MIME,
       DATA_IMAGE_AND_MIME
-    } data_mode;
+    } data_mode_t;
+
+    data_mode_t data_mode;
 
     typedef enum {
         UNKNOWN
@@ -94,6 +112,15 @@ class Image: public node::ObjectWrap {
     cairo_status_t createEmptyImageFallback();
     uint8_t *_data;
     int _data_len;
+    int _mime_len;
+    char *_error;
+    bool _decoding;
+    // settings of the current decode, copied by setSource()
+    // as the setters may run while it is on the thread pool
+    int _decode_width, _decode_height;
+    data_mode_t _data_mode;
+    bool _cached;
+    Persistent<Value> _next_src;
     ~Image();
 };
 
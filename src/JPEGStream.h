@@ -7,9 +7,49 @@
 #define __NODE_JPEG_STREAM_H__
 
 #include "Canvas.h"
+#include "cpu.h"
 #include <jpeglib.h>
 #include <jerror.h>
 
+#include <setjmp.h>
+
+/*
+ * JPEG encoder options.
+ *
+ *   - quality           0-100
+ *   - progressive       emit a progressive JPEG
+ *   - optimize_coding   compute optimal Huffman tables
+ *   - restart_interval  MCUs between restart markers, 0 for none
+ *   - chroma_h/v        luma sampling factors, 2x2 being 4:2:0
+ *   - dct_method        JDCT_ISLOW, JDCT_IFAST or JDCT_FLOAT
+ *
+ */
+
+typedef struct {
+  int quality;
+  int progressive;
+  int optimize_coding;
+  int restart_interval;
+  int chroma_h;
+  int chroma_v;
+  J_DCT_METHOD dct_method;
+} jpeg_options_t;
+
+/*
+ * Reset `options` to the libjpeg defaults at quality 75.
+ */
+
+void
+jpeg_options_defaults(jpeg_options_t *options) {
+  options->quality = 75;
+  options->progressive = 0;
+  options->optimize_coding = 0;
+  options->restart_interval = 0;
+  options->chroma_h = 2;
+  options->chroma_v = 2;
+  options->dct_method = JDCT_ISLOW;
+}
+
 /*
  * Expanded data destination object for closure output,
  * inspired by IJG's jdatadst.c
@@ -17,11 +57,40 @@
 
 typedef struct {
   struct jpeg_destination_mgr pub;
-  closure_t *closure;
+  cairo_write_func_t write_func;
+  void *closure;
+  cairo_status_t status;
   JOCTET *buffer;
   int bufsize;
 } closure_destination_mgr;
 
+/*
+ * Error manager jumping back to write_to_jpeg_stream().
+ */
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+} closure_error_mgr;
+
+void
+closure_error_exit(j_common_ptr cinfo) {
+  longjmp(((closure_error_mgr *) cinfo->err)->setjmp_buffer, 1);
+}
+
+/*
+ * Hand `len` bytes of the output buffer to the write function,
+ * bailing out of libjpeg when it fails.
+ */
+
+void
+write_closure_buffer(j_compress_ptr cinfo, size_t len) {
+  closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
+  if (!len) return;
+  dest->status = dest->write_func(dest->closure, dest->buffer, len);
+  if (dest->status) ERREXIT(cinfo, JERR_FILE_WRITE);
+}
+
 void
 init_closure_destination(j_compress_ptr cinfo){
   // we really don't have to do anything here
@@ -30,14 +99,7 @@ init_closure_destination(j_compress_ptr cinfo){
 boolean
 empty_closure_output_buffer(j_compress_ptr cinfo){
   closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
-  Local<Buffer> buf = Buffer::New(dest->bufsize);
-  memcpy(Buffer::Data(buf->handle_), dest->buffer, dest->bufsize);
-  Local<Value> argv[3] = {
-      Local<Value>::New(Null())
-    , Local<Value>::New(buf->handle_)
-    , Integer::New(dest->bufsize)
-  };
-  dest->closure->fn->Call(Context::GetCurrent()->Global(), 3, argv);
+  write_closure_buffer(cinfo, dest->bufsize);
   cinfo->dest->next_output_byte = dest->buffer;
   cinfo->dest->free_in_buffer = dest->bufsize;
   return true;
@@ -47,30 +109,11 @@ void
 term_closure_destination(j_compress_ptr cinfo){
   closure_destination_mgr *dest = (closure_destination_mgr *) cinfo->dest;
   /* emit remaining data */
-  size_t remaining = dest->bufsize - cinfo->dest->free_in_buffer;
-  Local<Buffer> buf = Buffer::New(remaining);
-  memcpy(Buffer::Data(buf->handle_), dest->buffer, remaining);
-
-  Local<Value> data_argv[3] = {
-      Local<Value>::New(Null())
-    , Local<Value>::New(buf->handle_)
-    , Integer::New(remaining)
-  };
-
-  dest->closure->fn->Call(Context::GetCurrent()->Global(), 3, data_argv);
-
-  // emit "end"
-  Local<Value> end_argv[3] = {
-      Local<Value>::New(Null())
-    , Local<Value>::New(Null())
-    , Integer::New(0)
-  };
-
-  dest->closure->fn->Call(Context::GetCurrent()->Global(), 3, end_argv);
+  write_closure_buffer(cinfo, dest->bufsize - cinfo->dest->free_in_buffer);
 }
 
 void
-jpeg_closure_dest(j_compress_ptr cinfo, closure_t * closure, int bufsize){
+jpeg_closure_dest(j_compress_ptr cinfo, cairo_write_func_t write_func, void *closure, int bufsize){
   closure_destination_mgr * dest;
 
   /* The destination object is made permanent so that multiple JPEG images
@@ -88,55 +131,143 @@ jpeg_closure_dest(j_compress_ptr cinfo, closure_t * closure, int bufsize){
   cinfo->dest->empty_output_buffer = &empty_closure_output_buffer;
   cinfo->dest->term_destination = &term_closure_destination;
 
+  dest->write_func = write_func;
   dest->closure = closure;
+  dest->status = CAIRO_STATUS_SUCCESS;
   dest->bufsize = bufsize;
-  dest->buffer = (JOCTET *)malloc(bufsize);
+  dest->buffer = (JOCTET *)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_PERMANENT, bufsize);
 
   cinfo->dest->next_output_byte = dest->buffer;
   cinfo->dest->free_in_buffer = dest->bufsize;
 }
 
-void
-write_to_jpeg_stream(cairo_surface_t *surface, int bufsize, int quality, closure_t *closure){
+/*
+ * Rows handed to libjpeg per jpeg_write_scanlines() call,
+ * one MCU row at the default 2x2 chroma subsampling.
+ */
+
+#define JPEG_BATCH_ROWS 16
+
+#ifdef HAVE_SSSE3
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Convert a row of native-endian xRGB pixels to packed RGB,
+ * used when libjpeg can't read the surface rows directly.
+ */
+
+static void
+xrgb_to_rgb_row(const uint32_t *src, uint8_t *dst, int width) {
+  for (int x = 0; x < width; ++x) {
+    uint32_t pixel = src[x];
+    dst[0] = pixel >> 16;
+    dst[1] = pixel >> 8;
+    dst[2] = pixel;
+    dst += 3;
+  }
+}
+
+#ifdef HAVE_SSSE3
+
+TARGET_SSSE3 static void
+xrgb_to_rgb_row_ssse3(const uint32_t *src, uint8_t *dst, int width) {
+  int x = 0;
+  // 4 pixels per iteration, 16 bytes in, 12 bytes out
+  const __m128i mask = _mm_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  for (; x + 6 <= width; x += 4) {
+    __m128i px = _mm_loadu_si128((const __m128i *) (src + x));
+    _mm_storeu_si128((__m128i *) (dst + x * 3), _mm_shuffle_epi8(px, mask));
+  }
+  xrgb_to_rgb_row(src + x, dst + x * 3, width - x);
+}
+
+#endif
+
+/*
+ * Compress `surface` as JPEG, passing the output to `write_func`
+ * in chunks of at most `bufsize` bytes. Does not touch V8, so
+ * it may run on the thread pool when `write_func` doesn't either.
+ *
+ * With libjpeg-turbo the surface rows are read as-is, otherwise
+ * they are converted to RGB a batch of rows at a time.
+ */
+
+cairo_status_t
+write_to_jpeg_stream(cairo_surface_t *surface, int bufsize, const jpeg_options_t *options, cairo_write_func_t write_func, void *closure){
   int w = cairo_image_surface_get_width(surface);
   int h = cairo_image_surface_get_height(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
   struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
+  closure_error_mgr jerr;
 
-  JSAMPROW slr;
-  cinfo.err = jpeg_std_error(&jerr);
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = closure_error_exit;
   jpeg_create_compress(&cinfo);
+
+  if (setjmp(jerr.setjmp_buffer)) {
+    closure_destination_mgr *dest = (closure_destination_mgr *) cinfo.dest;
+    cairo_status_t status = dest && dest->status
+      ? dest->status
+      : CAIRO_STATUS_WRITE_ERROR;
+    jpeg_destroy_compress(&cinfo);
+    return status;
+  }
+
+#ifdef JCS_EXTENSIONS
+  uint32_t probe = 1;
+  cinfo.in_color_space = *(uint8_t *) &probe
+    ? JCS_EXT_BGRX
+    : JCS_EXT_XRGB;
+  cinfo.input_components = 4;
+#else
   cinfo.in_color_space = JCS_RGB;
   cinfo.input_components = 3;
+#endif
   cinfo.image_width = w;
   cinfo.image_height = h;
   jpeg_set_defaults(&cinfo);
-  jpeg_set_quality(&cinfo, quality, (quality<25)?0:1);
-  jpeg_closure_dest(&cinfo, closure, bufsize);
+  jpeg_set_quality(&cinfo, options->quality, (options->quality<25)?0:1);
+  cinfo.comp_info[0].h_samp_factor = options->chroma_h;
+  cinfo.comp_info[0].v_samp_factor = options->chroma_v;
+  cinfo.optimize_coding = options->optimize_coding ? TRUE : FALSE;
+  cinfo.restart_interval = options->restart_interval;
+  cinfo.dct_method = options->dct_method;
+  if (options->progressive) jpeg_simple_progression(&cinfo);
+  jpeg_closure_dest(&cinfo, write_func, closure, bufsize);
 
   jpeg_start_compress(&cinfo, TRUE);
-  unsigned char *dst;
-  unsigned int *src = (unsigned int *) cairo_image_surface_get_data(surface);
-  int sl = 0;
-  dst = (unsigned char *) malloc(w * 3);
-  while (sl < h) {
-    unsigned char *dp = dst;
-    int x = 0;
-    while (x < w) {
-      dp[0] = (*src >> 16) & 255;
-      dp[1] = (*src >> 8) & 255;
-      dp[2] = *src & 255;
-      src++;
-      dp += 3;
-      x++;
+
+  JSAMPROW rows[JPEG_BATCH_ROWS];
+#ifndef JCS_EXTENSIONS
+  void (*convert)(const uint32_t *, uint8_t *, int) = xrgb_to_rgb_row;
+#ifdef HAVE_SSSE3
+  if (cpu_ssse3) convert = xrgb_to_rgb_row_ssse3;
+#endif
+  uint8_t *rgb = (uint8_t *)
+    (*cinfo.mem->alloc_large) ((j_common_ptr) &cinfo, JPOOL_IMAGE, JPEG_BATCH_ROWS * w * 3);
+#endif
+
+  while (cinfo.next_scanline < cinfo.image_height) {
+    int y = cinfo.next_scanline
+      , n = h - y < JPEG_BATCH_ROWS ? h - y : JPEG_BATCH_ROWS;
+    for (int i = 0; i < n; ++i) {
+#ifdef JCS_EXTENSIONS
+      rows[i] = data + (y + i) * stride;
+#else
+      rows[i] = rgb + i * w * 3;
+      convert((uint32_t *) (data + (y + i) * stride), rows[i], w);
+#endif
     }
-    slr = dst;
-    jpeg_write_scanlines(&cinfo, &slr, 1);
-    sl++;
+    jpeg_write_scanlines(&cinfo, rows, n);
   }
-  free(dst);
+
   jpeg_finish_compress(&cinfo);
   jpeg_destroy_compress(&cinfo);
+  return CAIRO_STATUS_SUCCESS;
 }
 
 #endif
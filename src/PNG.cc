@@ -0,0 +1,737 @@
+
+//
+// PNG.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include "PNG.h"
+#include "raw.h"
+#include "palette.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Write state shared with the libpng callbacks.
+ */
+
+typedef struct {
+  cairo_write_func_t write_func;
+  void *closure;
+  cairo_status_t status;
+} png_write_closure_t;
+
+/*
+ * Reset `options` to cairo's behaviour.
+ */
+
+void
+png_options_defaults(png_options_t *options) {
+  options->compression_level = Z_DEFAULT_COMPRESSION;
+  options->filters = PNG_ALL_FILTERS;
+  options->strategy = -1;
+  options->threads = 1;
+  options->palette = 0;
+  options->dither = 0;
+}
+
+/*
+ * libpng write callback.
+ */
+
+static void
+png_write(png_structp png, png_bytep data, png_size_t len) {
+  png_write_closure_t *closure = (png_write_closure_t *) png_get_io_ptr(png);
+  closure->status = closure->write_func(closure->closure, data, len);
+  if (closure->status) png_error(png, "write failed");
+}
+
+/*
+ * libpng flush callback, output is flushed by the caller.
+ */
+
+static void
+png_flush(png_structp png) {
+
+}
+
+/*
+ * libpng error callback, unwind to write_to_png_stream().
+ */
+
+static void
+png_error_exit(png_structp png, png_const_charp msg) {
+  longjmp(png_jmpbuf(png), 1);
+}
+
+/*
+ * Find the smallest PNG color type that holds the pixels of
+ * `surface` losslessly: no alpha when every pixel is opaque,
+ * gray when red, green and blue are always equal. Equal
+ * premultiplied channels stay equal un-premultiplied. One
+ * pass, four pixels at a time with SSE2, that stops as soon
+ * as neither reduction is possible.
+ */
+
+static int
+png_color_type(cairo_surface_t *surface) {
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  int width = cairo_image_surface_get_width(surface)
+    , height = cairo_image_surface_get_height(surface)
+    , stride = cairo_image_surface_get_stride(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+
+  // AND of every pixel, OR of every b ^ g and g ^ r
+  uint32_t alpha = ~0u, color = 0;
+  int opaque = CAIRO_FORMAT_ARGB32 != format;
+
+  for (int y = 0; y < height; ++y) {
+    const uint32_t *row = (const uint32_t *) (data + y * stride);
+    int x = 0;
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi32(-1)
+      , vc = _mm_setzero_si128()
+      , mask = _mm_set1_epi32(0xffff);
+    for (; x + 4 <= width; x += 4) {
+      __m128i p = _mm_loadu_si128((const __m128i *) (row + x));
+      va = _mm_and_si128(va, p);
+      vc = _mm_or_si128(vc, _mm_and_si128(_mm_xor_si128(p, _mm_srli_epi32(p, 8)), mask));
+    }
+    uint32_t lanes[8];
+    _mm_storeu_si128((__m128i *) lanes, va);
+    _mm_storeu_si128((__m128i *) (lanes + 4), vc);
+    alpha &= lanes[0] & lanes[1] & lanes[2] & lanes[3];
+    color |= lanes[4] | lanes[5] | lanes[6] | lanes[7];
+#endif
+    for (; x < width; ++x) {
+      alpha &= row[x];
+      color |= (row[x] ^ (row[x] >> 8)) & 0xffff;
+    }
+    if (color) {
+      if (opaque) return PNG_COLOR_TYPE_RGB;
+      if (0xff != alpha >> 24) return PNG_COLOR_TYPE_RGB_ALPHA;
+    }
+  }
+
+  if (0xff == alpha >> 24) opaque = 1;
+  return color
+    ? (opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA)
+    : (opaque ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_GRAY_ALPHA);
+}
+
+/*
+ * Bytes per pixel of the 8-bit `color_type`.
+ */
+
+static int
+png_color_type_bpp(int color_type) {
+  switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY: return 1;
+    case PNG_COLOR_TYPE_GRAY_ALPHA: return 2;
+    case PNG_COLOR_TYPE_RGB: return 3;
+    default: return 4;
+  }
+}
+
+/*
+ * Pack a row of native pixels into `color_type`, un-premultiplying
+ * where alpha is kept. Reduced types are only used for pixels
+ * png_color_type() found fit them.
+ */
+
+static void
+png_pack_row(const uint32_t *src, uint8_t *dst, int width, int color_type) {
+  switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+      for (int x = 0; x < width; ++x) dst[x] = src[x];
+      break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+      for (int x = 0; x < width; ++x, dst += 2) {
+        uint8_t a = src[x] >> 24
+          , v = src[x];
+        dst[0] = 0 == a ? 0 : 255 == a ? v : (v * 255 + a / 2) / a;
+        dst[1] = a;
+      }
+      break;
+    case PNG_COLOR_TYPE_RGB:
+      for (int x = 0; x < width; ++x, dst += 3) {
+        dst[0] = src[x] >> 16;
+        dst[1] = src[x] >> 8;
+        dst[2] = src[x];
+      }
+      break;
+    default:
+      raw_convert_row(src, dst, width, RAW_FORMAT_RGBA);
+  }
+}
+
+/*
+ * Compress with libpng on the calling thread, packing rows
+ * into `color_type` one at a time. With a palette the surface
+ * is quantized up front and written at the smallest bit depth
+ * that fits.
+ */
+
+static cairo_status_t
+write_png_serial(
+    cairo_surface_t *surface
+  , const png_options_t *options
+  , int color_type
+  , cairo_write_func_t write_func
+  , void *closure) {
+  int width = cairo_image_surface_get_width(surface)
+    , height = cairo_image_surface_get_height(surface)
+    , stride = cairo_image_surface_get_stride(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+
+  png_write_closure_t state;
+  state.write_func = write_func;
+  state.closure = closure;
+  state.status = CAIRO_STATUS_SUCCESS;
+
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_exit, NULL);
+  if (!png) return CAIRO_STATUS_NO_MEMORY;
+  png_infop info = png_create_info_struct(png);
+  if (!info) {
+    png_destroy_write_struct(&png, NULL);
+    return CAIRO_STATUS_NO_MEMORY;
+  }
+
+  // volatile, they are freed after a longjmp
+  uint8_t * volatile row = NULL;
+  uint8_t * volatile indices = NULL;
+
+  if (setjmp(png_jmpbuf(png))) {
+    free(row);
+    free(indices);
+    png_destroy_write_struct(&png, &info);
+    return state.status
+      ? state.status
+      : CAIRO_STATUS_WRITE_ERROR;
+  }
+
+  png_set_write_fn(png, &state, png_write, png_flush);
+  png_set_compression_level(png, options->compression_level);
+  png_set_filter(png, PNG_FILTER_TYPE_BASE, options->filters
+    ? options->filters
+    : PNG_FILTER_NONE);
+  if (options->strategy >= 0)
+    png_set_compression_strategy(png, options->strategy);
+
+  if (options->palette) {
+    palette_t palette;
+    uint8_t *quantized;
+    state.status = palette_quantize(surface, options->palette, options->dither, &palette, &quantized);
+    if (state.status) png_error(png, "quantize failed");
+    indices = quantized;
+
+    int depth = palette.count <= 2 ? 1
+      : palette.count <= 4 ? 2
+      : palette.count <= 16 ? 4
+      : 8;
+    png_set_IHDR(png, info, width, height, depth
+      , PNG_COLOR_TYPE_PALETTE
+      , PNG_INTERLACE_NONE
+      , PNG_COMPRESSION_TYPE_DEFAULT
+      , PNG_FILTER_TYPE_DEFAULT);
+
+    png_color colors[256];
+    png_byte alpha[256];
+    for (int i = 0; i < palette.count; ++i) {
+      colors[i].red = palette.rgba[i][0];
+      colors[i].green = palette.rgba[i][1];
+      colors[i].blue = palette.rgba[i][2];
+      alpha[i] = palette.rgba[i][3];
+    }
+    // filtering rarely helps indices, libpng's advice too
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    png_set_PLTE(png, info, colors, palette.count);
+    if (palette.translucent)
+      png_set_tRNS(png, info, alpha, palette.translucent, NULL);
+    png_write_info(png, info);
+
+    // one index per byte in, packed to `depth` by libpng
+    png_set_packing(png);
+    for (int y = 0; y < height; ++y)
+      png_write_row(png, indices + y * width);
+
+    png_write_end(png, info);
+    free(indices);
+    png_destroy_write_struct(&png, &info);
+    return state.status;
+  }
+
+  png_set_IHDR(png, info, width, height, 8
+    , color_type
+    , PNG_INTERLACE_NONE
+    , PNG_COMPRESSION_TYPE_DEFAULT
+    , PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+
+  row = (uint8_t *) malloc(width * 4);
+  if (!row) {
+    state.status = CAIRO_STATUS_NO_MEMORY;
+    png_error(png, "out of memory");
+  }
+  for (int y = 0; y < height; ++y) {
+    png_pack_row((uint32_t *) (data + y * stride), row, width, color_type);
+    png_write_row(png, row);
+  }
+
+  png_write_end(png, info);
+  free(row);
+  png_destroy_write_struct(&png, &info);
+  return state.status;
+}
+
+/*
+ * Parallel encoder, in the spirit of pigz.
+ *
+ * The image is split into row stripes, each filtered and
+ * deflated on its own thread. Stripes are primed with the
+ * last 32k of filtered data preceding them so compression
+ * barely suffers, and all but the last end on a sync flush
+ * so the raw deflate streams can simply be concatenated.
+ * The adler32 checksums of the stripes are then combined
+ * into the one of the whole zlib stream.
+ */
+
+#define PNG_STRIPE_MIN (64 * 1024)
+#define PNG_WINDOW_SIZE 32768
+
+struct png_stripe;
+
+/*
+ * State shared by the stripes of one encode.
+ */
+
+typedef struct {
+  const png_options_t *options;
+  int color_type;
+  uint8_t *data;
+  int width;
+  int height;
+  int stride;
+  int bpp;
+  int rowbytes;
+  struct png_stripe *stripes;
+} png_encoder_t;
+
+/*
+ * A stripe of rows [y0, y1) and its compressed output.
+ */
+
+typedef struct png_stripe {
+  png_encoder_t *enc;
+  int y0;
+  int y1;
+  int last;
+  uint8_t *out;
+  size_t len;
+  size_t max_len;
+  uLong adler;
+  size_t in_len;
+  cairo_status_t status;
+  pthread_t thread;
+} png_stripe_t;
+
+/*
+ * Convert row `y` to unfiltered PNG pixels.
+ */
+
+static void
+png_convert_row(png_encoder_t *enc, int y, uint8_t *dst) {
+  png_pack_row(
+      (const uint32_t *) (enc->data + y * enc->stride)
+    , dst
+    , enc->width
+    , enc->color_type);
+}
+
+/*
+ * Apply PNG filter `type` to `cur`, writing the filter
+ * byte and filtered row to `out`.
+ */
+
+static void
+png_filter_row(int type, const uint8_t *cur, const uint8_t *prev, uint8_t *out, int len, int bpp) {
+  int i;
+  *out++ = type;
+  switch (type) {
+    case PNG_FILTER_VALUE_NONE:
+      memcpy(out, cur, len);
+      break;
+    case PNG_FILTER_VALUE_SUB:
+      for (i = 0; i < bpp; ++i) out[i] = cur[i];
+      for (; i < len; ++i) out[i] = cur[i] - cur[i - bpp];
+      break;
+    case PNG_FILTER_VALUE_UP:
+      for (i = 0; i < len; ++i) out[i] = cur[i] - prev[i];
+      break;
+    case PNG_FILTER_VALUE_AVG:
+      for (i = 0; i < bpp; ++i) out[i] = cur[i] - (prev[i] >> 1);
+      for (; i < len; ++i) out[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+      break;
+    case PNG_FILTER_VALUE_PAETH:
+      for (i = 0; i < bpp; ++i) out[i] = cur[i] - prev[i];
+      for (; i < len; ++i) {
+        int a = cur[i - bpp]
+          , b = prev[i]
+          , c = prev[i - bpp]
+          , pa = abs(b - c)
+          , pb = abs(a - c)
+          , pc = abs(a + b - 2 * c);
+        out[i] = cur[i] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+      }
+      break;
+  }
+}
+
+/*
+ * Filter `cur` with the `filters` bitmask, picking the one with
+ * the smallest sum of absolute values like libpng does. `out`
+ * and `tmp` hold len + 1 bytes each, returns the one holding
+ * the chosen filtered row. `prev` is the previous unfiltered
+ * row, all zeros for the first.
+ */
+
+uint8_t *
+png_filter_select(
+    int filters
+  , const uint8_t *cur
+  , const uint8_t *prev
+  , uint8_t *out
+  , uint8_t *tmp
+  , int len
+  , int bpp) {
+  static const int masks[] = {
+      PNG_FILTER_NONE
+    , PNG_FILTER_SUB
+    , PNG_FILTER_UP
+    , PNG_FILTER_AVG
+    , PNG_FILTER_PAETH };
+  if (!filters) filters = PNG_FILTER_NONE;
+  unsigned long best = ULONG_MAX;
+  uint8_t *chosen = NULL;
+
+  for (int type = 0; type < 5; ++type) {
+    if (!(filters & masks[type])) continue;
+    // never overwrite the best row so far
+    uint8_t *dst = chosen == out ? tmp : out;
+    png_filter_row(type, cur, prev, dst, len, bpp);
+
+    // single filter, no need to measure
+    if (filters == masks[type]) return dst;
+
+    unsigned long sum = 0;
+    for (int i = 1; i <= len && sum < best; ++i)
+      sum += dst[i] < 128 ? dst[i] : 256 - dst[i];
+    if (sum < best) {
+      best = sum;
+      chosen = dst;
+    }
+  }
+
+  return chosen;
+}
+
+/*
+ * Filter `cur` with the encoder's filters.
+ */
+
+static uint8_t *
+png_select_filter(png_encoder_t *enc, const uint8_t *cur, const uint8_t *prev, uint8_t *out, uint8_t *tmp) {
+  return png_filter_select(
+      enc->options->filters
+    , cur
+    , prev
+    , out
+    , tmp
+    , enc->rowbytes
+    , enc->bpp);
+}
+
+/*
+ * Deflate `len` bytes of filtered data into the stripe's output.
+ */
+
+static int
+png_stripe_deflate(png_stripe_t *stripe, z_stream *zs, uint8_t *data, size_t len, int flush) {
+  zs->next_in = data;
+  zs->avail_in = len;
+  stripe->adler = adler32(stripe->adler, data, len);
+  stripe->in_len += len;
+
+  for (;;) {
+    if (stripe->len == stripe->max_len) {
+      size_t max = stripe->max_len * 2;
+      uint8_t *out = (uint8_t *) realloc(stripe->out, max);
+      if (!out) return Z_MEM_ERROR;
+      stripe->out = out;
+      stripe->max_len = max;
+    }
+    zs->next_out = stripe->out + stripe->len;
+    zs->avail_out = stripe->max_len - stripe->len;
+    int ret = deflate(zs, flush);
+    stripe->len = stripe->max_len - zs->avail_out;
+    if (Z_STREAM_ERROR == ret) return ret;
+    if (!zs->avail_in && zs->avail_out) return Z_OK;
+  }
+}
+
+/*
+ * Filter and compress one stripe, run on its own thread.
+ */
+
+static void *
+png_stripe_encode(void *data) {
+  png_stripe_t *stripe = (png_stripe_t *) data;
+  png_encoder_t *enc = stripe->enc;
+  const png_options_t *options = enc->options;
+  int rowbytes = enc->rowbytes;
+  uint8_t *buf = NULL, *dict = NULL, *prev, *cur, *out, *tmp, *swap;
+  int y = stripe->y0, strategy = options->strategy;
+  z_stream zs;
+
+  stripe->status = CAIRO_STATUS_NO_MEMORY;
+  stripe->adler = adler32(0, NULL, 0);
+  stripe->in_len = 0;
+  stripe->len = 0;
+  stripe->max_len = (size_t) (stripe->y1 - stripe->y0) * (rowbytes + 1) / 8 + 1024;
+  if (!(stripe->out = (uint8_t *) malloc(stripe->max_len))) return NULL;
+
+  // prev, cur, and two filtered rows
+  if (!(buf = (uint8_t *) malloc(4 * (rowbytes + 1)))) return NULL;
+  prev = buf;
+  cur = prev + rowbytes + 1;
+  out = cur + rowbytes + 1;
+  tmp = out + rowbytes + 1;
+
+  // same default as libpng
+  if (strategy < 0) {
+    strategy = PNG_FILTER_NONE == options->filters || !options->filters
+      ? Z_DEFAULT_STRATEGY
+      : Z_FILTERED;
+  }
+
+  memset(&zs, 0, sizeof(zs));
+  if (Z_OK != deflateInit2(&zs, options->compression_level, Z_DEFLATED, -15, 8, strategy)) {
+    free(buf);
+    return NULL;
+  }
+
+  // prime the window with the filtered rows preceding the stripe
+  if (y) {
+    int rows = PNG_WINDOW_SIZE / (rowbytes + 1) + 1;
+    if (rows > y) rows = y;
+    if (!(dict = (uint8_t *) malloc(rows * (rowbytes + 1)))) goto done;
+
+    int from = y - rows;
+    memset(prev, 0, rowbytes);
+    if (from) png_convert_row(enc, from - 1, prev);
+    for (int i = 0; i < rows; ++i) {
+      png_convert_row(enc, from + i, cur);
+      uint8_t *filtered = png_select_filter(enc, cur, prev, out, tmp);
+      memcpy(dict + i * (rowbytes + 1), filtered, rowbytes + 1);
+      swap = prev; prev = cur; cur = swap;
+    }
+
+    size_t len = rows * (rowbytes + 1);
+    size_t window = len > PNG_WINDOW_SIZE ? PNG_WINDOW_SIZE : len;
+    deflateSetDictionary(&zs, dict + len - window, window);
+  } else {
+    memset(prev, 0, rowbytes);
+  }
+
+  for (; y < stripe->y1; ++y) {
+    png_convert_row(enc, y, cur);
+    uint8_t *filtered = png_select_filter(enc, cur, prev, out, tmp);
+    int flush = y + 1 < stripe->y1
+      ? Z_NO_FLUSH
+      : stripe->last ? Z_FINISH : Z_SYNC_FLUSH;
+    if (Z_OK != png_stripe_deflate(stripe, &zs, filtered, rowbytes + 1, flush)) goto done;
+    swap = prev; prev = cur; cur = swap;
+  }
+
+  stripe->status = CAIRO_STATUS_SUCCESS;
+
+done:
+  deflateEnd(&zs);
+  free(dict);
+  free(buf);
+  return NULL;
+}
+
+/*
+ * Write a PNG chunk made of up to three pieces of data.
+ */
+
+static cairo_status_t
+png_write_chunk(
+    cairo_write_func_t write_func
+  , void *closure
+  , const char *type
+  , const uint8_t *a, size_t alen
+  , const uint8_t *b = NULL, size_t blen = 0
+  , const uint8_t *c = NULL, size_t clen = 0) {
+  cairo_status_t status;
+  uint8_t header[8];
+  size_t len = alen + blen + clen;
+  png_save_uint_32(header, len);
+  memcpy(header + 4, type, 4);
+
+  uLong crc = crc32(0, NULL, 0);
+  crc = crc32(crc, header + 4, 4);
+  if (alen) crc = crc32(crc, a, alen);
+  if (blen) crc = crc32(crc, b, blen);
+  if (clen) crc = crc32(crc, c, clen);
+  uint8_t trailer[4];
+  png_save_uint_32(trailer, crc);
+
+  if ((status = write_func(closure, header, 8))) return status;
+  if (alen && (status = write_func(closure, a, alen))) return status;
+  if (blen && (status = write_func(closure, b, blen))) return status;
+  if (clen && (status = write_func(closure, c, clen))) return status;
+  return write_func(closure, trailer, 4);
+}
+
+/*
+ * Compress with `stripes` threads, writing the chunks ourselves.
+ */
+
+static cairo_status_t
+write_png_parallel(
+    cairo_surface_t *surface
+  , const png_options_t *options
+  , int color_type
+  , int nstripes
+  , cairo_write_func_t write_func
+  , void *closure) {
+  png_encoder_t enc;
+  enc.options = options;
+  enc.color_type = color_type;
+  enc.data = cairo_image_surface_get_data(surface);
+  enc.width = cairo_image_surface_get_width(surface);
+  enc.height = cairo_image_surface_get_height(surface);
+  enc.stride = cairo_image_surface_get_stride(surface);
+  enc.bpp = png_color_type_bpp(color_type);
+  enc.rowbytes = enc.width * enc.bpp;
+
+  png_stripe_t *stripes = (png_stripe_t *) calloc(nstripes, sizeof(png_stripe_t));
+  if (!stripes) return CAIRO_STATUS_NO_MEMORY;
+  enc.stripes = stripes;
+
+  for (int i = 0; i < nstripes; ++i) {
+    png_stripe_t *stripe = &stripes[i];
+    stripe->enc = &enc;
+    stripe->y0 = (int) ((long long) enc.height * i / nstripes);
+    stripe->y1 = (int) ((long long) enc.height * (i + 1) / nstripes);
+    stripe->last = i == nstripes - 1;
+    stripe->status = CAIRO_STATUS_NO_MEMORY;
+  }
+
+  // the calling thread encodes the last stripe itself,
+  // and those no thread could be created for
+  int started = 0;
+  while (started < nstripes - 1
+    && 0 == pthread_create(&stripes[started].thread, NULL, png_stripe_encode, &stripes[started]))
+    ++started;
+  for (int i = started; i < nstripes; ++i)
+    png_stripe_encode(&stripes[i]);
+
+  for (int i = 0; i < started; ++i)
+    pthread_join(stripes[i].thread, NULL);
+
+  cairo_status_t status = CAIRO_STATUS_SUCCESS;
+  for (int i = 0; !status && i < nstripes; ++i)
+    status = stripes[i].status;
+
+  if (!status) {
+    static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    uint8_t ihdr[13];
+    png_save_uint_32(ihdr, enc.width);
+    png_save_uint_32(ihdr + 4, enc.height);
+    ihdr[8] = 8;
+    ihdr[9] = color_type;
+    ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+    ihdr[11] = PNG_FILTER_TYPE_BASE;
+    ihdr[12] = PNG_INTERLACE_NONE;
+
+    // zlib header, FLEVEL as zlib would set it
+    int level = options->compression_level;
+    int flevel = level < 0 || 6 == level
+      ? 2
+      : level < 2 ? 0 : level < 6 ? 1 : 3;
+    uint8_t zhead[2] = { 0x78, (uint8_t) (flevel << 6) };
+    zhead[1] += 31 - (zhead[0] * 256 + zhead[1]) % 31;
+
+    uLong adler = stripes[0].adler;
+    for (int i = 1; i < nstripes; ++i)
+      adler = adler32_combine(adler, stripes[i].adler, stripes[i].in_len);
+    uint8_t ztail[4];
+    png_save_uint_32(ztail, adler);
+
+    status = write_func(closure, signature, 8);
+    if (!status) status = png_write_chunk(write_func, closure, "IHDR", ihdr, 13);
+    for (int i = 0; !status && i < nstripes; ++i) {
+      png_stripe_t *stripe = &stripes[i];
+      status = png_write_chunk(write_func, closure, "IDAT"
+        , zhead, 0 == i ? 2 : 0
+        , stripe->out, stripe->len
+        , ztail, stripe->last ? 4 : 0);
+    }
+    if (!status) status = png_write_chunk(write_func, closure, "IEND", NULL, 0);
+  }
+
+  for (int i = 0; i < nstripes; ++i)
+    free(stripes[i].out);
+  free(stripes);
+  return status;
+}
+
+/*
+ * Compress `surface` as PNG with the given `options`, passing
+ * the output to `write_func`. Large surfaces are compressed on
+ * `options->threads` threads when more than one is requested.
+ * Does not touch V8, so it may run on the thread pool.
+ */
+
+cairo_status_t
+write_to_png_stream(
+    cairo_surface_t *surface
+  , const png_options_t *options
+  , cairo_write_func_t write_func
+  , void *closure) {
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  if (CAIRO_FORMAT_ARGB32 != format && CAIRO_FORMAT_RGB24 != format)
+    return CAIRO_STATUS_INVALID_FORMAT;
+
+  cairo_surface_flush(surface);
+  int height = cairo_image_surface_get_height(surface)
+    , stride = cairo_image_surface_get_stride(surface);
+  if (!height || !cairo_image_surface_get_width(surface))
+    return CAIRO_STATUS_INVALID_SIZE;
+
+  // each stripe should be worth a thread, indexed
+  // images are small enough to deflate on one
+  int stripes = options->palette ? 1 : options->threads;
+  long long max = (long long) height * stride / PNG_STRIPE_MIN;
+  if (stripes > max) stripes = (int) max;
+  if (stripes > height) stripes = height;
+
+  // drop the channels the pixels don't use
+  int color_type = options->palette
+    ? PNG_COLOR_TYPE_PALETTE
+    : png_color_type(surface);
+
+  return stripes > 1
+    ? write_png_parallel(surface, options, color_type, stripes, write_func, closure)
+    : write_png_serial(surface, options, color_type, write_func, closure);
+}
@@ -0,0 +1,61 @@
+
+//
+// PNG.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_PNG_H__
+#define __NODE_PNG_H__
+
+#include <stdint.h>
+#include <cairo.h>
+#include <png.h>
+#include <zlib.h>
+
+/*
+ * PNG encoder options.
+ *
+ *   - compression_level  zlib level 0-9
+ *   - filters            PNG_FILTER_* bitmask
+ *   - strategy           zlib strategy, -1 leaves it to libpng
+ *   - threads            compress row stripes on this many threads
+ *   - palette            write an indexed PNG of at most this many colors, 0 for truecolor
+ *   - dither             diffuse the palette's color error
+ *
+ */
+
+typedef struct {
+  int compression_level;
+  int filters;
+  int strategy;
+  int threads;
+  int palette;
+  int dither;
+} png_options_t;
+
+/*
+ * Prototypes.
+ */
+
+void
+png_options_defaults(png_options_t *options);
+
+uint8_t *
+png_filter_select(
+    int filters
+  , const uint8_t *cur
+  , const uint8_t *prev
+  , uint8_t *out
+  , uint8_t *tmp
+  , int len
+  , int bpp);
+
+cairo_status_t
+write_to_png_stream(
+    cairo_surface_t *surface
+  , const png_options_t *options
+  , cairo_write_func_t write_func
+  , void *closure);
+
+#endif /* __NODE_PNG_H__ */
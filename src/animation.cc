@@ -0,0 +1,699 @@
+//
+// animation.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "animation.h"
+#include "PNG.h"
+#include "raw.h"
+
+/*
+ * APNG constants, see https://wiki.mozilla.org/APNG_Specification
+ */
+
+#define APNG_ACTL_OFFSET 33
+#define APNG_DISPOSE_OP_NONE 0
+#define APNG_BLEND_OP_SOURCE 0
+#define APNG_BLEND_OP_OVER 1
+
+/*
+ * GIF constants. The LZW string table is hashed into a
+ * prime number of slots comfortably above its 4096 codes.
+ */
+
+#define GIF_DISPOSE_NONE 1
+#define GIF_DISPOSE_BACKGROUND 2
+#define GIF_REDRAW_CHANGED 0
+#define GIF_REDRAW_CLEARED 1
+#define GIF_REDRAW_ALL 2
+#define GIF_MAX_CODE 4096
+#define GIF_HASH_SIZE 8191
+
+/*
+ * Packed LZW codes, flushed in sub-blocks of up to 255 bytes.
+ */
+
+typedef struct {
+  animation_t *anim;
+  uint32_t acc;
+  int nbits;
+  uint8_t block[256];
+} gif_bits_t;
+
+/*
+ * Byte order helpers.
+ */
+
+static inline void
+put_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline void
+put_be16(uint8_t *p, unsigned v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static inline void
+put_le16(uint8_t *p, unsigned v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+/*
+ * Append `len` bytes to the output. Failures are sticky,
+ * later writes are dropped once `anim->status` is set.
+ */
+
+static void
+animation_write(animation_t *anim, const void *buf, size_t len) {
+  if (anim->status) return;
+  if (anim->len + len > anim->max_len) {
+    size_t max = anim->max_len ? anim->max_len : 4096;
+    while (max < anim->len + len) max *= 2;
+    uint8_t *data = (uint8_t *) realloc(anim->data, max);
+    if (!data) {
+      anim->status = CAIRO_STATUS_NO_MEMORY;
+      return;
+    }
+    anim->data = data;
+    anim->max_len = max;
+  }
+  memcpy(anim->data + anim->len, buf, len);
+  anim->len += len;
+}
+
+/*
+ * Write a PNG chunk of `type` whose data is `prefix`
+ * followed by `data`.
+ */
+
+static void
+apng_chunk(
+    animation_t *anim
+  , const char *type
+  , const uint8_t *prefix
+  , size_t prefix_len
+  , const uint8_t *data
+  , size_t len) {
+  uint8_t head[8], tail[4];
+  put_be32(head, prefix_len + len);
+  memcpy(head + 4, type, 4);
+  uLong crc = crc32(0, head + 4, 4);
+  if (prefix_len) crc = crc32(crc, prefix, prefix_len);
+  if (len) crc = crc32(crc, data, len);
+  put_be32(tail, crc);
+  animation_write(anim, head, 8);
+  if (prefix_len) animation_write(anim, prefix, prefix_len);
+  if (len) animation_write(anim, data, len);
+  animation_write(anim, tail, 4);
+}
+
+/*
+ * Recompute the CRC of the chunk at `offset` after patching it.
+ */
+
+static void
+apng_patch_crc(animation_t *anim, size_t offset) {
+  uint8_t *chunk = anim->data + offset;
+  uint32_t len = (uint32_t) chunk[0] << 24 | chunk[1] << 16 | chunk[2] << 8 | chunk[3];
+  put_be32(chunk + 8 + len, crc32(0, chunk + 4, len + 4));
+}
+
+/*
+ * Store `ms` as an fcTL delay fraction, falling back to
+ * centiseconds when milliseconds overflow 16 bits.
+ */
+
+static void
+apng_delay(unsigned ms, uint8_t *p) {
+  if (ms <= 0xffff) {
+    put_be16(p, ms);
+    put_be16(p + 2, 1000);
+  } else {
+    unsigned cs = (ms + 5) / 10;
+    put_be16(p, cs > 0xffff ? 0xffff : cs);
+    put_be16(p + 2, 100);
+  }
+}
+
+/*
+ * GIF delays are in centiseconds.
+ */
+
+static unsigned
+gif_delay(unsigned ms) {
+  unsigned cs = (ms + 5) / 10;
+  return cs > 0xffff ? 0xffff : cs;
+}
+
+/*
+ * Write the signature, IHDR and an acTL whose frame
+ * count is patched in by animation_finish().
+ */
+
+static void
+apng_header(animation_t *anim) {
+  static const uint8_t sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  uint8_t ihdr[13], actl[8];
+  put_be32(ihdr, anim->options.width);
+  put_be32(ihdr + 4, anim->options.height);
+  ihdr[8] = 8;
+  ihdr[9] = 6; // RGBA
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+  put_be32(actl, 0);
+  put_be32(actl + 4, anim->options.loop);
+  animation_write(anim, sig, 8);
+  apng_chunk(anim, "IHDR", NULL, 0, ihdr, 13);
+  apng_chunk(anim, "acTL", NULL, 0, actl, 8);
+}
+
+/*
+ * Write the box (x, y, w, h) of `data` as an fcTL followed by
+ * the IDAT of the default image or an fdAT. When blending
+ * over the previous frame, pixels that did not change are
+ * written fully transparent so they compress to nothing.
+ */
+
+static void
+apng_frame(animation_t *anim, uint8_t *data, int stride, int x, int y, int w, int h, int blend) {
+  int width = anim->options.width
+    , rowbytes = w * 4;
+  uint8_t fctl[26];
+  put_be32(fctl, anim->sequence++);
+  put_be32(fctl + 4, w);
+  put_be32(fctl + 8, h);
+  put_be32(fctl + 12, x);
+  put_be32(fctl + 16, y);
+  apng_delay(anim->delay, fctl + 20);
+  fctl[24] = APNG_DISPOSE_OP_NONE;
+  fctl[25] = blend;
+  anim->control = anim->len;
+  apng_chunk(anim, "fcTL", NULL, 0, fctl, 26);
+  if (anim->status) return;
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (Z_OK != deflateInit(&zs, anim->options.compression_level)) {
+    anim->status = CAIRO_STATUS_NO_MEMORY;
+    return;
+  }
+
+  size_t bound = deflateBound(&zs, (uLong) (rowbytes + 1) * h);
+  uint8_t *rows = (uint8_t *) calloc(2, rowbytes)
+    , *filtered = (uint8_t *) malloc(2 * (rowbytes + 1))
+    , *out = (uint8_t *) malloc(bound);
+
+  if (rows && filtered && out) {
+    uint8_t *cur = rows, *prev = rows + rowbytes;
+    zs.next_out = out;
+    zs.avail_out = bound;
+    for (int r = 0; r < h; ++r) {
+      const uint32_t *src = (const uint32_t *) (data + (y + r) * stride) + x;
+      raw_convert_row(src, cur, w, RAW_FORMAT_RGBA);
+      if (APNG_BLEND_OP_OVER == blend) {
+        const uint32_t *old = anim->prev + (y + r) * width + x;
+        for (int i = 0; i < w; ++i)
+          if (src[i] == old[i]) memset(cur + i * 4, 0, 4);
+      }
+
+      uint8_t *row = png_filter_select(
+          PNG_ALL_FILTERS
+        , cur
+        , prev
+        , filtered
+        , filtered + rowbytes + 1
+        , rowbytes
+        , 4);
+      zs.next_in = row;
+      zs.avail_in = rowbytes + 1;
+      deflate(&zs, r == h - 1 ? Z_FINISH : Z_NO_FLUSH);
+
+      uint8_t *tmp = cur;
+      cur = prev;
+      prev = tmp;
+    }
+
+    if (anim->frames) {
+      uint8_t seq[4];
+      put_be32(seq, anim->sequence++);
+      apng_chunk(anim, "fdAT", seq, 4, out, zs.total_out);
+    } else {
+      apng_chunk(anim, "IDAT", NULL, 0, out, zs.total_out);
+    }
+  } else {
+    anim->status = CAIRO_STATUS_NO_MEMORY;
+  }
+
+  deflateEnd(&zs);
+  free(rows);
+  free(filtered);
+  free(out);
+}
+
+/*
+ * Append `code` of `bits` bits.
+ */
+
+static void
+gif_put_code(gif_bits_t *b, int code, int bits) {
+  b->acc |= (uint32_t) code << b->nbits;
+  b->nbits += bits;
+  while (b->nbits >= 8) {
+    b->block[++b->block[0]] = b->acc;
+    b->acc >>= 8;
+    b->nbits -= 8;
+    if (255 == b->block[0]) {
+      animation_write(b->anim, b->block, 256);
+      b->block[0] = 0;
+    }
+  }
+}
+
+/*
+ * Flush the remaining bits and the block terminator.
+ */
+
+static void
+gif_flush_bits(gif_bits_t *b) {
+  if (b->nbits) gif_put_code(b, 0, 8 - b->nbits);
+  if (b->block[0]) animation_write(b->anim, b->block, b->block[0] + 1);
+  uint8_t end = 0;
+  animation_write(b->anim, &end, 1);
+}
+
+/*
+ * LZW compress `n` palette indices as GIF image data. Codes
+ * widen as the decoder's table grows, and once all 4096 are
+ * taken a clear code starts over.
+ */
+
+static void
+gif_lzw(animation_t *anim, const uint8_t *indices, size_t n, int min_bits) {
+  int clear = 1 << min_bits
+    , eoi = clear + 1
+    , next = clear + 2
+    , bits = min_bits + 1;
+  int32_t *keys = (int32_t *) malloc(GIF_HASH_SIZE * sizeof(int32_t));
+  uint16_t *codes = (uint16_t *) malloc(GIF_HASH_SIZE * sizeof(uint16_t));
+  if (!keys || !codes) {
+    anim->status = CAIRO_STATUS_NO_MEMORY;
+    free(keys);
+    free(codes);
+    return;
+  }
+  memset(keys, 0xff, GIF_HASH_SIZE * sizeof(int32_t));
+
+  uint8_t size = min_bits;
+  animation_write(anim, &size, 1);
+
+  gif_bits_t b;
+  b.anim = anim;
+  b.acc = 0;
+  b.nbits = 0;
+  b.block[0] = 0;
+  gif_put_code(&b, clear, bits);
+
+  int prefix = indices[0];
+  for (size_t i = 1; i < n; ++i) {
+    int c = indices[i];
+    int32_t key = prefix << 8 | c;
+    unsigned h = ((unsigned) c << 12 ^ prefix) % GIF_HASH_SIZE;
+    while (keys[h] != -1 && keys[h] != key)
+      if (++h == GIF_HASH_SIZE) h = 0;
+    if (keys[h] == key) {
+      prefix = codes[h];
+      continue;
+    }
+
+    gif_put_code(&b, prefix, bits);
+    if (next < GIF_MAX_CODE) {
+      // the decoder widens once its table reaches 1 << bits
+      if (next >= 1 << bits) ++bits;
+      keys[h] = key;
+      codes[h] = next++;
+    } else {
+      gif_put_code(&b, clear, bits);
+      memset(keys, 0xff, GIF_HASH_SIZE * sizeof(int32_t));
+      next = clear + 2;
+      bits = min_bits + 1;
+    }
+    prefix = c;
+  }
+
+  gif_put_code(&b, prefix, bits);
+  if (next >= 1 << bits && bits < 12) ++bits;
+  gif_put_code(&b, eoi, bits);
+  gif_flush_bits(&b);
+
+  free(keys);
+  free(codes);
+}
+
+/*
+ * Bits needed for a color table of `count` entries.
+ */
+
+static int
+gif_table_bits(int count) {
+  int bits = 1;
+  while ((1 << bits) < count) ++bits;
+  return bits;
+}
+
+/*
+ * Write `palette` as a color table of 1 << `bits` entries.
+ */
+
+static void
+gif_color_table(animation_t *anim, const palette_t *palette, int bits) {
+  uint8_t table[256 * 3];
+  int n = 1 << bits;
+  memset(table, 0, n * 3);
+  for (int i = 0; i < palette->count; ++i)
+    memcpy(table + i * 3, palette->rgba[i], 3);
+  animation_write(anim, table, n * 3);
+}
+
+/*
+ * Write the header, logical screen, optional global color
+ * table and the NETSCAPE2.0 loop extension.
+ */
+
+static void
+gif_header(animation_t *anim, const palette_t *global) {
+  uint8_t lsd[7];
+  int bits = global ? gif_table_bits(global->count + 1) : 1;
+  put_le16(lsd, anim->options.width);
+  put_le16(lsd + 2, anim->options.height);
+  lsd[4] = (global ? 0x80 : 0) | 0x70 | (bits - 1);
+  lsd[5] = lsd[6] = 0;
+  animation_write(anim, "GIF89a", 6);
+  animation_write(anim, lsd, 7);
+  if (global) gif_color_table(anim, global, bits);
+
+  uint8_t loop[19] = {
+      0x21, 0xff, 11
+    , 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0'
+    , 3, 1, 0, 0, 0 };
+  put_le16(loop + 16, anim->options.loop);
+  animation_write(anim, loop, 19);
+}
+
+/*
+ * Write the box (x, y, w, h) of `data` as a graphic control
+ * extension and image. The palette keeps one slot free for a
+ * transparent index, used by translucent pixels and by pixels
+ * that did not change so they compress to long runs. When
+ * `redraw` is GIF_REDRAW_CLEARED the previous frame was disposed
+ * to the background, so its pixels are redrawn even when they
+ * did not change. GIF_REDRAW_ALL draws every pixel, for a frame
+ * written over again in place of the previous one.
+ */
+
+static void
+gif_frame(animation_t *anim, uint8_t *data, int stride, int x, int y, int w, int h, int redraw) {
+  int width = anim->options.width
+    , shared = anim->options.shared_palette;
+  palette_t local, *palette = shared ? &anim->palette : &local;
+  uint8_t *indices;
+  cairo_status_t status;
+
+  cairo_surface_t *view = cairo_image_surface_create_for_data(
+      data + y * stride + x * 4
+    , CAIRO_FORMAT_ARGB32
+    , w
+    , h
+    , stride);
+  if (shared && anim->frames) {
+    status = palette_remap(view, palette, anim->options.dither, &indices);
+  } else {
+    status = palette_quantize(view, anim->options.colors - 1, anim->options.dither, palette, &indices);
+  }
+  cairo_surface_destroy(view);
+  if (status) {
+    anim->status = status;
+    return;
+  }
+
+  int transparent = palette->count
+    , bits = gif_table_bits(palette->count + 1);
+
+  for (int r = 0; r < h; ++r) {
+    uint8_t *out = indices + r * w;
+    const uint32_t *src = (const uint32_t *) (data + (y + r) * stride) + x
+      , *old = anim->prev + (y + r) * width + x;
+    int in_cleared = GIF_REDRAW_CLEARED == redraw
+      && y + r >= anim->y && y + r < anim->y + anim->h;
+    for (int i = 0; i < w; ++i) {
+      if (palette->rgba[out[i]][3] < 128) {
+        out[i] = transparent;
+      } else if (anim->frames && GIF_REDRAW_ALL != redraw && src[i] == old[i]) {
+        if (in_cleared && x + i >= anim->x && x + i < anim->x + anim->w) continue;
+        out[i] = transparent;
+      }
+    }
+  }
+
+  if (!anim->frames) gif_header(anim, shared ? palette : NULL);
+
+  uint8_t gce[8] = { 0x21, 0xf9, 4, GIF_DISPOSE_NONE << 2 | 1, 0, 0, 0, 0 };
+  put_le16(gce + 4, gif_delay(anim->delay));
+  gce[6] = transparent;
+  anim->control = anim->len;
+  animation_write(anim, gce, 8);
+
+  uint8_t desc[10];
+  desc[0] = 0x2c;
+  put_le16(desc + 1, x);
+  put_le16(desc + 3, y);
+  put_le16(desc + 5, w);
+  put_le16(desc + 7, h);
+  desc[9] = shared ? 0 : 0x80 | (bits - 1);
+  animation_write(anim, desc, 10);
+  if (!shared) gif_color_table(anim, palette, bits);
+
+  gif_lzw(anim, indices, (size_t) w * h, bits < 2 ? 2 : bits);
+  free(indices);
+}
+
+/*
+ * Rewrite the delay of the last frame after it was extended.
+ */
+
+static void
+animation_patch_delay(animation_t *anim) {
+  if (ANIMATION_FORMAT_GIF == anim->options.format) {
+    put_le16(anim->data + anim->control + 4, gif_delay(anim->delay));
+  } else {
+    apng_delay(anim->delay, anim->data + anim->control + 8 + 20);
+    apng_patch_crc(anim, anim->control);
+  }
+}
+
+/*
+ * Find the box of pixels that differ from the previous
+ * frame, returns 0 when nothing changed.
+ */
+
+static int
+animation_diff(animation_t *anim, uint8_t *data, int stride, int *bx, int *by, int *bw, int *bh) {
+  int width = anim->options.width
+    , height = anim->options.height
+    , x1 = width, y1 = height, x2 = 0, y2 = 0;
+
+  for (int y = 0; y < height; ++y) {
+    const uint32_t *cur = (const uint32_t *) (data + y * stride)
+      , *old = anim->prev + y * width;
+    if (!memcmp(cur, old, width * 4)) continue;
+    int a = 0, b = width;
+    while (cur[a] == old[a]) ++a;
+    while (cur[b - 1] == old[b - 1]) --b;
+    if (a < x1) x1 = a;
+    if (b > x2) x2 = b;
+    if (y < y1) y1 = y;
+    y2 = y + 1;
+  }
+
+  if (x2 <= x1) return 0;
+  *bx = x1;
+  *by = y1;
+  *bw = x2 - x1;
+  *bh = y2 - y1;
+  return 1;
+}
+
+/*
+ * Initialize `anim` with `options`, writing the file header
+ * where it does not depend on the first frame.
+ */
+
+cairo_status_t
+animation_init(animation_t *anim, const animation_options_t *options) {
+  memset(anim, 0, sizeof(animation_t));
+  anim->options = *options;
+  if (anim->options.colors < 3) anim->options.colors = 3;
+  if (anim->options.colors > 256) anim->options.colors = 256;
+
+  size_t pixels = (size_t) options->width * options->height;
+  if (!pixels) return anim->status = CAIRO_STATUS_INVALID_SIZE;
+  anim->prev = (uint32_t *) malloc(pixels * 4);
+  if (!anim->prev) return anim->status = CAIRO_STATUS_NO_MEMORY;
+
+  if (ANIMATION_FORMAT_APNG == options->format) apng_header(anim);
+  return anim->status;
+}
+
+/*
+ * Free the encoder's buffers.
+ */
+
+void
+animation_destroy(animation_t *anim) {
+  free(anim->prev);
+  free(anim->data);
+  anim->prev = NULL;
+  anim->data = NULL;
+}
+
+/*
+ * Append the ARGB32 `surface` as a frame shown for `delay`
+ * milliseconds. Only the box that changed since the previous
+ * frame is encoded, and a frame identical to the previous one
+ * extends its delay instead. Does not touch V8.
+ */
+
+cairo_status_t
+animation_add_frame(animation_t *anim, cairo_surface_t *surface, unsigned delay) {
+  int width = anim->options.width
+    , height = anim->options.height;
+
+  if (anim->status) return anim->status;
+  if (anim->finished) return CAIRO_STATUS_SURFACE_FINISHED;
+  if (CAIRO_FORMAT_ARGB32 != cairo_image_surface_get_format(surface))
+    return CAIRO_STATUS_INVALID_FORMAT;
+  if (width != cairo_image_surface_get_width(surface)
+    || height != cairo_image_surface_get_height(surface))
+    return CAIRO_STATUS_INVALID_SIZE;
+
+  cairo_surface_flush(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+  int stride = cairo_image_surface_get_stride(surface)
+    , x = 0, y = 0, w = width, h = height
+    , blend = APNG_BLEND_OP_SOURCE
+    , redraw = GIF_REDRAW_CHANGED;
+
+  if (anim->frames) {
+    if (!animation_diff(anim, data, stride, &x, &y, &w, &h)) {
+      anim->delay += delay;
+      animation_patch_delay(anim);
+      return anim->status;
+    }
+
+    // blending over is only exact when every changed pixel is opaque,
+    // and GIF can only clear pixels by disposing of the previous frame
+    int opaque = 1, clears = 0;
+    for (int r = y; r < y + h; ++r) {
+      const uint32_t *cur = (const uint32_t *) (data + r * stride)
+        , *old = anim->prev + r * width;
+      for (int i = x; i < x + w; ++i) {
+        if (cur[i] == old[i]) continue;
+        if (cur[i] >> 24 != 0xff) opaque = 0;
+        if (cur[i] >> 24 < 128 && old[i] >> 24 >= 128) clears = 1;
+      }
+    }
+
+    if (ANIMATION_FORMAT_GIF == anim->options.format) {
+      // disposing of the previous frame only clears its box, so
+      // when pixels outside of it are cleared too that frame is
+      // written over again grown to cover them
+      if (clears) {
+        int cx1 = anim->x, cy1 = anim->y
+          , cx2 = anim->x + anim->w, cy2 = anim->y + anim->h;
+        for (int r = y; r < y + h; ++r) {
+          const uint32_t *cur = (const uint32_t *) (data + r * stride)
+            , *old = anim->prev + r * width;
+          for (int i = x; i < x + w; ++i) {
+            if (cur[i] >> 24 >= 128 || old[i] >> 24 < 128) continue;
+            if (i < cx1) cx1 = i;
+            if (i >= cx2) cx2 = i + 1;
+            if (r < cy1) cy1 = r;
+            if (r >= cy2) cy2 = r + 1;
+          }
+        }
+
+        if (cx1 < anim->x || cy1 < anim->y
+          || cx2 > anim->x + anim->w || cy2 > anim->y + anim->h) {
+          anim->len = anim->control;
+          gif_frame(anim, (uint8_t *) anim->prev, width * 4
+            , cx1, cy1, cx2 - cx1, cy2 - cy1, GIF_REDRAW_ALL);
+          if (anim->status) return anim->status;
+          anim->x = cx1;
+          anim->y = cy1;
+          anim->w = cx2 - cx1;
+          anim->h = cy2 - cy1;
+        }
+
+        anim->data[anim->control + 3] = GIF_DISPOSE_BACKGROUND << 2 | 1;
+        int x2 = x + w > anim->x + anim->w ? x + w : anim->x + anim->w
+          , y2 = y + h > anim->y + anim->h ? y + h : anim->y + anim->h;
+        if (anim->x < x) x = anim->x;
+        if (anim->y < y) y = anim->y;
+        w = x2 - x;
+        h = y2 - y;
+        redraw = GIF_REDRAW_CLEARED;
+      }
+    } else if (opaque) {
+      blend = APNG_BLEND_OP_OVER;
+    }
+  }
+
+  anim->delay = delay;
+  if (ANIMATION_FORMAT_GIF == anim->options.format) {
+    gif_frame(anim, data, stride, x, y, w, h, redraw);
+  } else {
+    apng_frame(anim, data, stride, x, y, w, h, blend);
+  }
+  if (anim->status) return anim->status;
+
+  for (int r = y; r < y + h; ++r)
+    memcpy(anim->prev + r * width + x, data + r * stride + x * 4, w * 4);
+  anim->x = x;
+  anim->y = y;
+  anim->w = w;
+  anim->h = h;
+  ++anim->frames;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Write the trailer, after which `data` holds the whole file.
+ */
+
+cairo_status_t
+animation_finish(animation_t *anim) {
+  if (anim->finished || anim->status) return anim->status;
+  if (!anim->frames) return CAIRO_STATUS_INVALID_SIZE;
+  anim->finished = 1;
+
+  if (ANIMATION_FORMAT_GIF == anim->options.format) {
+    uint8_t trailer = 0x3b;
+    animation_write(anim, &trailer, 1);
+  } else {
+    put_be32(anim->data + APNG_ACTL_OFFSET + 8, anim->frames);
+    apng_patch_crc(anim, APNG_ACTL_OFFSET);
+    apng_chunk(anim, "IEND", NULL, 0, NULL, 0);
+  }
+
+  free(anim->prev);
+  anim->prev = NULL;
+  return anim->status;
+}
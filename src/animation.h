@@ -0,0 +1,85 @@
+//
+// animation.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_ANIMATION_H__
+#define __NODE_ANIMATION_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cairo.h>
+#include "palette.h"
+
+/*
+ * Animation formats.
+ */
+
+typedef enum {
+  ANIMATION_FORMAT_APNG,
+  ANIMATION_FORMAT_GIF
+} animation_format_t;
+
+/*
+ * Animation encoder options.
+ *
+ *   - width, height      size of every frame
+ *   - loop               times to play, 0 loops forever
+ *   - colors             GIF palette size 3-256, one entry is kept for transparency
+ *   - dither             diffuse the GIF palette's color error
+ *   - shared_palette     quantize the first GIF frame and reuse its palette
+ *   - compression_level  APNG zlib level 0-9
+ *
+ */
+
+typedef struct {
+  animation_format_t format;
+  int width;
+  int height;
+  int loop;
+  int colors;
+  int dither;
+  int shared_palette;
+  int compression_level;
+} animation_options_t;
+
+/*
+ * Incremental encoder state. Each frame is compared with
+ * the previous one and only the changed box is encoded,
+ * `data` holds the file written so far.
+ */
+
+typedef struct {
+  animation_options_t options;
+  cairo_status_t status;
+  int frames;
+  int finished;
+  uint32_t *prev;
+  uint8_t *data;
+  size_t len;
+  size_t max_len;
+  size_t control;
+  unsigned delay;
+  unsigned sequence;
+  int x, y, w, h;
+  palette_t palette;
+} animation_t;
+
+/*
+ * Prototypes.
+ */
+
+cairo_status_t
+animation_init(animation_t *anim, const animation_options_t *options);
+
+void
+animation_destroy(animation_t *anim);
+
+cairo_status_t
+animation_add_frame(animation_t *anim, cairo_surface_t *surface, unsigned delay);
+
+cairo_status_t
+animation_finish(animation_t *anim);
+
+#endif /* __NODE_ANIMATION_H__ */
@@ -0,0 +1,103 @@
+//
+// base64.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include "base64.h"
+#include "cpu.h"
+
+#ifdef HAVE_SSSE3
+#include <tmmintrin.h>
+#endif
+
+static const char alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#ifdef HAVE_SSSE3
+
+/*
+ * Encode 12 bytes of `src` into 16 characters, reading 16.
+ * Each 3 byte group is spread over 4 lanes and split into
+ * 6-bit indices with multiplies, the indices then become
+ * characters by adding an offset picked per index range.
+ * See http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html
+ */
+
+TARGET_SSSE3 static inline void
+base64_encode_block(const uint8_t *src, char *dst) {
+  __m128i in = _mm_loadu_si128((const __m128i *) src);
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+  __m128i hi = _mm_mulhi_epu16(
+      _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00))
+    , _mm_set1_epi32(0x04000040));
+  __m128i lo = _mm_mullo_epi16(
+      _mm_and_si128(in, _mm_set1_epi32(0x003f03f0))
+    , _mm_set1_epi32(0x01000010));
+  __m128i indices = _mm_or_si128(hi, lo);
+
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+  __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+
+  const __m128i offsets = _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52
+    , '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62
+    , '/' - 63, 'A', 0, 0);
+  __m128i out = _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+  _mm_storeu_si128((__m128i *) dst, out);
+}
+
+/*
+ * Encode whole blocks of `src` while at least 16 bytes can
+ * be read, returning the number of bytes encoded.
+ */
+
+TARGET_SSSE3 static size_t
+base64_encode_blocks(const uint8_t *src, size_t len, char *dst) {
+  size_t n = 0;
+  for (; n + 16 <= len; n += 12, dst += 16)
+    base64_encode_block(src + n, dst);
+  return n;
+}
+
+#endif
+
+/*
+ * Base64 encode `len` bytes of `src` into `dst`, which must
+ * hold BASE64_ENCODED_LEN(len) characters. No terminating
+ * NUL is written. Does not touch V8.
+ */
+
+void
+base64_encode(const uint8_t *src, size_t len, char *dst) {
+#ifdef HAVE_SSSE3
+  if (cpu_ssse3) {
+    size_t n = base64_encode_blocks(src, len, dst);
+    src += n;
+    dst += n / 3 * 4;
+    len -= n;
+  }
+#endif
+
+  while (len >= 3) {
+    uint32_t v = src[0] << 16 | src[1] << 8 | src[2];
+    dst[0] = alphabet[v >> 18];
+    dst[1] = alphabet[v >> 12 & 63];
+    dst[2] = alphabet[v >> 6 & 63];
+    dst[3] = alphabet[v & 63];
+    src += 3;
+    dst += 4;
+    len -= 3;
+  }
+
+  if (len) {
+    uint32_t v = src[0] << 16 | (len > 1 ? src[1] << 8 : 0);
+    dst[0] = alphabet[v >> 18];
+    dst[1] = alphabet[v >> 12 & 63];
+    dst[2] = len > 1 ? alphabet[v >> 6 & 63] : '=';
+    dst[3] = '=';
+  }
+}
@@ -0,0 +1,26 @@
+//
+// base64.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_BASE64_H__
+#define __NODE_BASE64_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Length of `len` bytes once base64 encoded, with padding.
+ */
+
+#define BASE64_ENCODED_LEN(len) (((len) + 2) / 3 * 4)
+
+/*
+ * Prototypes.
+ */
+
+void
+base64_encode(const uint8_t *src, size_t len, char *dst);
+
+#endif /* __NODE_BASE64_H__ */
@@ -9,19 +9,79 @@
 #define __NODE_CLOSURE_H__
 
 /*
- * PNG stream closure.
+ * Encoder output formats.
  */
 
-typedef struct {
+typedef enum {
+  CANVAS_FORMAT_PNG,
+  CANVAS_FORMAT_JPEG,
+  CANVAS_FORMAT_RAW
+} canvas_format_t;
+
+/*
+ * Additional callback of a merged async encode.
+ */
+
+typedef struct closure_waiter {
+  Persistent<Function> pfn;
+  struct closure_waiter *next;
+} closure_waiter_t;
+
+/*
+ * PNG / JPEG stream closure.
+ */
+
+typedef struct closure {
   Persistent<Function> pfn;
   Handle<Function> fn;
+  closure_waiter_t *waiters;
+  struct closure *next;
+  unsigned generation;
   unsigned len;
   unsigned max_len;
   uint8_t *data;
   Canvas *canvas;
+  snapshot_t *snapshot;
   cairo_status_t status;
+  canvas_format_t format;
+  raw_format_t raw;
+  png_options_t png;
+#ifdef HAVE_JPEG
+  jpeg_options_t jpeg;
+#endif
+  int bufsize;
 } closure_t;
 
+/*
+ * Reset the closure's encoder options to the defaults.
+ */
+
+void
+closure_defaults(closure_t *closure) {
+  closure->format = CANVAS_FORMAT_PNG;
+  closure->raw = RAW_FORMAT_ARGB32;
+  png_options_defaults(&closure->png);
+#ifdef HAVE_JPEG
+  jpeg_options_defaults(&closure->jpeg);
+#endif
+  closure->bufsize = 4096;
+}
+
+/*
+ * Copy the encoder options of `src` to `closure`.
+ */
+
+void
+closure_copy_options(closure_t *closure, const closure_t *src) {
+  closure->format = src->format;
+  closure->raw = src->raw;
+  closure->png = src->png;
+#ifdef HAVE_JPEG
+  closure->jpeg = src->jpeg;
+#endif
+  closure->bufsize = src->bufsize;
+}
+
 /*
  * Initialize the given closure.
  */
@@ -30,22 +90,591 @@ cairo_status_t
 closure_init(closure_t *closure, Canvas *canvas) {
   closure->len = 0;
   closure->canvas = canvas;
+  closure->snapshot = NULL;
+  closure->waiters = NULL;
+  closure->next = NULL;
+  closure->generation = 0;
+  closure_defaults(closure);
   closure->data = (uint8_t *) malloc(closure->max_len = 1024);
   if (!closure->data) return CAIRO_STATUS_NO_MEMORY;
   return CAIRO_STATUS_SUCCESS;
 }
 
 /*
- * Free the given closure's data, 
- * and hint V8 at the memory dealloc.
+ * Check whether two closures produce the same output.
+ */
+
+int
+closure_same_options(const closure_t *a, const closure_t *b) {
+  if (a->format != b->format) return 0;
+  switch (a->format) {
+#ifdef HAVE_JPEG
+    case CANVAS_FORMAT_JPEG:
+      return 0 == memcmp(&a->jpeg, &b->jpeg, sizeof(jpeg_options_t));
+#endif
+    case CANVAS_FORMAT_RAW:
+      return a->raw == b->raw;
+    default:
+      return 0 == memcmp(&a->png, &b->png, sizeof(png_options_t));
+  }
+}
+
+/*
+ * Grow the closure's data to hold at least `len` bytes,
+ * doubling the capacity so appends stay amortized O(1).
+ */
+
+cairo_status_t
+closure_reserve(closure_t *closure, unsigned len) {
+  if (len <= closure->max_len) return CAIRO_STATUS_SUCCESS;
+
+  unsigned max = closure->max_len ? closure->max_len : 1024;
+  while (max < len) {
+    if (max > UINT_MAX / 2) { max = len; break; }
+    max *= 2;
+  }
+
+  uint8_t *data = (uint8_t *) realloc(closure->data, max);
+  if (!data) return CAIRO_STATUS_NO_MEMORY;
+  closure->data = data;
+  closure->max_len = max;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Hand the closure's data over to the caller, shrunk
+ * to fit. The caller must free() it.
+ */
+
+uint8_t *
+closure_detach(closure_t *closure) {
+  uint8_t *data = closure->data;
+  if (closure->len < closure->max_len) {
+    uint8_t *shrunk = (uint8_t *) realloc(data, closure->len ? closure->len : 1);
+    if (shrunk) data = shrunk;
+  }
+  closure->data = NULL;
+  closure->len = closure->max_len = 0;
+  return data;
+}
+
+/*
+ * Free the given closure's data.
  */
 
 void
 closure_destroy(closure_t *closure) {
-  if (closure->len) {
-    free(closure->data);
-    V8::AdjustAmountOfExternalAllocatedMemory(-closure->max_len);
+  if (closure->snapshot) snapshot_unref(closure->snapshot);
+  free(closure->data);
+  closure->data = NULL;
+}
+
+/*
+ * PDF / SVG canvas closure. The document is written to
+ * `closure.data`, or straight to `fd` once streaming to a
+ * file descriptor. When streaming to `closure.pfn` the data
+ * is handed over after each page. `end` is called once the
+ * document has been finished on the thread pool.
+ */
+
+typedef struct {
+  closure_t closure;
+  Persistent<Function> end;
+  int fd;
+  int streaming;
+  int finishing;
+} vector_closure_t;
+
+/*
+ * Initialize the given vector closure.
+ */
+
+cairo_status_t
+vector_closure_init(vector_closure_t *closure, Canvas *canvas) {
+  closure->fd = -1;
+  closure->streaming = 0;
+  closure->finishing = 0;
+  closure->closure.pfn = Persistent<Function>();
+  closure->end = Persistent<Function>();
+  return closure_init(&closure->closure, canvas);
+}
+
+/*
+ * Release the given vector closure's callbacks and data.
+ */
+
+void
+vector_closure_destroy(vector_closure_t *closure) {
+  if (!closure->closure.pfn.IsEmpty()) closure->closure.pfn.Dispose();
+  if (!closure->end.IsEmpty()) closure->end.Dispose();
+  closure_destroy(&closure->closure);
+}
+
+/*
+ * Tile encode closure, `closure` carries the options,
+ * snapshot and callback, `tiles` the output of each of
+ * the canvas's dirty `rects`.
+ */
+
+typedef struct {
+  closure_t closure;
+  dirty_rect_t *rects;
+  closure_t *tiles;
+  int count;
+} tiles_closure_t;
+
+/*
+ * Initialize the given tile closure with a closure per
+ * dirty rect of the canvas, encoded with the options
+ * of `options`.
+ */
+
+cairo_status_t
+tiles_closure_init(tiles_closure_t *closure, Canvas *canvas, const closure_t *options) {
+  closure->rects = NULL;
+  closure->tiles = NULL;
+  closure->count = 0;
+
+  cairo_status_t status = closure_init(&closure->closure, canvas);
+  if (status) return status;
+  closure_copy_options(&closure->closure, options);
+
+  int n = dirty_rects(canvas->dirty(), &closure->rects);
+  if (n < 0) return CAIRO_STATUS_NO_MEMORY;
+  if (!n) return CAIRO_STATUS_SUCCESS;
+
+  closure->tiles = (closure_t *) calloc(n, sizeof(closure_t));
+  if (!closure->tiles) return CAIRO_STATUS_NO_MEMORY;
+  closure->count = n;
+
+  for (int i = 0; i < n; ++i) {
+    if ((status = closure_init(&closure->tiles[i], canvas))) return status;
+    closure_copy_options(&closure->tiles[i], options);
+  }
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Free the given tile closure's rects and data.
+ */
+
+void
+tiles_closure_destroy(tiles_closure_t *closure) {
+  for (int i = 0; i < closure->count; ++i)
+    closure_destroy(&closure->tiles[i]);
+  free(closure->tiles);
+  free(closure->rects);
+  closure_destroy(&closure->closure);
+}
+
+/*
+ * Batch encode closure, `closure` carries the options
+ * and callback, `items` the output of each canvas. The
+ * encoding threads claim items by bumping `next`.
+ */
+
+typedef struct {
+  closure_t closure;
+  closure_t *items;
+  int count;
+  int next;
+  int threads;
+  pthread_mutex_t mutex;
+} batch_closure_t;
+
+/*
+ * Initialize the given batch closure with room for
+ * `count` items, encoded with the options of `options`.
+ */
+
+cairo_status_t
+batch_closure_init(batch_closure_t *closure, int count, const closure_t *options) {
+  closure->items = NULL;
+  closure->count = 0;
+  closure->next = 0;
+  closure->threads = 1;
+  pthread_mutex_init(&closure->mutex, NULL);
+
+  cairo_status_t status = closure_init(&closure->closure, NULL);
+  if (status) return status;
+  closure_copy_options(&closure->closure, options);
+  if (!count) return CAIRO_STATUS_SUCCESS;
+
+  closure->items = (closure_t *) calloc(count, sizeof(closure_t));
+  if (!closure->items) return CAIRO_STATUS_NO_MEMORY;
+  closure->count = count;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Free the given batch closure's items and data.
+ */
+
+void
+batch_closure_destroy(batch_closure_t *closure) {
+  for (int i = 0; i < closure->count; ++i)
+    closure_destroy(&closure->items[i]);
+  free(closure->items);
+  pthread_mutex_destroy(&closure->mutex);
+  closure_destroy(&closure->closure);
+}
+
+/*
+ * Data URL closure, `closure` carries the options, snapshot,
+ * callback and encoded data, `str` the data URL built from
+ * it, without a terminating NUL.
+ */
+
+typedef struct {
+  closure_t closure;
+  char *str;
+  size_t len;
+} dataurl_closure_t;
+
+/*
+ * Initialize the given data URL closure.
+ */
+
+cairo_status_t
+dataurl_closure_init(dataurl_closure_t *closure, Canvas *canvas) {
+  closure->str = NULL;
+  closure->len = 0;
+  return closure_init(&closure->closure, canvas);
+}
+
+/*
+ * Free the given data URL closure's string and data.
+ */
+
+void
+dataurl_closure_destroy(dataurl_closure_t *closure) {
+  free(closure->str);
+  closure->str = NULL;
+  closure_destroy(&closure->closure);
+}
+
+/*
+ * Encode-into closure, output goes to the `max_len` bytes
+ * at `dst` within `buffer`. Once it overflows the whole
+ * output is collected in `closure.data` instead so it can
+ * be cached for the retry. `len` counts every byte written.
+ */
+
+typedef struct {
+  closure_t closure;
+  Persistent<Object> buffer;
+  uint8_t *dst;
+  unsigned max_len;
+  unsigned len;
+} into_closure_t;
+
+/*
+ * Initialize the given encode-into closure.
+ */
+
+cairo_status_t
+into_closure_init(into_closure_t *closure, Canvas *canvas, uint8_t *dst, unsigned max_len) {
+  closure->buffer = Persistent<Object>();
+  closure->dst = dst;
+  closure->max_len = max_len;
+  closure->len = 0;
+  return closure_init(&closure->closure, canvas);
+}
+
+/*
+ * Release the given encode-into closure's buffer and data.
+ */
+
+void
+into_closure_destroy(into_closure_t *closure) {
+  if (!closure->buffer.IsEmpty()) closure->buffer.Dispose();
+  closure_destroy(&closure->closure);
+}
+
+/*
+ * Encoded output of a canvas, valid while the canvas
+ * generation matches `generation`.
+ */
+
+typedef struct encode_cache {
+  closure_t key;
+  unsigned generation;
+  uint8_t *data;
+  unsigned len;
+  struct encode_cache *next;
+} encode_cache_t;
+
+/*
+ * Maximum cached encodes per canvas.
+ */
+
+#ifndef CANVAS_MAX_CACHED
+#define CANVAS_MAX_CACHED 4
+#endif
+
+/*
+ * Find the entry of `head` encoded with the options of
+ * `closure` at `generation`, freeing stale entries.
+ */
+
+encode_cache_t *
+encode_cache_find(encode_cache_t **head, const closure_t *closure, unsigned generation) {
+  encode_cache_t *found = NULL;
+  while (*head) {
+    encode_cache_t *entry = *head;
+    if (entry->generation != generation) {
+      *head = entry->next;
+      free(entry->data);
+      free(entry);
+      continue;
+    }
+    if (!found && closure_same_options(&entry->key, closure)) found = entry;
+    head = &entry->next;
+  }
+  return found;
+}
+
+/*
+ * Cache a copy of the closure's data at `generation`,
+ * evicting the oldest entry when the cache is full.
+ */
+
+void
+encode_cache_add(encode_cache_t **head, const closure_t *closure, unsigned generation) {
+  if (encode_cache_find(head, closure, generation)) return;
+
+  encode_cache_t *entry = (encode_cache_t *) malloc(sizeof(encode_cache_t));
+  if (!entry) return;
+  if (!(entry->data = (uint8_t *) malloc(closure->len))) {
+    free(entry);
+    return;
+  }
+  memcpy(entry->data, closure->data, closure->len);
+  entry->len = closure->len;
+  entry->generation = generation;
+  closure_copy_options(&entry->key, closure);
+  entry->next = *head;
+  *head = entry;
+
+  int n = 0;
+  for (encode_cache_t **e = head; *e; e = &(*e)->next) {
+    if (++n > CANVAS_MAX_CACHED) {
+      free((*e)->data);
+      free(*e);
+      *e = NULL;
+      break;
+    }
+  }
+}
+
+/*
+ * Free every entry of the cache.
+ */
+
+void
+encode_cache_clear(encode_cache_t **head) {
+  while (*head) {
+    encode_cache_t *entry = *head;
+    *head = entry->next;
+    free(entry->data);
+    free(entry);
+  }
+}
+
+#if NODE_VERSION_AT_LEAST(0, 6, 0)
+
+#include <pthread.h>
+
+/*
+ * Chunk of encoded data waiting to be
+ * handed over to the main thread.
+ */
+
+typedef struct stream_chunk {
+  uint8_t *data;
+  unsigned len;
+  unsigned max_len;
+  struct stream_chunk *next;
+} stream_chunk_t;
+
+/*
+ * Stream chunking defaults, the encoder waits for the
+ * consumer once `high_water_mark` bytes are queued.
+ */
+
+#ifndef CANVAS_STREAM_CHUNK_SIZE
+#define CANVAS_STREAM_CHUNK_SIZE (16 * 1024)
+#endif
+
+#ifndef CANVAS_STREAM_HIGH_WATER_MARK
+#define CANVAS_STREAM_HIGH_WATER_MARK (64 * 1024)
+#endif
+
+/*
+ * Async stream closure.
+ *
+ * The encoder runs on a `thread` of its own and coalesces its
+ * output into chunks of `chunk_size` bytes, `async` wakes
+ * up the main thread whenever one fills up or it is `done`,
+ * which then emits them to `closure.pfn` unless `paused`. Once
+ * `queued` reaches `high_water_mark` the encoder waits on
+ * `cond` until the consumer catches up or `cancelled`, which
+ * would tie up a thread pool thread for as long as a slow
+ * consumer takes. `control` is the JS handle pausing and
+ * resuming it.
+ */
+
+typedef struct {
+  closure_t closure;
+  uv_async_t async;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int threaded;
+  stream_chunk_t *head;
+  stream_chunk_t *tail;
+  Persistent<Object> control;
+  unsigned chunk_size;
+  unsigned high_water_mark;
+  unsigned queued;
+  int paused;
+  int cancelled;
+  int done;
+  int ended;
+} stream_closure_t;
+
+/*
+ * Initialize the given stream closure.
+ */
+
+void
+stream_closure_init(stream_closure_t *closure, Canvas *canvas) {
+  closure->closure.len = 0;
+  closure->closure.max_len = 0;
+  closure->closure.data = NULL;
+  closure->closure.canvas = canvas;
+  closure->closure.snapshot = NULL;
+  closure->closure.waiters = NULL;
+  closure->closure.next = NULL;
+  closure->closure.generation = 0;
+  closure->closure.status = CAIRO_STATUS_SUCCESS;
+  closure_defaults(&closure->closure);
+  closure->head = closure->tail = NULL;
+  closure->control = Persistent<Object>();
+  closure->chunk_size = CANVAS_STREAM_CHUNK_SIZE;
+  closure->high_water_mark = CANVAS_STREAM_HIGH_WATER_MARK;
+  closure->queued = 0;
+  closure->paused = closure->cancelled = closure->done = closure->ended = 0;
+  closure->threaded = 0;
+  pthread_mutex_init(&closure->mutex, NULL);
+  pthread_cond_init(&closure->cond, NULL);
+}
+
+/*
+ * Append `data` to the queued chunks, setting `*filled` when
+ * a chunk fills up. Waits first while the consumer is behind,
+ * returning CAIRO_STATUS_WRITE_ERROR once cancelled. Called
+ * from the encoder thread.
+ */
+
+cairo_status_t
+stream_closure_push(stream_closure_t *closure, const uint8_t *data, unsigned len, int *filled) {
+  pthread_mutex_lock(&closure->mutex);
+  while (closure->queued >= closure->high_water_mark && !closure->cancelled)
+    pthread_cond_wait(&closure->cond, &closure->mutex);
+  if (closure->cancelled) {
+    pthread_mutex_unlock(&closure->mutex);
+    return CAIRO_STATUS_WRITE_ERROR;
+  }
+
+  closure->queued += len;
+  while (len) {
+    stream_chunk_t *tail = closure->tail;
+    if (!tail || tail->len == tail->max_len) {
+      // chunk header and data share a single allocation
+      tail = (stream_chunk_t *) malloc(sizeof(stream_chunk_t) + closure->chunk_size);
+      if (!tail) {
+        pthread_mutex_unlock(&closure->mutex);
+        return CAIRO_STATUS_NO_MEMORY;
+      }
+      tail->data = (uint8_t *) (tail + 1);
+      tail->len = 0;
+      tail->max_len = closure->chunk_size;
+      tail->next = NULL;
+      if (closure->tail) {
+        closure->tail->next = tail;
+      } else {
+        closure->head = tail;
+      }
+      closure->tail = tail;
+    }
+
+    unsigned n = tail->max_len - tail->len;
+    if (n > len) n = len;
+    memcpy(tail->data + tail->len, data, n);
+    tail->len += n;
+    data += n;
+    len -= n;
+    if (tail->len == tail->max_len) *filled = 1;
+  }
+
+  pthread_mutex_unlock(&closure->mutex);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Detach and return the oldest chunk once it is full, or
+ * any chunk when the encoder is `done`, waking the encoder.
+ */
+
+stream_chunk_t *
+stream_closure_take(stream_closure_t *closure) {
+  pthread_mutex_lock(&closure->mutex);
+  stream_chunk_t *chunk = closure->head;
+  if (chunk && (chunk->len == chunk->max_len || closure->done)) {
+    closure->head = chunk->next;
+    if (!closure->head) closure->tail = NULL;
+    chunk->next = NULL;
+    closure->queued -= chunk->len;
+    pthread_cond_signal(&closure->cond);
+  } else {
+    chunk = NULL;
   }
+  pthread_mutex_unlock(&closure->mutex);
+  return chunk;
 }
 
+/*
+ * Stop the encoder, it gives up on its next write.
+ */
+
+void
+stream_closure_cancel(stream_closure_t *closure) {
+  pthread_mutex_lock(&closure->mutex);
+  closure->cancelled = 1;
+  pthread_cond_signal(&closure->cond);
+  pthread_mutex_unlock(&closure->mutex);
+}
+
+/*
+ * Free any chunks left in the given stream closure.
+ */
+
+void
+stream_closure_destroy(stream_closure_t *closure) {
+  if (closure->closure.snapshot) snapshot_unref(closure->closure.snapshot);
+  stream_chunk_t *chunk = closure->head;
+  while (chunk) {
+    stream_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  closure->head = closure->tail = NULL;
+  pthread_cond_destroy(&closure->cond);
+  pthread_mutex_destroy(&closure->mutex);
+}
+
+#endif
+
 #endif /* __NODE_CLOSURE_H__ */
@@ -0,0 +1,20 @@
+//
+// cpu.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include "cpu.h"
+
+int cpu_ssse3 = 0;
+
+/*
+ * Detect the CPU features, once when the module loads.
+ */
+
+void
+cpu_init() {
+#ifdef HAVE_SSSE3
+  cpu_ssse3 = 0 != __builtin_cpu_supports("ssse3");
+#endif
+}
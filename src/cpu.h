@@ -0,0 +1,34 @@
+//
+// cpu.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_CPU_H__
+#define __NODE_CPU_H__
+
+/*
+ * SSSE3 code is compiled for that target whatever the build
+ * flags, and only run when cpu_init() found it supported.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) \
+  && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_SSSE3 1
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+
+/*
+ * Detected CPU features.
+ */
+
+extern int cpu_ssse3;
+
+/*
+ * Prototypes.
+ */
+
+void
+cpu_init();
+
+#endif /* __NODE_CPU_H__ */
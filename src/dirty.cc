@@ -0,0 +1,144 @@
+//
+// dirty.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dirty.h"
+
+/*
+ * Initialize tracking for a `width` by `height` surface,
+ * starting out entirely dirty. When the tile bitmap can't
+ * be allocated it tracks an empty surface instead.
+ */
+
+void
+dirty_init(dirty_t *dirty, int width, int height) {
+  dirty->width = width;
+  dirty->height = height;
+  dirty->cols = (width + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+  dirty->rows = (height + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+  dirty->tiles = NULL;
+  if (dirty->cols && dirty->rows) {
+    dirty->tiles = (uint8_t *) malloc(dirty->cols * dirty->rows);
+    if (!dirty->tiles)
+      dirty->width = dirty->height = dirty->cols = dirty->rows = 0;
+  }
+  dirty_mark_all(dirty);
+}
+
+/*
+ * Free the tile bitmap.
+ */
+
+void
+dirty_destroy(dirty_t *dirty) {
+  free(dirty->tiles);
+  dirty->tiles = NULL;
+}
+
+/*
+ * Mark the device-space box (x1, y1, x2, y2) dirty. The
+ * box is rounded outwards and padded by a pixel to cover
+ * antialiasing, then clamped to the surface.
+ */
+
+void
+dirty_mark(dirty_t *dirty, double x1, double y1, double x2, double y2) {
+  if (!(x1 < x2) || !(y1 < y2)) return;
+
+  // clamp in double first, extents may be huge or infinite
+  x1 = floor(x1) - 1; y1 = floor(y1) - 1;
+  x2 = ceil(x2) + 1; y2 = ceil(y2) + 1;
+  if (x1 < 0) x1 = 0;
+  if (y1 < 0) y1 = 0;
+  if (x2 > dirty->width) x2 = dirty->width;
+  if (y2 > dirty->height) y2 = dirty->height;
+  if (x1 >= x2 || y1 >= y2) return;
+
+  int ix1 = x1, iy1 = y1, ix2 = x2, iy2 = y2;
+
+  if (dirty->x2 <= dirty->x1) {
+    dirty->x1 = ix1; dirty->y1 = iy1;
+    dirty->x2 = ix2; dirty->y2 = iy2;
+  } else {
+    if (ix1 < dirty->x1) dirty->x1 = ix1;
+    if (iy1 < dirty->y1) dirty->y1 = iy1;
+    if (ix2 > dirty->x2) dirty->x2 = ix2;
+    if (iy2 > dirty->y2) dirty->y2 = iy2;
+  }
+
+  int c1 = ix1 / CANVAS_TILE_SIZE
+    , c2 = (ix2 - 1) / CANVAS_TILE_SIZE
+    , r1 = iy1 / CANVAS_TILE_SIZE
+    , r2 = (iy2 - 1) / CANVAS_TILE_SIZE;
+
+  for (int r = r1; r <= r2; ++r)
+    memset(dirty->tiles + r * dirty->cols + c1, 1, c2 - c1 + 1);
+}
+
+/*
+ * Mark the whole surface dirty.
+ */
+
+void
+dirty_mark_all(dirty_t *dirty) {
+  if (dirty->tiles) memset(dirty->tiles, 1, dirty->cols * dirty->rows);
+  dirty->x1 = dirty->y1 = 0;
+  dirty->x2 = dirty->tiles ? dirty->width : 0;
+  dirty->y2 = dirty->tiles ? dirty->height : 0;
+}
+
+/*
+ * Mark the whole surface clean.
+ */
+
+void
+dirty_reset(dirty_t *dirty) {
+  if (dirty->tiles) memset(dirty->tiles, 0, dirty->cols * dirty->rows);
+  dirty->x1 = dirty->y1 = dirty->x2 = dirty->y2 = 0;
+}
+
+/*
+ * Collect the dirty tiles into `rects`, merging horizontal
+ * runs within each tile row and clipping edge tiles to the
+ * surface. Returns the number of rects, or -1 when out of
+ * memory. The caller frees `rects`.
+ */
+
+int
+dirty_rects(dirty_t *dirty, dirty_rect_t **rects) {
+  int n = 0;
+  *rects = NULL;
+  if (dirty->x2 <= dirty->x1) return 0;
+
+  // runs are separated by clean tiles, at most ceil(cols / 2) per row
+  int max = dirty->rows * ((dirty->cols + 1) / 2);
+  dirty_rect_t *out = (dirty_rect_t *) malloc(max * sizeof(dirty_rect_t));
+  if (!out) return -1;
+
+  for (int r = 0; r < dirty->rows; ++r) {
+    uint8_t *row = dirty->tiles + r * dirty->cols;
+    int c = 0;
+    while (c < dirty->cols) {
+      if (!row[c]) { ++c; continue; }
+      int start = c;
+      while (c < dirty->cols && row[c]) ++c;
+      dirty_rect_t *rect = &out[n++];
+      rect->x = start * CANVAS_TILE_SIZE;
+      rect->y = r * CANVAS_TILE_SIZE;
+      rect->width = c * CANVAS_TILE_SIZE - rect->x;
+      rect->height = CANVAS_TILE_SIZE;
+      if (rect->x + rect->width > dirty->width)
+        rect->width = dirty->width - rect->x;
+      if (rect->y + rect->height > dirty->height)
+        rect->height = dirty->height - rect->y;
+    }
+  }
+
+  *rects = out;
+  return n;
+}
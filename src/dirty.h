@@ -0,0 +1,65 @@
+//
+// dirty.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_DIRTY_H__
+#define __NODE_DIRTY_H__
+
+#include <stdint.h>
+
+/*
+ * Tile edge in pixels.
+ */
+
+#ifndef CANVAS_TILE_SIZE
+#define CANVAS_TILE_SIZE 64
+#endif
+
+/*
+ * Device-space dirty region of a surface, tracked both
+ * as a bounding box and as a bitmap of touched tiles.
+ * The bounding box is empty when x2 <= x1.
+ */
+
+typedef struct {
+  int width;
+  int height;
+  int cols;
+  int rows;
+  uint8_t *tiles;
+  int x1, y1, x2, y2;
+} dirty_t;
+
+/*
+ * Run of dirty tiles within a tile row, in pixels.
+ */
+
+typedef struct {
+  int x, y, width, height;
+} dirty_rect_t;
+
+/*
+ * Prototypes.
+ */
+
+void
+dirty_init(dirty_t *dirty, int width, int height);
+
+void
+dirty_destroy(dirty_t *dirty);
+
+void
+dirty_mark(dirty_t *dirty, double x1, double y1, double x2, double y2);
+
+void
+dirty_mark_all(dirty_t *dirty);
+
+void
+dirty_reset(dirty_t *dirty);
+
+int
+dirty_rects(dirty_t *dirty, dirty_rect_t **rects);
+
+#endif /* __NODE_DIRTY_H__ */
@@ -0,0 +1,166 @@
+//
+// downscale.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "downscale.h"
+
+/*
+ * Return the largest factor, at most `max_factor`, that keeps
+ * a `width` x `height` image at least `min_width` x `min_height`.
+ * A zero minimum leaves that dimension unconstrained.
+ */
+
+int
+downscale_factor(int width, int height, int min_width, int min_height, int max_factor) {
+  if (min_width <= 0 && min_height <= 0) return 1;
+  int factor = 1;
+  while (factor < max_factor) {
+    int next = factor + 1;
+    if (min_width > 0 && width / next < min_width) break;
+    if (min_height > 0 && height / next < min_height) break;
+    factor = next;
+  }
+  return factor;
+}
+
+/*
+ * Initialize `scale` for `src_width` x `src_height` rows,
+ * allocating the reduced image.
+ */
+
+cairo_status_t
+downscale_init(downscale_t *scale, int src_width, int src_height, int factor) {
+  scale->factor = factor;
+  scale->opaque = 0;
+  scale->src_width = src_width;
+  scale->width = (src_width + factor - 1) / factor;
+  scale->height = (src_height + factor - 1) / factor;
+  scale->rows = 0;
+  scale->y = 0;
+  scale->stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, scale->width);
+  scale->sums = (uint32_t *) calloc(scale->width * 4, sizeof(uint32_t));
+  scale->data = (uint8_t *) malloc(scale->stride * scale->height);
+  if (!scale->sums || !scale->data) {
+    downscale_destroy(scale);
+    return CAIRO_STATUS_NO_MEMORY;
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Average the accumulated rows into the next output row.
+ */
+
+static void
+downscale_flush(downscale_t *scale) {
+  uint32_t *dst = (uint32_t *) (scale->data + scale->stride * scale->y++);
+  uint32_t *sums = scale->sums;
+  int factor = scale->factor;
+
+  for (int x = 0; x < scale->width; ++x, sums += 4) {
+    int cols = scale->src_width - x * factor;
+    if (cols > factor) cols = factor;
+    uint32_t n = cols * scale->rows;
+    uint32_t half = n / 2;
+    dst[x] = (sums[0] + half) / n << 24
+      | (sums[1] + half) / n << 16
+      | (sums[2] + half) / n << 8
+      | (sums[3] + half) / n;
+  }
+
+  memset(scale->sums, 0, scale->width * 4 * sizeof(uint32_t));
+  scale->rows = 0;
+}
+
+/*
+ * Add the next source `row` of ARGB32 pixels.
+ */
+
+void
+downscale_row(downscale_t *scale, const uint32_t *row) {
+  uint32_t *sums = scale->sums;
+  int factor = scale->factor;
+
+  for (int x = 0; x < scale->src_width; x += factor, sums += 4) {
+    int end = x + factor;
+    if (end > scale->src_width) end = scale->src_width;
+    for (int i = x; i < end; ++i) {
+      uint32_t pixel = row[i];
+      sums[0] += scale->opaque ? 255 : pixel >> 24;
+      sums[1] += pixel >> 16 & 0xff;
+      sums[2] += pixel >> 8 & 0xff;
+      sums[3] += pixel & 0xff;
+    }
+  }
+
+  if (++scale->rows == factor) downscale_flush(scale);
+}
+
+/*
+ * Flush the last partial row and wrap the reduced image in a
+ * surface, which takes over the data. Returns NULL on failure.
+ */
+
+static cairo_user_data_key_t downscale_key;
+
+cairo_surface_t *
+downscale_finish(downscale_t *scale) {
+  if (scale->rows) downscale_flush(scale);
+  if (scale->y != scale->height) return NULL;
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+      scale->data
+    , CAIRO_FORMAT_ARGB32
+    , scale->width
+    , scale->height
+    , scale->stride);
+
+  if (cairo_surface_status(surface)
+    || cairo_surface_set_user_data(surface, &downscale_key, scale->data, free)) {
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+
+  scale->data = NULL;
+  return surface;
+}
+
+/*
+ * Free the accumulator, and the data unless it was taken over.
+ */
+
+void
+downscale_destroy(downscale_t *scale) {
+  free(scale->sums);
+  free(scale->data);
+  scale->sums = NULL;
+  scale->data = NULL;
+}
+
+/*
+ * Reduce an already decoded ARGB32 or RGB24 `surface` by `factor`,
+ * returning the new surface or NULL.
+ */
+
+cairo_surface_t *
+downscale_surface(cairo_surface_t *surface, int factor) {
+  downscale_t scale;
+  int width = cairo_image_surface_get_width(surface);
+  int height = cairo_image_surface_get_height(surface);
+  if (downscale_init(&scale, width, height, factor)) return NULL;
+  scale.opaque = CAIRO_FORMAT_RGB24 == cairo_image_surface_get_format(surface);
+
+  cairo_surface_flush(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  for (int y = 0; y < height; ++y)
+    downscale_row(&scale, (uint32_t *) (data + stride * y));
+
+  cairo_surface_t *reduced = downscale_finish(&scale);
+  downscale_destroy(&scale);
+  return reduced;
+}
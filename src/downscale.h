@@ -0,0 +1,64 @@
+//
+// downscale.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_DOWNSCALE_H__
+#define __NODE_DOWNSCALE_H__
+
+#include <stdint.h>
+#include <cairo.h>
+
+/*
+ * Largest reduction applied to PNG and GIF images.
+ */
+
+#ifndef DOWNSCALE_MAX_FACTOR
+#define DOWNSCALE_MAX_FACTOR 64
+#endif
+
+/*
+ * Box filter reducing ARGB32 rows by `factor` in both
+ * directions as they are decoded. Each output pixel
+ * averages a factor x factor box, boxes on the right and
+ * bottom edges may be smaller. `sums` accumulates the
+ * current output row, so only that row is buffered.
+ */
+
+typedef struct {
+  int factor;
+  int opaque;
+  int src_width;
+  int width;
+  int height;
+  int rows;
+  int y;
+  uint32_t *sums;
+  uint8_t *data;
+  int stride;
+} downscale_t;
+
+/*
+ * Prototypes.
+ */
+
+int
+downscale_factor(int width, int height, int min_width, int min_height, int max_factor);
+
+cairo_status_t
+downscale_init(downscale_t *scale, int src_width, int src_height, int factor);
+
+void
+downscale_row(downscale_t *scale, const uint32_t *row);
+
+cairo_surface_t *
+downscale_finish(downscale_t *scale);
+
+void
+downscale_destroy(downscale_t *scale);
+
+cairo_surface_t *
+downscale_surface(cairo_surface_t *surface, int factor);
+
+#endif /* __NODE_DOWNSCALE_H__ */
@@ -0,0 +1,288 @@
+//
+// imagecache.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "imagecache.h"
+
+/*
+ * Hash buckets, a power of two.
+ */
+
+#ifndef IMAGE_CACHE_BUCKETS
+#define IMAGE_CACHE_BUCKETS 1024
+#endif
+
+/*
+ * Cached surface, on both a hash chain and the LRU list.
+ */
+
+typedef struct image_cache_entry {
+  image_cache_key_t key;
+  uint64_t slot;
+  cairo_surface_t *surface;
+  size_t bytes;
+  struct image_cache_entry *prev;
+  struct image_cache_entry *next;
+  struct image_cache_entry *chain;
+} image_cache_entry_t;
+
+/*
+ * Process-wide cache, shared by the main thread and the
+ * thread pool. `head` is the most recently used entry.
+ */
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static image_cache_entry_t *buckets[IMAGE_CACHE_BUCKETS];
+static image_cache_entry_t *head;
+static image_cache_entry_t *tail;
+static image_cache_stats_t stats;
+
+/*
+ * MurmurHash64A of `len` bytes at `data`.
+ */
+
+uint64_t
+image_cache_hash(const uint8_t *data, size_t len) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * m);
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t k;
+    memcpy(&k, data + i, 8);
+    k *= m;
+    k ^= k >> 47;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  if (i < len) {
+    uint64_t k = 0;
+    memcpy(&k, data + i, len - i);
+    h ^= k;
+    h *= m;
+  }
+
+  h ^= h >> 47;
+  h *= m;
+  h ^= h >> 47;
+  return h;
+}
+
+/*
+ * Hash every field of `key`.
+ */
+
+static uint64_t
+key_slot(const image_cache_key_t *key) {
+  uint64_t fields[5] = {
+      key->hash
+    , (uint64_t) key->mtime
+    , (uint64_t) key->size
+    , (uint64_t) key->width
+    , (uint64_t) key->height };
+  return image_cache_hash((const uint8_t *) fields, sizeof(fields));
+}
+
+static int
+key_equal(const image_cache_key_t *a, const image_cache_key_t *b) {
+  if (a->hash != b->hash
+    || a->mtime != b->mtime
+    || a->size != b->size
+    || a->width != b->width
+    || a->height != b->height) return 0;
+  // hashes collide, Buffers match on their bytes
+  if (a->data && b->data) return 0 == memcmp(a->data, b->data, a->size);
+  return a->path && b->path && 0 == strcmp(a->path, b->path);
+}
+
+/*
+ * Find the entry for `key`, the mutex must be held.
+ */
+
+static image_cache_entry_t *
+find(const image_cache_key_t *key, uint64_t slot) {
+  image_cache_entry_t *entry = buckets[slot & (IMAGE_CACHE_BUCKETS - 1)];
+  while (entry) {
+    if (entry->slot == slot && key_equal(&entry->key, key)) return entry;
+    entry = entry->chain;
+  }
+  return NULL;
+}
+
+static void
+lru_unlink(image_cache_entry_t *entry) {
+  if (entry->prev) entry->prev->next = entry->next;
+  else head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void
+lru_push(image_cache_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = head;
+  if (head) head->prev = entry;
+  else tail = entry;
+  head = entry;
+}
+
+/*
+ * Drop `entry`, images still drawing from the
+ * surface keep their own reference.
+ */
+
+static void
+entry_remove(image_cache_entry_t *entry) {
+  image_cache_entry_t **link = &buckets[entry->slot & (IMAGE_CACHE_BUCKETS - 1)];
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+  lru_unlink(entry);
+  stats.entries--;
+  stats.bytes -= entry->bytes;
+  cairo_surface_destroy(entry->surface);
+  free((char *) entry->key.path);
+  free((uint8_t *) entry->key.data);
+  free(entry);
+}
+
+/*
+ * Evict least recently used entries until `bytes` more fit.
+ */
+
+static void
+evict(size_t bytes) {
+  while (tail && stats.bytes + bytes > stats.limit) {
+    entry_remove(tail);
+    stats.evictions++;
+  }
+}
+
+/*
+ * Check if caching is on, a non-zero limit is set.
+ */
+
+int
+image_cache_enabled() {
+  pthread_mutex_lock(&cache_mutex);
+  int enabled = stats.limit > 0;
+  pthread_mutex_unlock(&cache_mutex);
+  return enabled;
+}
+
+/*
+ * Set the byte budget, evicting what no longer fits.
+ * A `limit` of 0 disables the cache.
+ */
+
+void
+image_cache_set_limit(size_t limit) {
+  pthread_mutex_lock(&cache_mutex);
+  stats.limit = limit;
+  evict(0);
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * Return a new reference to the surface cached for
+ * `key`, or NULL on a miss.
+ */
+
+cairo_surface_t *
+image_cache_get(const image_cache_key_t *key) {
+  uint64_t slot = key_slot(key);
+  cairo_surface_t *surface = NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+  image_cache_entry_t *entry = find(key, slot);
+  if (entry) {
+    lru_unlink(entry);
+    lru_push(entry);
+    surface = cairo_surface_reference(entry->surface);
+    stats.hits++;
+  } else {
+    stats.misses++;
+  }
+  pthread_mutex_unlock(&cache_mutex);
+
+  return surface;
+}
+
+/*
+ * Cache a reference to `surface` for `key`, with a copy of the
+ * Buffer data counted towards the limit. The surface must own
+ * its pixels and never be drawn to. Returns 0 when it is not
+ * cached, because it exceeds the limit, is already cached or
+ * memory ran out.
+ */
+
+int
+image_cache_put(const image_cache_key_t *key, cairo_surface_t *surface) {
+  uint64_t slot = key_slot(key);
+  size_t bytes = cairo_image_surface_get_stride(surface)
+    * cairo_image_surface_get_height(surface)
+    + (key->data ? key->size : 0);
+
+  pthread_mutex_lock(&cache_mutex);
+  if (bytes > stats.limit || find(key, slot)) {
+    pthread_mutex_unlock(&cache_mutex);
+    return 0;
+  }
+
+  image_cache_entry_t *entry = (image_cache_entry_t *) malloc(sizeof(image_cache_entry_t));
+  char *path = key->path ? strdup(key->path) : NULL;
+  uint8_t *data = key->data ? (uint8_t *) malloc(key->size) : NULL;
+  if (!entry || (key->path && !path) || (key->data && !data)) {
+    pthread_mutex_unlock(&cache_mutex);
+    free(entry);
+    free(path);
+    free(data);
+    return 0;
+  }
+  if (data) memcpy(data, key->data, key->size);
+
+  evict(bytes);
+  entry->key = *key;
+  entry->key.path = path;
+  entry->key.data = data;
+  entry->slot = slot;
+  entry->surface = cairo_surface_reference(surface);
+  entry->bytes = bytes;
+  entry->chain = buckets[slot & (IMAGE_CACHE_BUCKETS - 1)];
+  buckets[slot & (IMAGE_CACHE_BUCKETS - 1)] = entry;
+  lru_push(entry);
+  stats.entries++;
+  stats.bytes += bytes;
+  pthread_mutex_unlock(&cache_mutex);
+
+  return 1;
+}
+
+/*
+ * Drop every entry, statistics are kept.
+ */
+
+void
+image_cache_clear() {
+  pthread_mutex_lock(&cache_mutex);
+  while (head) entry_remove(head);
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * Copy the current statistics to `out`.
+ */
+
+void
+image_cache_stats(image_cache_stats_t *out) {
+  pthread_mutex_lock(&cache_mutex);
+  *out = stats;
+  pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,69 @@
+//
+// imagecache.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_IMAGE_CACHE_H__
+#define __NODE_IMAGE_CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cairo.h>
+
+/*
+ * Decoded image cache key. Files are keyed by `path`, with
+ * `hash` its hash, and their `mtime` and `size`. Buffers have
+ * a NULL `path` and are keyed by their `size` bytes of `data`,
+ * with `hash` their hash. `width` and `height` are the decodeSize.
+ */
+
+typedef struct {
+  const char *path;
+  const uint8_t *data;
+  uint64_t hash;
+  int64_t mtime;
+  int64_t size;
+  int width;
+  int height;
+} image_cache_key_t;
+
+/*
+ * Cache statistics.
+ */
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t entries;
+  size_t bytes;
+  size_t limit;
+} image_cache_stats_t;
+
+/*
+ * Prototypes.
+ */
+
+uint64_t
+image_cache_hash(const uint8_t *data, size_t len);
+
+int
+image_cache_enabled();
+
+void
+image_cache_set_limit(size_t limit);
+
+cairo_surface_t *
+image_cache_get(const image_cache_key_t *key);
+
+int
+image_cache_put(const image_cache_key_t *key, cairo_surface_t *surface);
+
+void
+image_cache_clear();
+
+void
+image_cache_stats(image_cache_stats_t *stats);
+
+#endif /* __NODE_IMAGE_CACHE_H__ */
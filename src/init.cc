@@ -12,10 +12,13 @@
 #include "CanvasGradient.h"
 #include "CanvasPattern.h"
 #include "CanvasRenderingContext2d.h"
+#include "AnimationEncoder.h"
+#include "cpu.h"
 
 extern "C" void
 init (Handle<Object> target) {
   HandleScope scope;
+  cpu_init();
   Canvas::Initialize(target);
   Image::Initialize(target);
   ImageData::Initialize(target);
@@ -23,5 +26,6 @@ init (Handle<Object> target) {
   Context2d::Initialize(target);
   Gradient::Initialize(target);
   Pattern::Initialize(target);
+  AnimationEncoder::Initialize(target);
   target->Set(String::New("cairoVersion"), String::New(cairo_version_string()));
 }
@@ -0,0 +1,474 @@
+//
+// palette.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "palette.h"
+#include "raw.h"
+
+/*
+ * Median cut works on a histogram of 5 bits per channel,
+ * which also keys the nearest color lookup table.
+ */
+
+#define PALETTE_BITS 5
+#define PALETTE_BINS (1 << (4 * PALETTE_BITS))
+
+/*
+ * Slots of the exact color set, a power of two well
+ * above the 256 colors it may hold.
+ */
+
+#define PALETTE_SET_BITS 10
+#define PALETTE_SET_SIZE (1 << PALETTE_SET_BITS)
+
+/*
+ * Histogram bin, channels hold 5-bit values.
+ */
+
+typedef struct {
+  uint32_t count;
+  uint8_t c[4];
+} palette_bin_t;
+
+/*
+ * Median cut box over bins [begin, end).
+ */
+
+typedef struct {
+  int begin;
+  int end;
+  uint32_t count;
+  int channel;
+  int range;
+} palette_box_t;
+
+/*
+ * Pack / bin RGBA bytes.
+ */
+
+#define PALETTE_PACK(p) \
+  ((uint32_t) (p)[0] << 24 | (uint32_t) (p)[1] << 16 | (uint32_t) (p)[2] << 8 | (p)[3])
+
+#define PALETTE_BIN(p) \
+  (((p)[0] >> 3) << 15 | ((p)[1] >> 3) << 10 | ((p)[2] >> 3) << 5 | ((p)[3] >> 3))
+
+/*
+ * Read a row of the surface as un-premultiplied RGBA.
+ */
+
+static void
+palette_read_row(const uint32_t *src, uint8_t *dst, int width, cairo_format_t format) {
+  if (CAIRO_FORMAT_ARGB32 == format) {
+    raw_convert_row(src, dst, width, RAW_FORMAT_RGBA);
+    return;
+  }
+  for (int x = 0; x < width; ++x, dst += 4) {
+    dst[0] = src[x] >> 16;
+    dst[1] = src[x] >> 8;
+    dst[2] = src[x];
+    dst[3] = 255;
+  }
+}
+
+/*
+ * Order `palette` translucent entries first, filling
+ * `order` with the new index of each old entry.
+ */
+
+static void
+palette_sort(palette_t *palette, uint8_t *order) {
+  uint8_t rgba[256][4];
+  int n = 0;
+  memcpy(rgba, palette->rgba, palette->count * 4);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < palette->count; ++i) {
+      if ((255 == rgba[i][3]) != pass) continue;
+      memcpy(palette->rgba[n], rgba[i], 4);
+      order[i] = n++;
+    }
+    if (!pass) palette->translucent = n;
+  }
+}
+
+/*
+ * Collect the exact colors of the surface when it has no
+ * more than `colors` of them, storing each pixel's entry
+ * in `indices`. Returns 0 when there are too many.
+ */
+
+static int
+palette_exact(
+    cairo_surface_t *surface
+  , int colors
+  , palette_t *palette
+  , uint8_t *indices
+  , uint8_t *row) {
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  int width = cairo_image_surface_get_width(surface)
+    , height = cairo_image_surface_get_height(surface)
+    , stride = cairo_image_surface_get_stride(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+
+  uint32_t keys[PALETTE_SET_SIZE];
+  int16_t slots[PALETTE_SET_SIZE];
+  memset(slots, 0xff, sizeof(slots));
+  palette->count = 0;
+
+  // runs of one color are common, skip the lookup for them
+  uint32_t last = 0;
+  int last_index = -1;
+
+  for (int y = 0; y < height; ++y) {
+    palette_read_row((uint32_t *) (data + y * stride), row, width, format);
+    uint8_t *out = indices + y * width;
+    for (int x = 0; x < width; ++x) {
+      uint32_t color = PALETTE_PACK(row + x * 4);
+      if (color != last || last_index < 0) {
+        unsigned h = (color * 2654435761u) >> (32 - PALETTE_SET_BITS);
+        while (slots[h] >= 0 && keys[h] != color)
+          h = (h + 1) & (PALETTE_SET_SIZE - 1);
+        if (slots[h] < 0) {
+          if (palette->count == colors) return 0;
+          keys[h] = color;
+          slots[h] = palette->count;
+          memcpy(palette->rgba[palette->count++], row + x * 4, 4);
+        }
+        last = color;
+        last_index = slots[h];
+      }
+      out[x] = last_index;
+    }
+  }
+
+  uint8_t order[256];
+  palette_sort(palette, order);
+  for (long i = 0, n = (long) width * height; i < n; ++i)
+    indices[i] = order[indices[i]];
+  return 1;
+}
+
+/*
+ * Find the widest channel of `box`.
+ */
+
+static void
+palette_box_stats(palette_box_t *box, palette_bin_t *bins) {
+  uint8_t lo[4] = { 31, 31, 31, 31 }, hi[4] = { 0, 0, 0, 0 };
+  box->count = 0;
+  for (int i = box->begin; i < box->end; ++i) {
+    box->count += bins[i].count;
+    for (int c = 0; c < 4; ++c) {
+      if (bins[i].c[c] < lo[c]) lo[c] = bins[i].c[c];
+      if (bins[i].c[c] > hi[c]) hi[c] = bins[i].c[c];
+    }
+  }
+  box->channel = 0;
+  box->range = -1;
+  for (int c = 0; c < 4; ++c) {
+    if (hi[c] - lo[c] > box->range) {
+      box->range = hi[c] - lo[c];
+      box->channel = c;
+    }
+  }
+}
+
+/*
+ * Split `box` at the weighted median of its widest channel
+ * into itself and `other`. The bins are counting-sorted on
+ * that channel first, it only has 32 values.
+ */
+
+static void
+palette_box_split(palette_box_t *box, palette_box_t *other, palette_bin_t *bins, palette_bin_t *tmp) {
+  int c = box->channel;
+  int offsets[33] = { 0 };
+  for (int i = box->begin; i < box->end; ++i) ++offsets[bins[i].c[c] + 1];
+  for (int v = 0; v < 32; ++v) offsets[v + 1] += offsets[v];
+  for (int i = box->begin; i < box->end; ++i) tmp[offsets[bins[i].c[c]]++] = bins[i];
+  memcpy(bins + box->begin, tmp, (box->end - box->begin) * sizeof(palette_bin_t));
+
+  uint32_t half = box->count / 2, sum = 0;
+  int split = box->begin;
+  while (split < box->end - 1 && (sum += bins[split].count) < half) ++split;
+  ++split;
+  if (split >= box->end) split = box->end - 1;
+
+  other->begin = split;
+  other->end = box->end;
+  box->end = split;
+  palette_box_stats(box, bins);
+  palette_box_stats(other, bins);
+}
+
+/*
+ * Reduce the histogram `bins` to at most `colors`
+ * entries of `palette` by median cut.
+ */
+
+static cairo_status_t
+palette_median_cut(palette_bin_t *bins, int n, int colors, palette_t *palette) {
+  palette_bin_t *tmp = (palette_bin_t *) malloc(n * sizeof(palette_bin_t));
+  if (!tmp) return CAIRO_STATUS_NO_MEMORY;
+
+  palette_box_t boxes[256];
+  int nboxes = 1;
+  boxes[0].begin = 0;
+  boxes[0].end = n;
+  palette_box_stats(&boxes[0], bins);
+
+  // split the box with the most pixels spread widest
+  while (nboxes < colors) {
+    int best = -1;
+    uint64_t score = 0;
+    for (int i = 0; i < nboxes; ++i) {
+      uint64_t s = (uint64_t) boxes[i].count * boxes[i].range;
+      if (boxes[i].end - boxes[i].begin > 1 && s > score) {
+        score = s;
+        best = i;
+      }
+    }
+    if (best < 0) break;
+    palette_box_split(&boxes[best], &boxes[nboxes++], bins, tmp);
+  }
+
+  free(tmp);
+
+  // weighted mean of each box, 5-bit values widened to 8
+  palette->count = nboxes;
+  for (int i = 0; i < nboxes; ++i) {
+    uint64_t sums[4] = { 0, 0, 0, 0 };
+    for (int j = boxes[i].begin; j < boxes[i].end; ++j)
+      for (int c = 0; c < 4; ++c)
+        sums[c] += (uint64_t) bins[j].count * (bins[j].c[c] << 3 | bins[j].c[c] >> 2);
+    for (int c = 0; c < 4; ++c)
+      palette->rgba[i][c] = (sums[c] + boxes[i].count / 2) / boxes[i].count;
+  }
+
+  uint8_t order[256];
+  palette_sort(palette, order);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Index of the entry of `palette` nearest to `rgba`.
+ */
+
+static int
+palette_nearest(const palette_t *palette, const uint8_t *rgba) {
+  int best = 0;
+  unsigned best_dist = ~0u;
+  for (int i = 0; i < palette->count; ++i) {
+    const uint8_t *p = palette->rgba[i];
+    int dr = p[0] - rgba[0]
+      , dg = p[1] - rgba[1]
+      , db = p[2] - rgba[2]
+      , da = p[3] - rgba[3];
+    unsigned dist = dr * dr + dg * dg + db * db + 2 * da * da;
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = i;
+    }
+  }
+  return best;
+}
+
+/*
+ * Clamp to a byte.
+ */
+
+static inline uint8_t
+palette_clamp(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/*
+ * Map each pixel to its nearest palette entry through a
+ * lookup table of the 5-bit bins, diffusing the color error
+ * Floyd-Steinberg style when `dither` is set. Alpha is never
+ * diffused so edges and fully transparent pixels stay clean.
+ */
+
+static cairo_status_t
+palette_map(
+    cairo_surface_t *surface
+  , const palette_t *palette
+  , int dither
+  , int16_t *lut
+  , uint8_t *indices
+  , uint8_t *row) {
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  int width = cairo_image_surface_get_width(surface)
+    , height = cairo_image_surface_get_height(surface)
+    , stride = cairo_image_surface_get_stride(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+
+  // error of this row and the next, one pixel of padding each side
+  int *err = NULL;
+  if (dither) {
+    err = (int *) calloc(2 * (width + 2) * 3, sizeof(int));
+    if (!err) return CAIRO_STATUS_NO_MEMORY;
+  }
+
+  for (int y = 0; y < height; ++y) {
+    palette_read_row((uint32_t *) (data + y * stride), row, width, format);
+    uint8_t *out = indices + y * width;
+    int *cur = NULL, *next = NULL;
+    if (dither) {
+      cur = err + (y & 1) * (width + 2) * 3 + 3;
+      next = err + (~y & 1) * (width + 2) * 3 + 3;
+      memset(next - 3, 0, (width + 2) * 3 * sizeof(int));
+    }
+
+    for (int x = 0; x < width; ++x) {
+      uint8_t *p = row + x * 4;
+      if (dither && p[3]) {
+        for (int c = 0; c < 3; ++c)
+          p[c] = palette_clamp(p[c] + cur[x * 3 + c] / 16);
+      }
+
+      int bin = PALETTE_BIN(p);
+      if (lut[bin] < 0) lut[bin] = palette_nearest(palette, p);
+      out[x] = lut[bin];
+
+      if (dither && p[3]) {
+        const uint8_t *q = palette->rgba[out[x]];
+        for (int c = 0; c < 3; ++c) {
+          int e = p[c] - q[c];
+          cur[(x + 1) * 3 + c] += e * 7;
+          next[(x - 1) * 3 + c] += e * 3;
+          next[x * 3 + c] += e * 5;
+          next[(x + 1) * 3 + c] += e;
+        }
+      }
+    }
+  }
+
+  free(err);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Quantize the ARGB32 or RGB24 `surface` to at most `colors`
+ * (2-256) colors, storing the palette in `palette` and one
+ * byte per pixel in `*indices`, which the caller must free().
+ *
+ * Surfaces with few enough colors keep them exactly, others
+ * are reduced by median cut over a 5-bit per channel histogram.
+ * Does not touch V8, so it may run on the thread pool.
+ */
+
+cairo_status_t
+palette_quantize(
+    cairo_surface_t *surface
+  , int colors
+  , int dither
+  , palette_t *palette
+  , uint8_t **indices) {
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  int width = cairo_image_surface_get_width(surface)
+    , height = cairo_image_surface_get_height(surface)
+    , stride = cairo_image_surface_get_stride(surface);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+  cairo_status_t status = CAIRO_STATUS_NO_MEMORY;
+
+  if (colors < 2) colors = 2;
+  if (colors > 256) colors = 256;
+  palette->translucent = 0;
+
+  uint8_t *row = (uint8_t *) malloc(width * 4);
+  uint8_t *out = (uint8_t *) malloc((size_t) width * height);
+  uint32_t *counts = NULL;
+  palette_bin_t *bins = NULL;
+  int16_t *lut = NULL;
+  if (!row || !out) goto done;
+
+  if (palette_exact(surface, colors, palette, out, row)) {
+    status = CAIRO_STATUS_SUCCESS;
+    goto done;
+  }
+
+  // histogram
+  counts = (uint32_t *) calloc(PALETTE_BINS, sizeof(uint32_t));
+  if (!counts) goto done;
+  for (int y = 0; y < height; ++y) {
+    palette_read_row((uint32_t *) (data + y * stride), row, width, format);
+    for (int x = 0; x < width; ++x) ++counts[PALETTE_BIN(row + x * 4)];
+  }
+
+  {
+    int n = 0;
+    for (int i = 0; i < PALETTE_BINS; ++i) n += !!counts[i];
+    bins = (palette_bin_t *) malloc(n * sizeof(palette_bin_t));
+    if (!bins) goto done;
+    n = 0;
+    for (int i = 0; i < PALETTE_BINS; ++i) {
+      if (!counts[i]) continue;
+      bins[n].count = counts[i];
+      bins[n].c[0] = i >> 15;
+      bins[n].c[1] = (i >> 10) & 31;
+      bins[n].c[2] = (i >> 5) & 31;
+      bins[n].c[3] = i & 31;
+      ++n;
+    }
+    free(counts);
+    counts = NULL;
+
+    if ((status = palette_median_cut(bins, n, colors, palette))) goto done;
+  }
+
+  status = CAIRO_STATUS_NO_MEMORY;
+  lut = (int16_t *) malloc(PALETTE_BINS * sizeof(int16_t));
+  if (!lut) goto done;
+  memset(lut, 0xff, PALETTE_BINS * sizeof(int16_t));
+  status = palette_map(surface, palette, dither, lut, out, row);
+
+done:
+  free(row);
+  free(counts);
+  free(bins);
+  free(lut);
+  if (status) {
+    free(out);
+    out = NULL;
+  }
+  *indices = out;
+  return status;
+}
+
+/*
+ * Map the ARGB32 or RGB24 `surface` onto the existing
+ * `palette`, storing one byte per pixel in `*indices`,
+ * which the caller must free().
+ */
+
+cairo_status_t
+palette_remap(
+    cairo_surface_t *surface
+  , const palette_t *palette
+  , int dither
+  , uint8_t **indices) {
+  int width = cairo_image_surface_get_width(surface)
+    , height = cairo_image_surface_get_height(surface);
+  cairo_status_t status = CAIRO_STATUS_NO_MEMORY;
+
+  uint8_t *row = (uint8_t *) malloc(width * 4);
+  uint8_t *out = (uint8_t *) malloc((size_t) width * height);
+  int16_t *lut = (int16_t *) malloc(PALETTE_BINS * sizeof(int16_t));
+  if (row && out && lut) {
+    memset(lut, 0xff, PALETTE_BINS * sizeof(int16_t));
+    status = palette_map(surface, palette, dither, lut, out, row);
+  }
+
+  free(row);
+  free(lut);
+  if (status) {
+    free(out);
+    out = NULL;
+  }
+  *indices = out;
+  return status;
+}
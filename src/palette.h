@@ -0,0 +1,43 @@
+//
+// palette.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_PALETTE_H__
+#define __NODE_PALETTE_H__
+
+#include <stdint.h>
+#include <cairo.h>
+
+/*
+ * Un-premultiplied RGBA palette, entries with alpha
+ * below 255 come first so a PNG tRNS chunk stays short.
+ */
+
+typedef struct {
+  int count;
+  int translucent;
+  uint8_t rgba[256][4];
+} palette_t;
+
+/*
+ * Prototypes.
+ */
+
+cairo_status_t
+palette_quantize(
+    cairo_surface_t *surface
+  , int colors
+  , int dither
+  , palette_t *palette
+  , uint8_t **indices);
+
+cairo_status_t
+palette_remap(
+    cairo_surface_t *surface
+  , const palette_t *palette
+  , int dither
+  , uint8_t **indices);
+
+#endif /* __NODE_PALETTE_H__ */
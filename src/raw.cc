@@ -0,0 +1,117 @@
+
+//
+// raw.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "raw.h"
+
+/*
+ * Bytes per pixel of `format`.
+ */
+
+int
+raw_format_bpp(raw_format_t format) {
+  return RAW_FORMAT_RGB == format ? 3 : 4;
+}
+
+/*
+ * Parse "argb32-premul", "rgba", "bgra" or "rgb" into
+ * `format`, returning 0 when `str` is not recognized.
+ */
+
+int
+raw_format_from_string(const char *str, raw_format_t *format) {
+  if (0 == strcmp("argb32-premul", str)) {
+    *format = RAW_FORMAT_ARGB32;
+  } else if (0 == strcmp("rgba", str)) {
+    *format = RAW_FORMAT_RGBA;
+  } else if (0 == strcmp("bgra", str)) {
+    *format = RAW_FORMAT_BGRA;
+  } else if (0 == strcmp("rgb", str)) {
+    *format = RAW_FORMAT_RGB;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Convert a row of ARGB32 pixels to `format`.
+ */
+
+void
+raw_convert_row(const uint32_t *src, uint8_t *dst, int width, raw_format_t format) {
+  if (RAW_FORMAT_ARGB32 == format) {
+    memcpy(dst, src, width * 4);
+    return;
+  }
+
+  int bpp = raw_format_bpp(format);
+  int ri = RAW_FORMAT_BGRA == format ? 2 : 0
+    , bi = 2 - ri;
+
+  for (int x = 0; x < width; ++x) {
+    uint32_t pixel = src[x];
+    uint8_t a = pixel >> 24;
+    uint8_t r = pixel >> 16
+      , g = pixel >> 8
+      , b = pixel;
+
+    if (0 == a) {
+      r = g = b = 0;
+    } else if (255 != a) {
+      r = (r * 255 + a / 2) / a;
+      g = (g * 255 + a / 2) / a;
+      b = (b * 255 + a / 2) / a;
+    }
+
+    dst[ri] = r;
+    dst[1] = g;
+    dst[bi] = b;
+    if (4 == bpp) dst[3] = a;
+    dst += bpp;
+  }
+}
+
+/*
+ * Write the pixels of an ARGB32 `surface` in `format`, tightly
+ * packed, one row at a time. Does not touch V8, so it may run
+ * on the thread pool.
+ */
+
+cairo_status_t
+write_raw_stream(
+    cairo_surface_t *surface
+  , raw_format_t format
+  , cairo_write_func_t write_func
+  , void *closure) {
+  if (CAIRO_FORMAT_ARGB32 != cairo_image_surface_get_format(surface))
+    return CAIRO_STATUS_INVALID_FORMAT;
+
+  cairo_surface_flush(surface);
+  int width = cairo_image_surface_get_width(surface)
+    , height = cairo_image_surface_get_height(surface)
+    , stride = cairo_image_surface_get_stride(surface)
+    , len = width * raw_format_bpp(format);
+  uint8_t *data = cairo_image_surface_get_data(surface);
+  cairo_status_t status = CAIRO_STATUS_SUCCESS;
+
+  // native rows without padding go out in one piece
+  if (RAW_FORMAT_ARGB32 == format && stride == len)
+    return write_func(closure, data, len * height);
+
+  uint8_t *row = (uint8_t *) malloc(len);
+  if (!row) return CAIRO_STATUS_NO_MEMORY;
+
+  for (int y = 0; !status && y < height; ++y) {
+    raw_convert_row((uint32_t *) (data + y * stride), row, width, format);
+    status = write_func(closure, row, len);
+  }
+
+  free(row);
+  return status;
+}
@@ -0,0 +1,51 @@
+
+//
+// raw.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_RAW_H__
+#define __NODE_RAW_H__
+
+#include <stdint.h>
+#include <cairo.h>
+
+/*
+ * Raw pixel layouts.
+ *
+ *   - ARGB32  cairo's native-endian premultiplied pixels
+ *   - RGBA    un-premultiplied, byte order R, G, B, A
+ *   - BGRA    un-premultiplied, byte order B, G, R, A
+ *   - RGB     un-premultiplied, alpha dropped
+ *
+ */
+
+typedef enum {
+  RAW_FORMAT_ARGB32,
+  RAW_FORMAT_RGBA,
+  RAW_FORMAT_BGRA,
+  RAW_FORMAT_RGB
+} raw_format_t;
+
+/*
+ * Prototypes.
+ */
+
+int
+raw_format_bpp(raw_format_t format);
+
+int
+raw_format_from_string(const char *str, raw_format_t *format);
+
+void
+raw_convert_row(const uint32_t *src, uint8_t *dst, int width, raw_format_t format);
+
+cairo_status_t
+write_raw_stream(
+    cairo_surface_t *surface
+  , raw_format_t format
+  , cairo_write_func_t write_func
+  , void *closure);
+
+#endif /* __NODE_RAW_H__ */
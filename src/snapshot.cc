@@ -0,0 +1,148 @@
+
+//
+// snapshot.cc
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+
+/*
+ * Rows copied per lock, keeps the main thread from
+ * waiting on a full frame copy when it wants to draw.
+ */
+
+#define SNAPSHOT_BAND 64
+
+/*
+ * Copy up to `n` more rows from the source, the
+ * snapshot's mutex must be held. Once every row has
+ * been copied the source surface is released.
+ */
+
+static void
+snapshot_copy_rows(snapshot_t *snapshot, int n) {
+  cairo_surface_t *src = snapshot->source;
+  if (!src) return;
+
+  int height = cairo_image_surface_get_height(src);
+
+  if (!snapshot->copy) {
+    snapshot->copy = cairo_image_surface_create(
+        cairo_image_surface_get_format(src)
+      , cairo_image_surface_get_width(src)
+      , height);
+  }
+
+  if (!cairo_surface_status(snapshot->copy)) {
+    int srcStride = cairo_image_surface_get_stride(src)
+      , dstStride = cairo_image_surface_get_stride(snapshot->copy)
+      , len = srcStride < dstStride ? srcStride : dstStride
+      , end = n < height - snapshot->rows
+        ? snapshot->rows + n
+        : height;
+
+    uint8_t *srcData = cairo_image_surface_get_data(src)
+      , *dstData = cairo_image_surface_get_data(snapshot->copy);
+
+    if (srcStride == dstStride) {
+      memcpy(
+          dstData + snapshot->rows * dstStride
+        , srcData + snapshot->rows * srcStride
+        , (end - snapshot->rows) * srcStride);
+    } else {
+      for (int y = snapshot->rows; y < end; ++y)
+        memcpy(dstData + y * dstStride, srcData + y * srcStride, len);
+    }
+
+    snapshot->rows = end;
+  } else {
+    // leave the error surface for the encoder to report
+    snapshot->rows = height;
+  }
+
+  if (snapshot->rows >= height) {
+    cairo_surface_mark_dirty(snapshot->copy);
+    cairo_surface_destroy(src);
+    snapshot->source = NULL;
+  }
+}
+
+/*
+ * Create a snapshot of `source`, no pixels are copied yet.
+ * Must be called on the main thread.
+ */
+
+snapshot_t *
+snapshot_create(cairo_surface_t *source) {
+  snapshot_t *snapshot = (snapshot_t *) malloc(sizeof(snapshot_t));
+  if (!snapshot) return NULL;
+  cairo_surface_flush(source);
+  snapshot->source = cairo_surface_reference(source);
+  snapshot->copy = NULL;
+  snapshot->rows = 0;
+  snapshot->refs = 1;
+  pthread_mutex_init(&snapshot->mutex, NULL);
+  return snapshot;
+}
+
+/*
+ * Add a reference to `snapshot`.
+ */
+
+snapshot_t *
+snapshot_ref(snapshot_t *snapshot) {
+  pthread_mutex_lock(&snapshot->mutex);
+  ++snapshot->refs;
+  pthread_mutex_unlock(&snapshot->mutex);
+  return snapshot;
+}
+
+/*
+ * Drop a reference to `snapshot`, freeing it with the last one.
+ */
+
+void
+snapshot_unref(snapshot_t *snapshot) {
+  pthread_mutex_lock(&snapshot->mutex);
+  int refs = --snapshot->refs;
+  pthread_mutex_unlock(&snapshot->mutex);
+  if (refs) return;
+
+  if (snapshot->source) cairo_surface_destroy(snapshot->source);
+  if (snapshot->copy) cairo_surface_destroy(snapshot->copy);
+  pthread_mutex_destroy(&snapshot->mutex);
+  free(snapshot);
+}
+
+/*
+ * Finish copying the pixels before the source changes.
+ * Nothing is copied when the caller holds the only
+ * reference, since no reader is left to see them.
+ */
+
+void
+snapshot_freeze(snapshot_t *snapshot) {
+  pthread_mutex_lock(&snapshot->mutex);
+  if (snapshot->refs > 1) snapshot_copy_rows(snapshot, INT_MAX);
+  pthread_mutex_unlock(&snapshot->mutex);
+}
+
+/*
+ * Return the snapshot's private surface, copying any
+ * pending rows. Safe to call from the thread pool.
+ */
+
+cairo_surface_t *
+snapshot_surface(snapshot_t *snapshot) {
+  for (;;) {
+    pthread_mutex_lock(&snapshot->mutex);
+    snapshot_copy_rows(snapshot, SNAPSHOT_BAND);
+    bool done = NULL == snapshot->source;
+    pthread_mutex_unlock(&snapshot->mutex);
+    if (done) return snapshot->copy;
+  }
+}
@@ -0,0 +1,51 @@
+
+//
+// snapshot.h
+//
+// Copyright (c) 2010 LearnBoost <tj@learnboost.com>
+//
+
+#ifndef __NODE_SNAPSHOT_H__
+#define __NODE_SNAPSHOT_H__
+
+#include <cairo.h>
+#include <pthread.h>
+
+/*
+ * Copy-on-write snapshot of an image surface.
+ *
+ * Creating a snapshot copies nothing, the pixels are
+ * copied band by band from `source` by whichever thread
+ * reads the snapshot first. When the canvas is about to
+ * draw while the copy is still pending it freezes the
+ * snapshot, finishing the copy before the pixels change.
+ */
+
+typedef struct {
+  cairo_surface_t *source;
+  cairo_surface_t *copy;
+  int rows;
+  int refs;
+  pthread_mutex_t mutex;
+} snapshot_t;
+
+/*
+ * Prototypes.
+ */
+
+snapshot_t *
+snapshot_create(cairo_surface_t *source);
+
+snapshot_t *
+snapshot_ref(snapshot_t *snapshot);
+
+void
+snapshot_unref(snapshot_t *snapshot);
+
+void
+snapshot_freeze(snapshot_t *snapshot);
+
+cairo_surface_t *
+snapshot_surface(snapshot_t *snapshot);
+
+#endif /* __NODE_SNAPSHOT_H__ */
@@ -9,6 +9,114 @@ var Canvas = require('../')
   , assert = require('assert')
   , fs = require('fs');
 
+/**
+ * Decode the LZW image data of a GIF frame.
+ */
+
+function gifLZW(data, min) {
+  var clear = 1 << min
+    , eoi = clear + 1
+    , out = []
+    , acc = 0
+    , nbits = 0
+    , pos = 0
+    , dict, bits, prev;
+
+  function reset() {
+    dict = [];
+    for (var i = 0; i < clear; ++i) dict.push([i]);
+    dict.push(null, null);
+    bits = min + 1;
+    prev = null;
+  }
+
+  reset();
+  while (true) {
+    while (nbits < bits) {
+      if (pos == data.length) return out;
+      acc |= data[pos++] << nbits;
+      nbits += 8;
+    }
+    var code = acc & ((1 << bits) - 1);
+    acc >>= bits;
+    nbits -= bits;
+    if (clear == code) { reset(); continue; }
+    if (eoi == code) return out;
+    var entry = code < dict.length ? dict[code] : prev.concat(prev[0]);
+    out.push.apply(out, entry);
+    if (prev && dict.length < 4096) dict.push(prev.concat(entry[0]));
+    if (dict.length == 1 << bits && bits < 12) ++bits;
+    prev = entry;
+  }
+}
+
+/**
+ * Decode the frames of a GIF, returning each frame's box,
+ * delay, disposal and the RGBA pixels shown once it is drawn.
+ */
+
+function decodeGIF(buf) {
+  var width = buf.readUInt16LE(6)
+    , height = buf.readUInt16LE(8)
+    , pixels = new Buffer(width * height * 4)
+    , pos = 13
+    , frames = []
+    , global, gce, last;
+
+  function table(flags) {
+    var len = 3 << (flags & 7) + 1;
+    pos += len;
+    return buf.slice(pos - len, pos);
+  }
+
+  function blocks() {
+    var ret = [];
+    for (; buf[pos]; pos += buf[pos] + 1) ret.push(buf.slice(pos + 1, pos + 1 + buf[pos]));
+    ++pos;
+    return Buffer.concat(ret);
+  }
+
+  pixels.fill(0);
+  if (buf[10] & 0x80) global = table(buf[10]);
+  while (0x3b != buf[pos]) {
+    if (0x21 == buf[pos++]) {
+      if (0xf9 == buf[pos++]) gce = blocks();
+      else blocks();
+      continue;
+    }
+
+    if (last && 2 == last.dispose) {
+      for (var y = last.y; y < last.y + last.h; ++y)
+        pixels.fill(0, (y * width + last.x) * 4, (y * width + last.x + last.w) * 4);
+    }
+
+    var frame = {
+        x: buf.readUInt16LE(pos)
+      , y: buf.readUInt16LE(pos + 2)
+      , w: buf.readUInt16LE(pos + 4)
+      , h: buf.readUInt16LE(pos + 6)
+      , delay: gce.readUInt16LE(1)
+      , dispose: gce[0] >> 2 & 7 };
+    var flags = buf[pos + 8];
+    pos += 9;
+    var colors = flags & 0x80 ? table(flags) : global
+      , transparent = gce[0] & 1 ? gce[3] : -1
+      , min = buf[pos++]
+      , indices = gifLZW(blocks(), min);
+
+    for (var i = 0; i < frame.w * frame.h; ++i) {
+      if (transparent == indices[i]) continue;
+      var o = ((frame.y + (i / frame.w | 0)) * width + frame.x + i % frame.w) * 4;
+      colors.copy(pixels, o, indices[i] * 3, indices[i] * 3 + 3);
+      pixels[o + 3] = 255;
+    }
+    frame.pixels = new Buffer(pixels.length);
+    pixels.copy(frame.pixels);
+    frames.push(last = frame);
+  }
+  return frames;
+}
+
 console.log();
 console.log('   canvas: %s', Canvas.version);
 console.log('   cairo: %s', Canvas.cairoVersion);
@@ -158,6 +266,118 @@ module.exports = {
     assert.equal('#000000', ctx.fillStyle);
   },
 
+  'test Canvas#createAnimationEncoder()': function(){
+    var canvas = new Canvas(20, 20)
+      , ctx = canvas.getContext('2d');
+
+    ['apng', 'gif'].forEach(function(format){
+      var anim = canvas.createAnimationEncoder({ format: format });
+      assert.equal(format, anim.format);
+      ctx.fillStyle = '#fff';
+      ctx.fillRect(0, 0, 20, 20);
+      anim.addFrame();
+      anim.addFrame(50);
+      ctx.fillStyle = 'red';
+      ctx.fillRect(5, 5, 5, 5);
+      anim.addFrame();
+      assert.equal(2, anim.frames);
+
+      var buf = anim.toBuffer().toString('binary');
+      if ('gif' == format) {
+        assert.equal('GIF89a', buf.slice(0, 6));
+        assert.equal(';', buf[buf.length - 1]);
+        var frames = decodeGIF(anim.toBuffer());
+        assert.equal(2, frames.length);
+        assert.equal(15, frames[0].delay);
+        assert.equal(10, frames[1].delay);
+        assert.deepEqual([5, 5, 5, 5], [frames[1].x, frames[1].y, frames[1].w, frames[1].h]);
+        assert.deepEqual([255, 0, 0, 255], [].slice.call(frames[1].pixels, 6 * 80 + 24, 6 * 80 + 28));
+      } else {
+        assert.equal('PNG', buf.slice(1, 4));
+        assert.ok(-1 != buf.indexOf('acTL'));
+        assert.ok(-1 != buf.indexOf('fdAT'));
+      }
+      assert.throws(function(){
+        anim.addFrame();
+      });
+    });
+
+    // clearing pixels outside the previous frame's box
+    var anim = canvas.createAnimationEncoder({ format: 'gif' })
+      , expected = [];
+
+    function addFrame() {
+      anim.addFrame();
+      expected.push(ctx.getImageData(0, 0, 20, 20).data);
+    }
+
+    ctx.clearRect(0, 0, 20, 20);
+    ctx.fillStyle = 'blue';
+    ctx.fillRect(2, 2, 5, 5);
+    ctx.fillStyle = 'lime';
+    ctx.fillRect(12, 12, 4, 4);
+    addFrame();
+    ctx.fillStyle = 'red';
+    ctx.fillRect(12, 12, 4, 4);
+    addFrame();
+    ctx.clearRect(2, 2, 5, 5);
+    addFrame();
+
+    var frames = decodeGIF(anim.toBuffer());
+    assert.equal(3, frames.length);
+    frames.forEach(function(frame, k){
+      for (var i = 0; i < 20 * 20 * 4; i += 4) {
+        var alpha = expected[k][i + 3] < 128 ? 0 : 255;
+        assert.equal(alpha, frame.pixels[i + 3], 'frame ' + k + ' pixel ' + i / 4);
+        for (var c = 0; alpha && c < 3; ++c)
+          assert.equal(expected[k][i + c], frame.pixels[i + c], 'frame ' + k + ' pixel ' + i / 4);
+      }
+    });
+  },
+
+  'test Canvas#encodeInto()': function(){
+    var canvas = new Canvas(20, 20)
+      , ctx = canvas.getContext('2d');
+    ctx.fillRect(5, 5, 10, 10);
+
+    var png = canvas.toBuffer()
+      , buf = new Buffer(png.length + 10);
+    assert.equal(png.length, canvas.encodeInto(buf, 10));
+    assert.equal(png.toString('base64'), buf.slice(10).toString('base64'));
+
+    assert.equal(20 * 20 * 4, canvas.encodeInto(new Buffer(20 * 20 * 4), 'raw'));
+
+    var err;
+    try {
+      canvas.encodeInto(new Buffer(10), 0, 'png', { compressionLevel: 1 });
+    } catch (e) {
+      err = e;
+    }
+    assert.ok(err instanceof RangeError);
+    assert.equal(canvas.toBuffer('png', { compressionLevel: 1 }).length, err.neededSize);
+  },
+
+  'test Canvas.encodeBatch()': function(done){
+    var canvases = [1, 2, 3].map(function(n){
+      var canvas = new Canvas(10 * n, 10);
+      canvas.getContext('2d').fillRect(0, 0, n, n);
+      return canvas;
+    });
+
+    Canvas.encodeBatch(canvases, function(err, buffers){
+      assert.ok(!err);
+      assert.equal(3, buffers.length);
+      buffers.forEach(function(buf, i){
+        assert.equal('PNG', buf.toString('ascii', 1, 4));
+        assert.equal(canvases[i].toBuffer().toString('base64'), buf.toString('base64'));
+      });
+      assert.throws(function(){
+        Canvas.encodeBatch([new Canvas(10, 10, 'pdf')]);
+      });
+      done();
+    });
+  },
+
   'test Canvas#type': function(){
     var canvas = new Canvas(10, 10);
     assert('image' == canvas.type);
@@ -167,6 +387,89 @@ module.exports = {
     assert('image' == canvas.type);
   },
 
+  'test Canvas#toBuffer() svg': function(){
+    var canvas = new Canvas(20, 20, 'svg')
+      , ctx = canvas.getContext('2d');
+    assert.equal('svg', canvas.type);
+    ctx.fillRect(5, 5, 10, 10);
+    var svg = canvas.toBuffer().toString();
+    assert.ok(-1 != svg.indexOf('<svg'));
+    assert.ok(-1 != svg.indexOf('</svg>'));
+  },
+
+  'test Canvas#endSVG()': function(done){
+    var canvas = new Canvas(20, 20, 'svg')
+      , ctx = canvas.getContext('2d');
+
+    ctx.fillRect(5, 5, 10, 10);
+    canvas.endSVG(function(err, buf){
+      assert.ok(!err);
+      assert.ok(-1 != buf.toString().indexOf('width="20pt"'));
+      done();
+    });
+
+    assert.throws(function(){
+      canvas.height = 40;
+    }, /the document is being finished/);
+    assert.equal(20, canvas.height);
+  },
+
+  'test Canvas#createPDFStream()': function(done){
+    var canvas = new Canvas(200, 200, 'pdf')
+      , ctx = canvas.getContext('2d')
+      , stream = canvas.createPDFStream()
+      , chunks = [];
+
+    stream.on('data', function(chunk){
+      chunks.push(chunk.toString('binary'));
+    });
+
+    stream.on('end', function(){
+      var pdf = chunks.join('');
+      assert.ok(chunks.length > 1);
+      assert.equal('%PDF', pdf.slice(0, 4));
+      assert.ok(-1 != pdf.indexOf('%%EOF'));
+      done();
+    });
+
+    for (var i = 0; i < 3; ++i) {
+      ctx.fillRect(10, 10, 100, 100);
+      ctx.addPage();
+    }
+
+    process.nextTick(function(){
+      assert.throws(function(){
+        canvas.toBuffer();
+      });
+      stream.end();
+    });
+  },
+
+  'test Canvas#endPDF()': function(done){
+    var canvas = new Canvas(200, 200, 'pdf')
+      , ctx = canvas.getContext('2d');
+
+    ctx.fillRect(10, 10, 100, 100);
+    canvas.endPDF(function(err){
+      assert.ok(!err);
+      done();
+    });
+
+    assert.throws(function(){
+      ctx.fillRect(10, 10, 100, 100);
+    }, /the document is being finished/);
+    assert.throws(function(){
+      ctx.drawImage(new Canvas(10, 10), 0, 0);
+    }, /the document is being finished/);
+    assert.throws(function(){
+      ctx.addPage();
+    }, /the document is being finished/);
+    assert.throws(function(){
+      canvas.width = 100;
+    }, /the document is being finished/);
+    assert.equal(200, canvas.width);
+  },
+
   'test Canvas#getContext("2d")': function(){
     var canvas = new Canvas(200, 300)
       , ctx = canvas.getContext('2d');
@@ -319,6 +622,310 @@ module.exports = {
     });
   },
   
+  'test Canvas#createPNGStream()': function(done){
+    var canvas = new Canvas(200, 200)
+      , stream = canvas.createPNGStream()
+      , bufs = [];
+
+    stream.on('data', function(chunk){
+      bufs.push(chunk);
+    });
+
+    stream.on('end', function(){
+      assert.ok(bufs.length);
+      assert.equal('PNG', bufs[0].slice(1,4).toString());
+      done();
+    });
+  },
+
+  'test Canvas#createPNGStream() pause': function(done){
+    var canvas = new Canvas(400, 400)
+      , ctx = canvas.getContext('2d')
+      , stream = canvas.createPNGStream({ chunkSize: 1024, compressionLevel: 0 })
+      , bufs = []
+      , paused = false;
+
+    ctx.fillStyle = '#f00';
+    ctx.fillRect(0,0,400,400);
+
+    stream.on('data', function(chunk){
+      assert.ok(!paused);
+      bufs.push(chunk);
+      if (1 == bufs.length) {
+        stream.pause();
+        paused = true;
+        setTimeout(function(){
+          paused = false;
+          stream.resume();
+        }, 50);
+      }
+    });
+
+    stream.on('end', function(){
+      assert.ok(bufs.length > 1);
+      bufs.slice(0, -1).forEach(function(buf){
+        assert.equal(1024, buf.length);
+      });
+      assert.equal('PNG', bufs[0].slice(1,4).toString());
+      done();
+    });
+  },
+
+  'test Canvas#toBuffer() async snapshot': function(done){
+    var canvas = new Canvas(20, 20)
+      , ctx = canvas.getContext('2d');
+
+    ctx.fillStyle = '#f00';
+    ctx.fillRect(0,0,20,20);
+
+    canvas.toBuffer(function(err, buf){
+      assert.ok(!err);
+      var img = new Canvas.Image
+        , out = new Canvas(20, 20)
+        , octx = out.getContext('2d');
+      img.src = buf;
+      octx.drawImage(img, 0, 0);
+      var data = octx.getImageData(0,0,1,1).data;
+      assert.equal(255, data[0]);
+      assert.equal(0, data[2]);
+      done();
+    });
+
+    // drawing continues while the first frame is encoded
+    ctx.fillStyle = '#00f';
+    ctx.fillRect(0,0,20,20);
+  },
+
+  'test Canvas#toBuffer("png", options)': function(){
+    var canvas = new Canvas(200, 200)
+      , ctx = canvas.getContext('2d');
+
+    ctx.fillStyle = 'red';
+    ctx.fillRect(0,0,100,200);
+
+    var fast = canvas.toBuffer('png', { compressionLevel: 1, filters: Canvas.PNG_FILTER_SUB })
+      , none = canvas.toBuffer('png', { compressionLevel: 0, filters: Canvas.PNG_NO_FILTERS });
+    assert.equal('PNG', fast.slice(1,4).toString());
+    assert.equal('PNG', none.slice(1,4).toString());
+    assert.ok(none.length > 200 * 200 * 4);
+    assert.ok(fast.length < none.length);
+  },
+
+  'test Canvas#toBuffer("png") channel reduction': function(){
+    var canvas = new Canvas(100, 100)
+      , ctx = canvas.getContext('2d');
+
+    // IHDR color type
+    assert.equal(6, canvas.toBuffer('png')[25]);
+
+    ctx.fillStyle = '#808080';
+    ctx.fillRect(0,0,100,100);
+    assert.equal(0, canvas.toBuffer('png')[25]);
+
+    ctx.fillStyle = 'red';
+    ctx.fillRect(0,0,50,50);
+    assert.equal(2, canvas.toBuffer('png')[25]);
+
+    ctx.clearRect(0,0,100,100);
+    ctx.fillStyle = 'rgba(255,255,255,0.5)';
+    ctx.fillRect(0,0,50,50);
+    assert.equal(4, canvas.toBuffer('png')[25]);
+  },
+
+  'test Canvas#toBuffer("png", { palette: 16 })': function(){
+    var canvas = new Canvas(200, 200)
+      , ctx = canvas.getContext('2d');
+
+    ctx.fillStyle = 'red';
+    ctx.fillRect(0,0,100,200);
+
+    var rgba = canvas.toBuffer('png')
+      , indexed = canvas.toBuffer('png', { palette: 16 });
+    assert.equal('PNG', indexed.slice(1,4).toString());
+    // IHDR bit depth and color type, red and transparent fit 1 bit
+    assert.equal(1, indexed[24]);
+    assert.equal(3, indexed[25]);
+    assert.ok(-1 != indexed.toString('binary').indexOf('PLTE'));
+    assert.ok(-1 != indexed.toString('binary').indexOf('tRNS'));
+    assert.ok(indexed.length < rgba.length);
+
+    var gradient = ctx.createLinearGradient(0,0,200,0);
+    gradient.addColorStop(0,'#f00');
+    gradient.addColorStop(1,'#00f');
+    ctx.fillStyle = gradient;
+    ctx.fillRect(0,0,200,200);
+    var dithered = canvas.toBuffer('png', { palette: 16, dither: true });
+    assert.equal(4, dithered[24]);
+    assert.equal(3, dithered[25]);
+    assert.equal(-1, dithered.toString('binary').indexOf('tRNS'));
+  },
+
+  'test Canvas#toBuffer("png", { threads: 4 })': function(done){
+    var canvas = new Canvas(400, 400)
+      , ctx = canvas.getContext('2d');
+
+    ctx.fillStyle = 'red';
+    ctx.fillRect(0,0,400,200);
+
+    canvas.toBuffer('png', { threads: 4 }, function(err, buf){
+      assert.ok(!err);
+      var img = new Canvas.Image
+        , out = new Canvas(400, 400)
+        , octx = out.getContext('2d');
+      img.src = buf;
+      octx.drawImage(img, 0, 0);
+      assert.equal(255, octx.getImageData(0,199,1,1).data[0]);
+      assert.equal(0, octx.getImageData(0,200,1,1).data[3]);
+      done();
+    });
+  },
+
+  'test Canvas#toBuffer() cache': function(done){
+    var canvas = new Canvas(50, 50)
+      , ctx = canvas.getContext('2d')
+      , bufs = [];
+
+    ctx.fillStyle = 'red';
+    ctx.fillRect(0,0,50,50);
+
+    var a = canvas.toBuffer()
+      , b = canvas.toBuffer();
+    assert.ok(a !== b);
+    assert.equal(a.toString('base64'), b.toString('base64'));
+
+    ctx.fillStyle = 'blue';
+    ctx.fillRect(0,0,10,10);
+    assert.notEqual(a.toString('base64'), canvas.toBuffer().toString('base64'));
+
+    // merged into a single encode
+    ctx.fillRect(10,10,10,10);
+    function fn(err, buf){
+      assert.ok(!err);
+      bufs.push(buf.toString('base64'));
+      if (2 == bufs.length) {
+        assert.equal(bufs[0], bufs[1]);
+        done();
+      }
+    }
+    canvas.toBuffer(fn);
+    canvas.toBuffer(fn);
+  },
+
+  'test Canvas#toBuffer("jpeg") async': function(done){
+    var canvas = new Canvas(200, 200);
+    canvas.toBuffer('jpeg', { quality: 80 }, function(err, buf){
+      assert.ok(!err);
+      assert.equal(0xff, buf[0]);
+      assert.equal(0xd8, buf[1]);
+      done();
+    });
+  },
+
+  'test Canvas#toBuffer("jpeg", options)': function(){
+    var canvas = new Canvas(200, 200)
+      , ctx = canvas.getContext('2d');
+
+    ctx.fillStyle = 'red';
+    ctx.fillRect(0,0,100,200);
+
+    function hasMarker(buf, marker) {
+      for (var i = 2; i < buf.length - 1; ++i) {
+        if (0xff == buf[i] && marker == buf[i + 1]) return true;
+      }
+      return false;
+    }
+
+    var baseline = canvas.toBuffer('jpeg')
+      , progressive = canvas.toBuffer('jpeg', {
+          progressive: true
+        , chromaSubsampling: '4:4:4'
+        , restartInterval: 4
+        , dctMethod: 'fast'
+      });
+
+    assert.ok(hasMarker(baseline, 0xc0));
+    assert.ok(!hasMarker(baseline, 0xdd));
+    assert.ok(hasMarker(progressive, 0xc2));
+    assert.ok(hasMarker(progressive, 0xdd));
+  },
+
+  'test Canvas#toBuffer("raw")': function(){
+    var canvas = new Canvas(2, 1)
+      , ctx = canvas.getContext('2d');
+
+    ctx.fillStyle = 'rgba(255,0,0,0.5)';
+    ctx.fillRect(0,0,1,1);
+
+    var rgba = canvas.toBuffer('raw', { format: 'rgba' });
+    assert.equal(8, rgba.length);
+    assert.equal(255, rgba[0]);
+    assert.equal(0, rgba[2]);
+    assert.ok(Math.abs(rgba[3] - 128) <= 1);
+    assert.equal(0, rgba[7]);
+
+    var bgra = canvas.toBuffer('raw', { format: 'bgra' });
+    assert.equal(255, bgra[2]);
+    assert.equal(0, bgra[0]);
+
+    assert.equal(6, canvas.toBuffer('raw', { format: 'rgb' }).length);
+
+    var view = canvas.toBuffer('raw', { format: 'argb32-premul', copy: false });
+    assert.equal(8, view.length);
+    assert.equal(0, view[4] | view[5] | view[6] | view[7]);
+    ctx.fillStyle = 'white';
+    ctx.fillRect(1,0,1,1);
+    assert.equal(255, view[4]);
+
+    var png = canvas.toBuffer().toString('base64');
+    assert.equal(png, canvas.toBuffer().toString('base64'));
+    view[0] = view[1] = view[2] = view[3] = 255;
+    assert.notEqual(png, canvas.toBuffer().toString('base64'));
+
+    assert.throws(function(){
+      canvas.toBuffer('raw', { format: 'yuv' });
+    });
+  },
+
+  'test Canvas#toBuffer("tiles")': function(){
+    var canvas = new Canvas(200, 100)
+      , ctx = canvas.getContext('2d');
+
+    var region = canvas.getDirtyRegion();
+    assert.equal(200, region.width);
+    assert.equal(100, region.height);
+    assert.equal(2, canvas.toBuffer('tiles').length);
+
+    canvas.resetDirty();
+    assert.equal(null, canvas.getDirtyRegion());
+    assert.equal(0, canvas.toBuffer('tiles').length);
+
+    ctx.fillRect(10,10,10,10);
+    ctx.fillRect(70,10,10,10);
+    region = canvas.getDirtyRegion();
+    assert.ok(region.x <= 10 && region.y <= 10);
+    assert.ok(region.x + region.width >= 80);
+    assert.ok(region.y + region.height < 64);
+
+    var tiles = canvas.toBuffer('tiles', { type: 'raw', format: 'rgba' });
+    assert.equal(1, tiles.length);
+    assert.equal(0, tiles[0].x);
+    assert.equal(0, tiles[0].y);
+    assert.equal(128, tiles[0].width);
+    assert.equal(64, tiles[0].height);
+    assert.equal(128 * 64 * 4, tiles[0].buffer.length);
+    assert.equal(255, tiles[0].buffer[(10 * 128 + 10) * 4 + 3]);
+
+    canvas.resetDirty();
+    ctx.clearRect(190,90,5,5);
+    tiles = canvas.toBuffer('tiles');
+    assert.equal(1, tiles.length);
+    assert.equal(128, tiles[0].x);
+    assert.equal(64, tiles[0].y);
+    assert.equal(72, tiles[0].width);
+    assert.equal(36, tiles[0].height);
+    assert.equal('PNG', tiles[0].buffer.slice(1,4).toString());
+  },
+
   'test Canvas#toDataURL()': function(){
     var canvas = new Canvas(200, 200)
       , ctx = canvas.getContext('2d');
@@ -330,13 +937,13 @@ module.exports = {
     assert.ok(0 == canvas.toDataURL().indexOf('data:image/png;base64,'));
     assert.ok(0 == canvas.toDataURL('image/png').indexOf('data:image/png;base64,'));
 
-    var err;
-    try {
-      canvas.toDataURL('image/jpeg');
-    } catch (e) {
-      err = e;
-    }
-    assert.equal('currently only image/png is supported', err.message);
+    assert.ok(0 == canvas.toDataURL('image/jpeg').indexOf('data:image/jpeg;base64,'));
+    var png = canvas.toDataURL().slice('data:image/png;base64,'.length);
+    assert.equal(canvas.toBuffer().toString('base64'), png);
+
+    assert.throws(function(){
+      canvas.toDataURL('image/gif');
+    });
   },
   
   'test Canvas#toDataURL() async': function(){
@@ -353,6 +960,14 @@ module.exports = {
     });
   },
   
+  'test Canvas#toDataURL() async jpeg with quality': function(done){
+    new Canvas(200,200).toDataURL('image/jpeg', 0.5, function(err, str){
+      assert.ok(!err);
+      assert.ok(0 == str.indexOf('data:image/jpeg;base64,'));
+      done();
+    });
+  },
+
   'test Context2d#createImageData(width, height)': function(){
     var canvas = new Canvas(20, 20)
       , ctx = canvas.getContext('2d');
@@ -5,7 +5,8 @@
 
 var Canvas = require('../')
   , Image = Canvas.Image
-  , assert = require('assert');
+  , assert = require('assert')
+  , fs = require('fs');
 
 var png = __dirname + '/fixtures/clock.png';
 
@@ -18,32 +19,50 @@ module.exports = {
     assert.ok(Image instanceof Function);
   },
 
-  'test Image#onload': function(){
-    var img = new Image
-      , n = 0;
+  'test Image#onload': function(done){
+    var img = new Image;
 
     assert.strictEqual(false, img.complete);
     img.onload = function(){
-      ++n;
       assert.equal(img.src, png);
+      assert.strictEqual(true, img.complete);
+      assert.strictEqual(320, img.width);
+      assert.strictEqual(320, img.height);
+      done();
     };
 
     img.onerror = function () {
-      asset.fail('called onerror');
+      assert.fail('called onerror');
     }
 
     img.src = png;
     assert.equal(img.src, png);
+    assert.strictEqual(false, img.complete);
+  },
+
+  'test Image#onload Buffer': function(done){
+    var img = new Image;
+
+    img.onload = function(){
+      assert.strictEqual(true, img.complete);
+      assert.strictEqual(320, img.width);
+      done();
+    };
+
+    img.src = fs.readFileSync(png);
+    assert.strictEqual(false, img.complete);
+    assert.strictEqual(0, img.width);
+  },
+
+  'test Image without onload': function(){
+    var img = new Image;
+    img.src = png;
     assert.strictEqual(true, img.complete);
     assert.strictEqual(320, img.width);
-    assert.strictEqual(320, img.height);
-    assert.equal(1, n);
   },
   
-  'test Image#onerror': function(){
-    var img = new Image
-      , error
-      , n = 0;
+  'test Image#onerror': function(done){
+    var img = new Image;
 
     assert.strictEqual(false, img.complete);
     img.onload = function(){
@@ -51,8 +70,9 @@ module.exports = {
     };
     
     img.onerror = function(err){
-      ++n;
-      error = err;
+      assert.ok(err instanceof Error, 'did not invoke onerror() with error');
+      assert.strictEqual(false, img.complete);
+      done();
     };
 
     try {
@@ -62,19 +82,17 @@ module.exports = {
     }
 
     assert.equal(img.src, png + 's');
-
-    assert.ok(error instanceof Error, 'did not invoke onerror() with error');
-    assert.strictEqual(false, img.complete);
-    assert.equal(1, n);
   },
 
-  'test Image with cmyk jpeg': function () {
-    var img = new Image
-      , n = 0;
+  'test Image with cmyk jpeg': function (done) {
+    var img = new Image;
 
     assert.strictEqual(false, img.complete);
     img.onload = function() {
-      ++n;
+      assert.strictEqual(true, img.complete);
+      assert.strictEqual(190, img.width);
+      assert.strictEqual(45, img.height);
+      done();
     }
 
     img.onerror = function() {
@@ -88,16 +106,10 @@ module.exports = {
     }
 
     assert.equal(img.src, cmyk_jpeg);
-    assert.strictEqual(true, img.complete);
-    assert.strictEqual(190, img.width);
-    assert.strictEqual(45, img.height);
-    assert.equal(1, n);
   },
 
-  'test Image with corrupt jpeg': function () {
-    var img = new Image
-      , error
-      , n = 0;
+  'test Image with corrupt jpeg': function (done) {
+    var img = new Image;
 
     assert.strictEqual(false, img.complete);
     img.onload = function(){
@@ -105,8 +117,9 @@ module.exports = {
     };
     
     img.onerror = function(err){
-      ++n;
-      error = err;
+      assert.ok(err instanceof Error, 'did not invoke onerror() with error');
+      assert.strictEqual(false, img.complete);
+      done();
     };
 
     try {
@@ -116,19 +129,17 @@ module.exports = {
     }
 
     assert.equal(img.src, corrupt_jpeg);
-
-    assert.ok(error instanceof Error, 'did not invoke onerror() with error');
-    assert.strictEqual(false, img.complete);
-    assert.equal(1, n);
   },
 
-  'test Image with troublesome png': function () {
-    var img = new Image
-      , n = 0;
+  'test Image with troublesome png': function (done) {
+    var img = new Image;
 
     assert.strictEqual(false, img.complete);
     img.onload = function() {
-      ++n;
+      assert.strictEqual(true, img.complete);
+      assert.strictEqual(35, img.width);
+      assert.strictEqual(37, img.height);
+      done();
     }
 
     img.onerror = function() {
@@ -142,25 +153,69 @@ module.exports = {
     }
 
     assert.equal(img.src, oom_png);
-    assert.strictEqual(true, img.complete);
-    assert.strictEqual(35, img.width);
-    assert.strictEqual(37, img.height);
-    assert.equal(1, n);
   },
   
-  'test Image#{width,height}': function(){
-    var img = new Image
-      , n = 0;
+  'test Image#decodeSize': function(){
+    var img = new Image;
+    assert.strictEqual(null, img.decodeSize);
+    img.decodeSize = { width: 80, height: 80 };
+    assert.equal(80, img.decodeSize.width);
+    img.src = png;
+    assert.strictEqual(80, img.width);
+    assert.strictEqual(80, img.height);
+
+    var jpeg = new Image;
+    jpeg.decodeSize = { width: 50 };
+    jpeg.src = cmyk_jpeg;
+    assert.strictEqual(95, jpeg.width);
+    assert.strictEqual(23, jpeg.height);
+  },
+
+  'test Image#decodeSize= while decoding': function(done){
+    var img = new Image;
+    img.onload = function(){
+      assert.strictEqual(320, img.width);
+      assert.strictEqual(80, img.decodeSize.width);
+      done();
+    };
+    img.src = png;
+    img.decodeSize = { width: 80, height: 80 };
+  },
+
+  'test Image cache': function(){
+    Image.setCacheLimit(1024 * 1024);
+    var before = Image.getCacheStats()
+      , a = new Image
+      , b = new Image
+      , c = new Image;
+
+    a.src = png;
+    b.src = png;
+    c.src = fs.readFileSync(png);
+    assert.strictEqual(320, b.width);
+    assert.strictEqual(320, c.width);
+
+    var stats = Image.getCacheStats();
+    assert.equal(before.hits + 1, stats.hits);
+    assert.equal(before.misses + 2, stats.misses);
+    assert.equal(2, stats.entries);
+    assert.equal(1024 * 1024, stats.limit);
+
+    Image.clearCache();
+    Image.setCacheLimit(0);
+    assert.equal(0, Image.getCacheStats().bytes);
+  },
+
+  'test Image#{width,height}': function(done){
+    var img = new Image;
     
     assert.strictEqual(0, img.width);
     assert.strictEqual(0, img.height);
     img.onload = function(){
-      ++n;
       assert.strictEqual(320, img.width);
       assert.strictEqual(320, img.height);
+      done();
     };
     img.src = png;
-
-    assert.equal(1, n);
   }
 };